@@ -51,6 +51,7 @@
 #endif
 
 #include <ctype.h>
+#include <limits.h>
 #include <string.h>
 
 char *strstr ();
@@ -78,10 +79,29 @@ char *strstr ();
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <locale.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#if USE_POSIX_THREADS
+# include <pthread.h>
+#endif
+
+/* Annotated listings of many inputs may get rendered in parallel, each in
+   its own memory stream, provided listing state may be kept per thread.  */
+#if USE_POSIX_THREADS && HAVE_OPEN_MEMSTREAM && defined __GNUC__
+# define PARALLEL_LISTINGS 1
+# define THREAD_LOCAL __thread
+#else
+# define PARALLEL_LISTINGS 0
+# define THREAD_LOCAL
+#endif
 
 #include "regex.h"
 #define CHAR_SET_SIZE 256
@@ -104,6 +124,13 @@ char *strstr ();
 #define LTYPE_LINE_FORMAT_OPTION	14
 #define SUPPRESS_COMMON_LINES_OPTION	15
 #define TOLERANCE_OPTION		16
+#define INDEX_OPTION			17
+#define BUILD_SHARD_OPTION		18
+#define MERGE_SHARDS_OPTION		19
+#define NEAR_DUPLICATES_OPTION		20
+#define STATS_OPTION			21
+#define REPORT_OPTION			22
+#define REPETITIONS_OPTION		23
 
 /* The name this program was run with. */
 const char *program_name;
@@ -116,13 +143,13 @@ static int show_version = 0;
 
 /* Other variables.  */
 
-FILE *output_file;		/* file or pipe to which we write output */
+THREAD_LOCAL FILE *output_file; /* file or pipe to which we write output */
 int exit_status = EXIT_SUCCESS;	/* status at end of execution */
 
 /* Options variables.  */
 
 #define OPTION_STRING \
-  "0123ABC::D:F:GHI:J:KL:NO:PQ:RS:TU::VWX:Y:Z:abc::dehijklmnopqrs:tu::vw:xyz"
+  "0123ABC:D:F:GHI:J:KL:NO:PQ:RS:TU:VWX:Y:Z:abc::dehijklmnopqrstu::vw:x:yz"
 /*      BC: D:F: HI:   L:N  P   S:TU:   X:    abc  dehi  l n pqrs:tu  vw:xy  */
 /* The line above gives GNU diff options, for reference.  */
 
@@ -131,6 +158,7 @@ static const struct option long_options[] = {
   {"auto-pager", no_argument, NULL, 'A'},
   {"avoid-wraps", no_argument, NULL, 'm'},
   {"brief", no_argument, NULL, 'q'},
+  {"build-shard", required_argument, NULL, BUILD_SHARD_OPTION},
   {"context", optional_argument, NULL, 'c'},
   {"debugging", no_argument, NULL, '0'},
   {"ed", no_argument, NULL, 'e'},
@@ -141,6 +169,7 @@ static const struct option long_options[] = {
   {"help", no_argument, &show_help, 1},
   {"horizon-lines", required_argument, NULL, HORIZON_LINES_OPTION},
   {"ifdef", required_argument, NULL, 'D'},
+  {"index", required_argument, NULL, INDEX_OPTION},
   {"ignore-all-space", no_argument, NULL, 'w'},
   {"ignore-blank-lines", no_argument, NULL, 'B'},
   {"ignore-case", no_argument, NULL, 'i'},
@@ -153,8 +182,10 @@ static const struct option long_options[] = {
   {"less-mode", no_argument, NULL, 'k'},
   {"line-format", required_argument, NULL, LINE_FORMAT_OPTION},
   {"LTYPE-line-format", required_argument, NULL, LTYPE_LINE_FORMAT_OPTION},
+  {"merge-shards", no_argument, NULL, MERGE_SHARDS_OPTION},
   {"minimal", no_argument, NULL, 'd'},
   {"minimum-size", required_argument, NULL, 'J'},
+  {"near-duplicates", optional_argument, NULL, NEAR_DUPLICATES_OPTION},
   {"new-file", no_argument, NULL, 'N'},
   {"no-common", no_argument, NULL, '3'},
   {"no-deleted", no_argument, NULL, '1'},
@@ -166,6 +197,8 @@ static const struct option long_options[] = {
   {"rcs", no_argument, NULL, 'n'},
   {"recursive", no_argument, NULL, 'r'},
   {"relist-files", no_argument, NULL, 'G'},
+  {"repetitions", no_argument, NULL, REPETITIONS_OPTION},
+  {"report", required_argument, NULL, REPORT_OPTION},
   {"report-identical-files", no_argument, NULL, 's'},
   {"show-c-function", no_argument, NULL, 'p'},
   {"show-function-line", required_argument, NULL, 'F'},
@@ -173,6 +206,7 @@ static const struct option long_options[] = {
   {"side-by-side", no_argument, NULL, 'y'},
   {"speed-large-files", no_argument, NULL, 'H'},
   {"starting-file", required_argument, NULL, 'S'},
+  {"stats", required_argument, NULL, STATS_OPTION},
   {"string", optional_argument, NULL, 'Z'},
   {"suppress-common-lines", no_argument, NULL, SUPPRESS_COMMON_LINES_OPTION},
   {"terminal", no_argument, NULL, 'z'},
@@ -212,10 +246,20 @@ static int ignore_blank_lines = 0;
 /* Consider upper-case and lower-case to be the same.  */
 static int ignore_case = 0;
 
+/* File saving study results between runs, or NULL.  */
+static const char *index_name = NULL;
+
+/* File receiving a shard for later merging, or NULL.  */
+static const char *shard_name = NULL;
+
+/* If nonzero, operands are shards to merge rather than files to study.  */
+static int merge_shards = 0;
+
 /* If nonzero, segregate matchable only items out of normal items.  */
 static int ignore_delimiters = 0;
 
 /* Ignore changes whose lines all match regular expression.  */
+static const char **ignore_string_array = NULL;
 static struct re_pattern_buffer **ignore_regexp_array = NULL;
 static int ignore_regexps = 0;
 
@@ -246,15 +290,25 @@ static int relist_files = 0;
 /* Give file and line references in annotated listings.  */
 static int show_links = 0;
 
-/* Assume large files and many scattered small changes.  Unimplemented.  */
+/* Assume large files and many scattered small changes.  */
 static int speed_large_files = 0;
 
+/* When speeding large files, checksums occurring more often than this,
+   for each input file on average, do not seed clusters, and no more
+   members than that are considered per set of clusters.  */
+#define SPEED_FREQUENCY_PER_INPUT 4
+
+/* When speeding large files, cluster members further ahead than this many
+   items do not count when choosing mergings, unless first in their file.  */
+#define SPEED_HORIZON 2000
+
 /* If nonzero, show progress of operations.  */
 static int verbose = 0;
 
 /* Compare words, use REGEXP to define item.  */
 static int word_mode = 0;
 static struct re_pattern_buffer *item_regexp = NULL;
+static const char *item_regexp_string = NULL;
 
 /*---------------.
 | diff options.  |
@@ -269,6 +323,10 @@ static int context = 0;
 /* Output unified context diffs or unidiffs.  */
 static int unified = 0;
 
+/* If context or unified diffs between two inputs are to be produced, which
+   asks for stricter matching than listings.  */
+static int diff_hunks = 0;
+
 /* Use LABEL instead of file name.  */
 static const char *label = NULL;
 
@@ -277,6 +335,10 @@ static int show_c_function = 0;
 
 /* Show the most recent line matching RE.  */
 static const char *show_function_line = NULL;
+static struct re_pattern_buffer *function_regexp = NULL;
+
+/* Regular expression for -p, as in GNU diff but not needing classes.  */
+#define C_FUNCTION_REGEXP "^[a-zA-Z$_]"
 
 /* Output only whether files differ.  */
 static int brief = 0;
@@ -326,17 +388,47 @@ static int unidirectional_new_file = 0;
 /* Report when two files are the same.  */
 static int report_identical_files = 0;
 
-/* Exclude files that match PAT.  */
-static const char *exclude = NULL;
+/* Report pairs of files estimated similar at least to this percentage,
+   or 0 if not.  */
+static int near_duplicates = 0;
+
+/* If nonzero, only report passages repeated within inputs.  */
+static int repetitions = 0;
+
+/* Format for reporting clusters and mergings, instead of listing.  */
+enum report_format
+{
+  NO_REPORT,			/* usual listings */
+  BINARY_REPORT,		/* memory image, see struct report_header */
+  JSONL_REPORT			/* one JSON object per line */
+};
+static enum report_format report_format = NO_REPORT;
+
+/* Exclude files whose base name matches any of these patterns, given
+   through PAT or read from FILE.  */
+enum exclude_kind
+{
+  EXCLUDE_LITERAL,		/* whole pattern compared as a string */
+  EXCLUDE_SUFFIX,		/* `*' followed by a literal suffix */
+  EXCLUDE_GLOB			/* anything else, left to fnmatch */
+};
+
+struct exclude_pattern
+{
+  enum exclude_kind kind;	/* how to match this pattern */
+  const char *string;		/* pattern, or suffix after `*' */
+  size_t length;		/* length of string */
+};
 
-/* Exclude files that match any pattern in FILE.  */
-static const char *exclude_from = NULL;
+static struct exclude_pattern *exclude_array = NULL;
+static int excludes = 0;
+static size_t allocated_excludes = 0;
 
 /* Start with FILE when comparing directories.  */
 static const char *starting_file = NULL;
 
-/* Keep NUM lines of the common prefix and suffix.  */
-static int horizon_lines = 2;
+/* Keep NUM lines of context around differences.  */
+static int horizon_lines = 3;
 
 /*----------------------.
 | mdiff draft options.  |
@@ -394,1430 +486,5168 @@ alloc_and_compile_regex (const char *string)
   return pattern;
 }
 
-/* Items.  */
-
-/* Each item has a type which is meaningful to the clustering process.
-   NORMAL items and DELIMS items fully participate in cluster
-   construction, yet only NORMAL items are worth participating into building
-   the minimum size count, merely DELIMS items do not.  WHITE items, even if
-   they do exist in input files, are a little like if they were just not
-   there: they are often skipped over.  SENTINEL items do not correspond to
-   any real input item, they are used to mark file boundaries, and may not
-   compare equally to any other item.
+/* Ignored lines.  */
 
-   The names NORMAL, DELIMS, WHITE and SENTINEL are a bit generic and are
-   used mainly to trigger the imagination of the reader.  Practice may be
-   quite different.  For example, actual white items may well be classified
-   as DELIMS or NORMAL, items having only delimiters may be seen as NORMAL,
-   items making up a block comment may be considered as WHITE.  Moreover,
-   SENTINEL items could be introduced at function boundaries, say, if we
-   wanted to limit cluster members to a single function, etc.  */
+/* Lines are ignored when some -I regular expression matches at their
+   start.  Rather than trying each expression in turn, all of them get
+   combined into a single alternation.  Moreover, most expressions require
+   some literal string to appear in lines they match, so a quick search
+   for these strings usually tells that the regex matcher is not needed
+   at all.  A literal string found at the start of an expression has to be
+   found at the start of the line.  */
 
-enum type
+struct ignore_literal
 {
-  NORMAL,			/* meaningful, countable items */
-  DELIMS,			/* items having only delimiters */
-  WHITE,			/* white items */
-  SENTINEL			/* file boundaries */
+  const char *string;		/* literal string required in lines */
+  int length;			/* length of string */
+  int anchored;			/* if string should start lines */
 };
 
-/* Comparison work is done on checksums of items, rather than input items
-   themselves.  The following array maintains one entry for each item,
-   whether a real item or a sentinel.  Checksums, which are meaningful only
-   for NORMAL or DELIMS items, are computed so they ignore parts of the item
-   which are not really meaningful for the purpose of comparisons.
+static struct ignore_literal *ignore_literal_array = NULL;
+static int ignore_unfiltered = 0; /* if some expression has no literal */
+static struct re_pattern_buffer *ignore_regexp = NULL; /* combined, or NULL */
 
-   If SAFER_SLOWER has been selected, checksums may be avoided and pointers
-   used instead.  For pointers to occupy the full space they might need, the
-   type bits are kept apart but tightly packed.  Otherwise, the TYPE bits
-   are part of the structured item, eating out some chekcsum space.  */
+/*------------------------------------------------------------------.
+| Find in regular expression STRING the longest literal string any  |
+| match requires, and save it into LITERAL.  Return zero if none.   |
+`------------------------------------------------------------------*/
 
-#define BITS_PER_CHAR		8
-#define BITS_PER_TYPE		2
-#define BITS_PER_WORD		(sizeof (unsigned) * BITS_PER_CHAR)
-#define TYPES_PER_WORD		(BITS_PER_WORD / BITS_PER_TYPE)
+static int
+find_required_literal (const char *string, struct ignore_literal *literal)
+{
+  const char *cursor = string;
+  char *buffer = xmalloc (strlen (string) + 1);
+  int length = 0;		/* length of literal run being scanned */
+  int start = 1;		/* if current run starts the expression */
+  int level;			/* nesting of groups being skipped */
+
+  literal->string = NULL;
+  literal->length = 0;
+  literal->anchored = 0;
+
+  if (*cursor == '^')
+    cursor++;
+
+#define END_OF_RUN							\
+  do									\
+    {									\
+      if (length > literal->length)					\
+	{								\
+	  free ((char *) literal->string);				\
+	  literal->string = xmalloc (length);				\
+	  memcpy ((char *) literal->string, buffer, length);		\
+	  literal->length = length;					\
+	  literal->anchored = start;					\
+	}								\
+      length = 0;							\
+      start = 0;							\
+    }									\
+  while (0)
+
+  while (*cursor)
+    switch (*cursor)
+      {
+      case '*':
+      case '+':
+      case '?':
+	/* The previous character is optional or repeated.  */
+
+	if (length > 0)
+	  length--;
+	END_OF_RUN;
+	cursor++;
+	break;
 
-#if SAFER_SLOWER
+      case '.':
+      case '^':
+      case '$':
+	END_OF_RUN;
+	cursor++;
+	break;
 
-# define ITEM			union item
+      case '[':
+	END_OF_RUN;
+	cursor++;
+	if (*cursor == '^')
+	  cursor++;
+	if (*cursor == ']')
+	  cursor++;
+	while (*cursor && *cursor != ']')
+	  cursor++;
+	if (*cursor)
+	  cursor++;
+	break;
 
-union item
-{
-  unsigned checksum;
-  char *pointer;
-};
+      case '\\':
+	if (cursor[1] && strchr (".*[]^$\\+?", cursor[1]))
+	  {
+	    /* A quoted special character stands for itself.  */
 
-static union item *item_array = NULL;
-static unsigned *type_array = NULL;
-static int items = 0;
+	    if (cursor[2] == '*' || cursor[2] == '+' || cursor[2] == '?')
+	      END_OF_RUN;
+	    else
+	      buffer[length++] = cursor[1];
+	    cursor += 2;
+	  }
+	else if (cursor[1] == '|')
+	  {
+	    /* Alternatives at top level may each require other strings.  */
 
-static inline enum type
-item_type (ITEM * item)
-{
-  int position = item - item_array;
-  int shift = position % TYPES_PER_WORD * BITS_PER_TYPE;
-  unsigned *pointer = type_array + position / TYPES_PER_WORD;
+	    free ((char *) literal->string);
+	    literal->string = NULL;
+	    literal->length = 0;
+	    free (buffer);
+	    return 0;
+	  }
+	else if (cursor[1] == '(')
+	  {
+	    /* Skip the whole group, which may have alternatives.  */
 
-  return (enum type) (MASK (BITS_PER_TYPE) & *pointer >> shift);
-}
+	    END_OF_RUN;
+	    cursor += 2;
+	    for (level = 1; *cursor && level > 0; cursor++)
+	      if (cursor[0] == '\\' && cursor[1])
+		{
+		  if (cursor[1] == '(')
+		    level++;
+		  else if (cursor[1] == ')')
+		    level--;
+		  cursor++;
+		}
+	  }
+	else
+	  {
+	    END_OF_RUN;
+	    cursor += cursor[1] ? 2 : 1;
+	  }
+	break;
 
-static inline void
-set_item_type (ITEM * item, enum type type)
-{
-  int position = item - item_array;
-  int shift = position % TYPES_PER_WORD * BITS_PER_TYPE;
-  unsigned *pointer = type_array + position / TYPES_PER_WORD;
+      default:
+	if (cursor[1] == '*' || cursor[1] == '+' || cursor[1] == '?')
+	  END_OF_RUN;
+	else
+	  buffer[length++] = *cursor;
+	cursor++;
+	break;
+      }
 
-  *pointer &= ~MASK (BITS_PER_TYPE) << shift;
-  *pointer |= type << shift;
-}
+  END_OF_RUN;
+#undef END_OF_RUN
 
-#else /* not SAFER_SLOWER */
+  free (buffer);
+  return literal->length > 0;
+}
 
-# define ITEM			struct item
+/*----------------------------------------------------------------.
+| Compile all -I regular expressions into one, and find literal   |
+| strings for quickly filtering out lines which cannot match.     |
+`----------------------------------------------------------------*/
 
-struct item
+static void
+prepare_ignore_regexps (void)
 {
-  enum type type:BITS_PER_TYPE;
-  unsigned checksum:BITS_PER_WORD - BITS_PER_TYPE;
-};
+  size_t length = 0;
+  char *combined;
+  char *cursor;
+  const char *message;
+  int counter;
 
-static struct item *item_array = NULL;
-static int items = 0;
+  if (ignore_regexps == 0)
+    return;
 
-static inline enum type
-item_type (ITEM * item)
-{
-  return item->type;
-}
+  ignore_literal_array = (struct ignore_literal *)
+    xmalloc (ignore_regexps * sizeof (struct ignore_literal));
+  for (counter = 0; counter < ignore_regexps; counter++)
+    if (!find_required_literal (ignore_string_array[counter],
+				ignore_literal_array + counter))
+      ignore_unfiltered = 1;
 
-static inline void
-set_item_type (ITEM * item, enum type type)
-{
-  item->type = type;
-}
+  if (ignore_regexps == 1)
+    {
+      ignore_regexp = ignore_regexp_array[0];
+      return;
+    }
 
-#endif /* not SAFER_SLOWER */
+  /* Back references get renumbered within an alternation, expressions
+     using them are rather tried one after another.  */
 
-#if DEBUGGING
+  for (counter = 0; counter < ignore_regexps; counter++)
+    {
+      const char *string = ignore_string_array[counter];
 
-/*---------------------.
-| Dump a given INPUT.  |
-`---------------------*/
+      for (cursor = (char *) string; *cursor; cursor++)
+	if (cursor[0] == '\\' && cursor[1])
+	  {
+	    if (cursor[1] >= '1' && cursor[1] <= '9')
+	      return;
+	    cursor++;
+	  }
+      length += strlen (string) + 6;
+    }
 
-static void
-dump_item (ITEM * item)
-{
-  static const char *item_type_string[4] = { "", "delim", "white", "SENTIN" };
+  combined = xmalloc (length);
+  cursor = combined;
+  for (counter = 0; counter < ignore_regexps; counter++)
+    {
+      if (counter > 0)
+	{
+	  *cursor++ = '\\';
+	  *cursor++ = '|';
+	}
+      cursor += sprintf (cursor, "\\(%s\\)", ignore_string_array[counter]);
+    }
 
-  fprintf (stderr, "(%ld)\t%s\t%08x\n", (long) (item - item_array),
-	   item_type_string[item_type (item)], item->checksum);
+  ignore_regexp = (struct re_pattern_buffer *)
+    xmalloc (sizeof (struct re_pattern_buffer));
+  memset (ignore_regexp, 0, sizeof (struct re_pattern_buffer));
+  ignore_regexp->fastmap = xmalloc ((size_t) CHAR_SET_SIZE);
+
+  /* Should combining fail, each expression compiled alone still works.  */
+
+  message = re_compile_pattern (combined, cursor - combined, ignore_regexp);
+  if (message)
+    {
+      free (ignore_regexp->fastmap);
+      free (ignore_regexp);
+      ignore_regexp = NULL;
+    }
+  else
+    re_compile_fastmap (ignore_regexp);
+  free (combined);
 }
 
-/*------------------.
-| Dump all items.  |
-`------------------*/
+/*----------------------------------------------------------------.
+| Return non-zero if the LENGTH characters of LINE should be      |
+| ignored, as matched at their start by some -I expression.       |
+`----------------------------------------------------------------*/
 
-static void
-dump_all_items (void)
+static int
+ignored_line (const char *line, int length)
 {
   int counter;
 
-  fputs ("\f\n", stderr);
-  for (counter = 0; counter < items; counter++)
-    dump_item (item_array + counter);
-}
-
-#endif /* DEBUGGING */
+  if (ignore_regexps == 0)
+    return 0;
 
-/*-------------------------------------------------------------------.
-| Move item pointer forward or backward, skipping over white items.  |
-`-------------------------------------------------------------------*/
+  /* Unless some string required by an expression is there, no need to
+     try matching.  */
 
-#define FORWARD_ITEM(Pointer) \
-  do { Pointer++; } while (item_type (Pointer) == WHITE)
+  if (!ignore_unfiltered)
+    {
+      for (counter = 0; counter < ignore_regexps; counter++)
+	{
+	  struct ignore_literal *literal = ignore_literal_array + counter;
+	  const char *cursor = line;
+	  const char *limit = line + length - literal->length;
 
-#define BACKWARD_ITEM(Pointer) \
-  do { Pointer--; } while (item_type (Pointer) == WHITE)
+	  if (literal->anchored)
+	    {
+	      if (length >= literal->length
+		  && memcmp (line, literal->string, literal->length) == 0)
+		break;
+	      continue;
+	    }
 
-/*------------------------------------------------------------------.
-| Sort helper.  Compare two item indices.  Lower indices go first.  |
-`------------------------------------------------------------------*/
+	  while (cursor <= limit
+		 && (cursor = memchr (cursor, literal->string[0],
+				      limit - cursor + 1)))
+	    {
+	      if (memcmp (cursor, literal->string, literal->length) == 0)
+		break;
+	      cursor++;
+	    }
+	  if (cursor && cursor <= limit)
+	    break;
+	}
 
-static int
-compare_for_positions (const void *void_first, const void *void_second)
-{
-#define value1 *((int *) void_first)
-#define value2 *((int *) void_second)
+      if (counter == ignore_regexps)
+	return 0;
+    }
 
-  return value1 - value2;
+  if (ignore_regexp)
+    return re_match (ignore_regexp, line, length, 0, NULL) > 0;
 
-#undef value1
-#undef value2
+  for (counter = 0; counter < ignore_regexps; counter++)
+    if (re_match (ignore_regexp_array[counter], line, length, 0, NULL) > 0)
+      return 1;
+  return 0;
 }
 
-/*-------------------------------------------------------------------------.
-| Sort helper.  Compare two item indices.  Items having identical	   |
-| checksums should be brought together.  Whenever two checksums are equal, |
-| items are then ordered by the checksum of the following items, and this  |
-| way going forward until a difference is found.			   |
-`-------------------------------------------------------------------------*/
+/* Item definitions.  */
+
+/* In word mode, items are found by a table driven scanner whenever
+   possible.  An item is a character allowed to start it, followed by the
+   longest run of characters allowed to continue it.  By default, both
+   tables hold all non white space characters.  With -O, simple patterns
+   like `[A-Za-z_][A-Za-z0-9_]*', `[0-9]+' or `[^,]+' get translated into
+   these tables, so whole lines get tokenized in a single pass.  Other
+   patterns have the regex matcher find each item.  */
+
+static char item_start_table[CHAR_SET_SIZE]; /* if character starts items */
+static char item_rest_table[CHAR_SET_SIZE]; /* if character continues them */
+static int item_tables = 1;	/* if tables are used, rather than regex */
+
+/*----------------------------------------------------------------------.
+| Parse at *POINTER a single character matching atom of a regular	|
+| expression, marking into TABLE all characters it accepts, and advance |
+| *POINTER past it.  Return zero if the atom is not understood.		|
+`----------------------------------------------------------------------*/
 
 static int
-compare_for_checksum_runs (const void *void_first, const void *void_second)
+parse_item_atom (const char **pointer, char *table)
 {
-#define value1 *((int *) void_first)
-#define value2 *((int *) void_second)
+  const unsigned char *cursor = (const unsigned char *) *pointer;
+  int character;
+  int negated;
 
-  ITEM *item1 = item_array + value1;
-  ITEM *item2 = item_array + value2;
-  int result;
+  memset (table, 0, CHAR_SET_SIZE);
 
-  while (1)
+  switch (*cursor)
     {
-      /* Order checksums.  */
+    case '\0':
+    case '*':
+    case '+':
+    case '?':
+    case '^':
+    case '$':
+    case ']':
+      return 0;
+
+    case '.':
+      memset (table, 1, CHAR_SET_SIZE);
+      cursor++;
+      break;
+
+    case '\\':
+      if (cursor[1] == 'w' || cursor[1] == 'W')
+	{
+	  for (character = 0; character < CHAR_SET_SIZE; character++)
+	    table[character] = ((isalnum (character) || character == '_')
+				== (cursor[1] == 'w'));
+	}
+      else if (cursor[1] && strchr (".*[]^$\\+?", cursor[1]))
+	table[cursor[1]] = 1;
+      else
+	return 0;
+      cursor += 2;
+      break;
 
-      result = item1->checksum - item2->checksum;
-      if (result)
-	return result;
+    case '[':
+      cursor++;
+      negated = *cursor == '^';
+      if (negated)
+	cursor++;
 
-      /* Seek forward for a difference.  */
+      /* A closing bracket right away stands for itself.  */
 
-      FORWARD_ITEM (item1);
-      FORWARD_ITEM (item2);
+      if (*cursor == ']')
+	table[*cursor++] = 1;
 
-      /* Sentinels are never equal (unless really the same).  They go after
-         all checksums, and compare so to stabilise the sort.  */
+      while (*cursor != ']')
+	if (*cursor == '\0')
+	  return 0;
+	else if (cursor[0] == '[' && cursor[1] == ':')
+	  {
+	    static const struct
+	    {
+	      const char *name;
+	      int (*predicate) (int);
+	    }
+	    class_array[] =
+	      {
+		{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+		{"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+		{"lower", islower}, {"print", isprint}, {"punct", ispunct},
+		{"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+	      };
+	    const char *end = strstr ((const char *) cursor + 2, ":]");
+	    int counter;
+
+	    if (!end)
+	      return 0;
+	    for (counter = 0;
+		 counter < sizeof class_array / sizeof class_array[0];
+		 counter++)
+	      if (strlen (class_array[counter].name)
+		  == end - (const char *) cursor - 2
+		  && strncmp (class_array[counter].name,
+			      (const char *) cursor + 2,
+			      end - (const char *) cursor - 2) == 0)
+		break;
+	    if (counter == sizeof class_array / sizeof class_array[0])
+	      return 0;
+	    for (character = 0; character < CHAR_SET_SIZE; character++)
+	      if ((*class_array[counter].predicate) (character))
+		table[character] = 1;
+	    cursor = (const unsigned char *) end + 2;
+	  }
+	else if (cursor[1] == '-' && cursor[2] && cursor[2] != ']')
+	  {
+	    for (character = cursor[0]; character <= cursor[2]; character++)
+	      table[character] = 1;
+	    cursor += 3;
+	  }
+	else
+	  table[*cursor++] = 1;
+      cursor++;
 
-      if (item_type (item1) == SENTINEL)
-	return item_type (item2) == SENTINEL ? value1 - value2 : 1;
+      if (negated)
+	for (character = 0; character < CHAR_SET_SIZE; character++)
+	  table[character] = !table[character];
+      break;
 
-      if (item_type (item2) == SENTINEL)
-	return -1;
+    default:
+      table[*cursor++] = 1;
+      break;
     }
 
-#undef value1
-#undef value2
+  *pointer = (const char *) cursor;
+  return 1;
 }
 
-/*-----------------.
-| Add a new item.  |
-`-----------------*/
+/*--------------------------------------------------------------------.
+| Prepare the scanning tables for word mode items, which are either   |
+| white space delimited, or given by a simple enough -O expression.   |
+`--------------------------------------------------------------------*/
 
-static inline void
-new_item (enum type type, int checksum)
+static void
+prepare_item_tables (void)
 {
-  ITEM *item;
+  const char *cursor = item_regexp_string;
+  int character;
 
-  if (items % (64 * TYPES_PER_WORD) == 0)
+  if (!item_regexp)
     {
-      item_array = (ITEM *)
-	xrealloc (item_array, (items + 64 * TYPES_PER_WORD) * sizeof (ITEM));
-#if SAFER_SLOWER
-      type_array = (unsigned *)
-	xrealloc (type_array,
-		  (items / TYPES_PER_WORD + 64) * sizeof (unsigned));
-#endif
+      for (character = 0; character < CHAR_SET_SIZE; character++)
+	item_start_table[character] = item_rest_table[character]
+	  = !isspace (character);
+      return;
     }
 
-  item = item_array + items++;
-  set_item_type (item, type);
-  item->checksum = checksum;
-}
+  /* Accept `A', `A+' and `AB*', where A and B match single characters.  */
 
-/*---------------------.
-| Add a new sentinel.  |
-`---------------------*/
+  item_tables = 0;
+  if (!parse_item_atom (&cursor, item_start_table))
+    return;
 
-static void
-new_sentinel (void)
-{
-  new_item (SENTINEL, 0);
+  if (*cursor == '+' && cursor[1] == '\0')
+    memcpy (item_rest_table, item_start_table, CHAR_SET_SIZE);
+  else if (*cursor == '\0')
+    memset (item_rest_table, 0, CHAR_SET_SIZE);
+  else if (!parse_item_atom (&cursor, item_rest_table)
+	   || *cursor != '*' || cursor[1] != '\0')
+    return;
+
+  /* Items never extend over the end of a line.  */
+
+  item_start_table['\n'] = 0;
+  item_rest_table['\n'] = 0;
+  item_tables = 1;
 }
 
-/*------------------------------------------------------------------------.
-| Find how many identical normal items follow, given two start items.	  |
-| Ensure matchable items correspond to each other, but skip over white	  |
-| items.  The starting items may not be sentinels nor white items.  Fuzzy |
-| items, if any, ought to be embedded and correspond to each other.	  |
-`------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------.
+| Find the next item in LINE from CURSOR to LIMIT, set *START to its	|
+| beginning and return its length.  If no item remains in the line,	|
+| return zero with *START set to LIMIT.					|
+`----------------------------------------------------------------------*/
 
-static int
-identical_size (int index1, int index2)
+static inline int
+find_item (const char *line, const char *cursor, const char *limit,
+	   const char **start)
 {
-  ITEM *item1 = item_array + index1;
-  ITEM *item2 = item_array + index2;
-  int normal_count = 0;
-  int mismatch_count = 0;
-
-  while (1)
+  if (item_tables)
     {
-      if (item1->checksum == item2->checksum
-#if 0
-	  /* Just assume that identical checksums imply identical types.  */
-	  && item_type (item1) == item_type (item2)
-#endif
-	)
-	{
-	  if (item_type (item1) == NORMAL)
-	    normal_count++;
-	}
-      else if (normal_count > 0 && mismatch_count < tolerance)
-	{
-	  if (item_type (item1) == NORMAL && item_type (item2) == NORMAL)
-	    normal_count++;
-	  mismatch_count++;
-	}
-      else
-	break;
+      const char *end;
 
-      FORWARD_ITEM (item1);
-      FORWARD_ITEM (item2);
+      while (cursor < limit && !item_start_table[(unsigned char) *cursor])
+	cursor++;
+      *start = cursor;
+      if (cursor == limit)
+	return 0;
 
-      if (item_type (item1) == SENTINEL || item_type (item2) == SENTINEL)
-	break;
+      for (end = cursor + 1;
+	   end < limit && item_rest_table[(unsigned char) *end];
+	   end++)
+	;
+      return end - cursor;
     }
+  else
+    {
+      int size = limit - line;
+      int position;
+      int length;
 
-  return normal_count;
-}
-
-/*-----------------------------------------------------------------------.
-| Count normal items from START to FINISH (excluded).  However, if there |
-| are MAXIMUM or more normal input items, return a negative number.      |
-`-----------------------------------------------------------------------*/
+      /* The end of line may not be part of items.  */
 
-static int
-item_distance (int start, int finish, int maximum)
-{
-  int counter = 0;
-  ITEM *item;
+      if (size > 0 && line[size - 1] == '\n')
+	size--;
 
-  assert (start < finish);
-  assert (maximum > 0);
+      /* Empty matches do not make items, look further.  */
 
-  for (item = item_array + start; item < item_array + finish; item++)
-    if (item_type (item) == NORMAL)
-      {
-	counter++;
-	if (counter == maximum)
-	  return -1;
-      }
+      for (position = cursor - line; position < size; position++)
+	{
+	  position = re_search (item_regexp, line, size, position,
+				size - position, NULL);
+	  if (position < 0)
+	    break;
+	  length = re_match (item_regexp, line, size, position, NULL);
+	  if (length > 0)
+	    {
+	      *start = line + position;
+	      return length;
+	    }
+	}
 
-  return counter;
+      *start = limit;
+      return 0;
+    }
 }
-
-/* Files.  */
-
-/* All input files use a single continuous item counting scheme.  To revert
-   item numbers back to actual file and item references, the following array
-   maintains the cumulated number items seen prior to the beginning of each
-   file, for each file given as argument to the program.  To ease some
-   algorithms, a few sentinel items exist: one before the first file, one
-   between each file, and one after the last file.  Each file counts all
-   sentinels preceding it.  */
 
-struct input
-{
-  const char *file_name;	/* name of input file */
-  struct stat stat_buffer;	/* stat information for the file */
-  char nick_name[4];		/* short name of the file */
-  FILE *file;			/* file being read */
-  char *memory_copy;		/* buffer containing the file, or NULL */
+/* Parallel work.  */
 
-  /* Reading the file, one line or one character at a time.  */
-  char *line;			/* line from file */
-  char *cursor;			/* cursor into line, or NULL at end of file */
-  char *limit;			/* limit value for cursor */
-  size_t line_allocated;	/* allocated length of line */
+/* Some phases are made up of many independent jobs, like studying each
+   input file.  When threads are available, such jobs are distributed over
+   a few worker threads, each of them repeatedly picking the next job not
+   yet taken.  Jobs should only write into memory they own, results are
+   later gathered in job order by the calling thread, so the outcome never
+   depends on the number of workers.  */
 
-  /* Rescanning of the file, one item at a time.  */
-  int first_item;		/* index of first item in this file */
-  int item_limit;		/* one past last item index in this file */
-  int item;			/* index of next item to consider */
+/* Number of worker threads, 1 meaning that all jobs run serially.  */
+static int workers = 0;		/* undecided yet */
 
-  /* Merging views.  */
-  int *indirect_cursor;		/* cursor into indirect_array */
-  int *indirect_limit;		/* one past limit value of indirect_cursor */
+#if USE_POSIX_THREADS
 
-  /* Output control.  */
-  short listing_allowed;	/* if difference output allowed */
-  const char *user_start;	/* user string before difference */
-  const char *user_stop;	/* user string after difference */
-  const char *term_start;	/* terminal string before difference */
-  const char *term_stop;	/* terminal string after difference */
+struct parallel_work
+{
+  void (*job) (int);		/* function processing one job */
+  int jobs;			/* total number of jobs */
+  int next_job;			/* index of next job to take */
+  pthread_mutex_t lock;		/* protecting next_job */
 };
 
-static struct input *input_array = NULL;
-static int inputs = 0;
-
-int common_listing_allowed;	/* if common output allowed */
+/*--------------------------------------------------------------------.
+| Worker thread routine.  Process jobs from the shared WORK until no  |
+| jobs remain.							      |
+`--------------------------------------------------------------------*/
 
-/* Convenience macros.  */
+static void *
+parallel_worker (void *closure)
+{
+  struct parallel_work *work = (struct parallel_work *) closure;
+  int job;
 
-#define left (input_array + 0)
-#define right (input_array + 1)
+  while (1)
+    {
+      pthread_mutex_lock (&work->lock);
+      job = work->next_job++;
+      pthread_mutex_unlock (&work->lock);
 
-#define INPUT_MEMBER(Input) \
-  (member_array + *(Input)->indirect_cursor)
+      if (job >= work->jobs)
+	break;
+      (*work->job) (job);
+    }
 
-#define INPUT_CLUSTER(Input) \
-  (cluster_array + member_array[*(Input)->indirect_cursor].cluster_number)
+  return NULL;
+}
 
-#if DEBUGGING
+#endif /* USE_POSIX_THREADS */
 
-/*---------------------.
-| Dump a given INPUT.  |
-`---------------------*/
+/*-------------------------------------------------------------------.
+| Decide how many worker threads to use.  Debugging dumps are meant  |
+| to come out in a predictable order, so they force serial work.     |
+`-------------------------------------------------------------------*/
 
 static void
-dump_input (struct input *input)
+decide_workers (void)
 {
-  fprintf (stderr, "%s1,%d\t%7d\t%s\n",
-	   input->nick_name, input->item_limit - input->first_item,
-	   input->first_item, input->file_name);
-}
-
-/*------------------.
-| Dump all inputs.  |
-`------------------*/
+  workers = 1;
 
-static void
-dump_all_inputs (void)
-{
-  int counter;
+#if USE_POSIX_THREADS && defined _SC_NPROCESSORS_ONLN
+  if (!debugging)
+    {
+      long processors = sysconf (_SC_NPROCESSORS_ONLN);
 
-  fputs ("\f\n", stderr);
-  for (counter = 0; counter < inputs; counter++)
-    dump_input (input_array + counter);
+      if (processors > 1)
+	workers = processors;
+    }
+#endif
 }
 
-#endif /* DEBUGGING */
-
-/*---------------------------------------------------------------------.
-| Swallow the whole INPUT into a contiguous region of memory.  In the  |
-| INPUT structure, file name and stat buffer are already initialised.  |
-`---------------------------------------------------------------------*/
-
-/* Define to reallocation increment when swallowing input.  */
-#define SWALLOW_BUFFER_STEP 20000
+/*------------------------------------------------------------------------.
+| Call JOB once for each job index from 0 to JOBS (excluded), possibly in |
+| parallel, and only return once all jobs have been processed.            |
+`------------------------------------------------------------------------*/
 
 static void
-swallow_input (struct input *input)
+run_in_parallel (void (*job) (int), int jobs)
 {
-  int handle;			/* file descriptor number */
-  size_t allocated_length;	/* allocated length of memory buffer */
-  size_t length;		/* total length read so far */
-  int read_length;		/* number of character gotten on last read */
-
-  /* Standard input is already opened.  In all other cases, open the file
-     from its name.  */
-
-  if (strcmp (input->file_name, STDIN_PRINTED_NAME) == 0)
-    handle = fileno (stdin);
-  else if (handle = open (input->file_name, O_RDONLY), handle < 0)
-    error (EXIT_ERROR, errno, "%s", input->file_name);
-
-  /* If the file is a plain, regular file, allocate the memory buffer all at
-     once and swallow the file in one blow.  In other cases, read the file
-     repeatedly in smaller chunks until we have it all, reallocating memory
-     once in a while, as we go.  */
+  int counter;
 
-#if MSDOS
+#if USE_POSIX_THREADS
+  if (workers > 1 && jobs > 1)
+    {
+      struct parallel_work work;
+      pthread_t *thread_array;
+      int threads;
 
-  /* On MSDOS, we cannot predict in memory size from file size, because of
-     end of line conversions.  */
+      work.job = job;
+      work.jobs = jobs;
+      work.next_job = 0;
+      pthread_mutex_init (&work.lock, NULL);
 
-#else
+      /* The calling thread is a worker as well.  */
 
-  if (S_ISREG (input->stat_buffer.st_mode))
-    {
-      input->memory_copy = (char *)
-	xmalloc ((size_t) input->stat_buffer.st_size);
+      threads = (workers < jobs ? workers : jobs) - 1;
+      thread_array = (pthread_t *) xmalloc (threads * sizeof (pthread_t));
 
-      if (read
-	  (handle, input->memory_copy,
-	   (size_t) input->stat_buffer.st_size) != input->stat_buffer.st_size)
-	error (EXIT_ERROR, errno, "%s", input->file_name);
-    }
-  else
-#endif
+      for (counter = 0; counter < threads; counter++)
+	if (pthread_create (thread_array + counter, NULL,
+			    parallel_worker, &work) != 0)
+	  break;
+      threads = counter;
 
-    {
-      input->memory_copy = xmalloc ((size_t) SWALLOW_BUFFER_STEP);
-      allocated_length = SWALLOW_BUFFER_STEP;
+      parallel_worker (&work);
 
-      length = 0;
-      while (read_length = read (handle, input->memory_copy + length,
-				 allocated_length - length), read_length > 0)
-	{
-	  length += read_length;
-	  if (length == allocated_length)
-	    {
-	      allocated_length += SWALLOW_BUFFER_STEP;
-	      input->memory_copy = (char *)
-		xrealloc (input->memory_copy, allocated_length);
-	    }
-	}
+      for (counter = 0; counter < threads; counter++)
+	pthread_join (thread_array[counter], NULL);
 
-      if (read_length < 0)
-	error (EXIT_ERROR, errno, "%s", input->file_name);
+      pthread_mutex_destroy (&work.lock);
+      free (thread_array);
+      return;
     }
+#endif /* USE_POSIX_THREADS */
 
-  /* Close the file, but only if it was not the standard input.  */
-
-  if (handle != fileno (stdin))
-    close (handle);
+  for (counter = 0; counter < jobs; counter++)
+    (*job) (counter);
 }
+
+/* Statistics.  */
 
-/*-------------------------------------------.
-| Register a file NAME to be later studied.  |
-`-------------------------------------------*/
+/* With --stats=json, wall clock and processor times get accumulated for
+   each phase of the processing, and reported at exit on standard error
+   along with a few counts, in a form meant for programs rather than for
+   people.  Processor times include all worker threads.  */
 
-static void
-new_input (const char *name)
+enum phase
 {
-  static int stdin_swallowed = 0;
-  struct input *input;
-
-  /* Add a new input file descriptor, read in stdin right away.  */
+  PHASE_STUDY,			/* reading and studying inputs */
+  PHASE_SORT,			/* sorting seeds */
+  PHASE_CLUSTERING,		/* finding clusters and members */
+  PHASE_INDIRECTS,		/* ordering members in each input */
+  PHASE_MERGINGS,		/* deciding how to walk inputs */
+  PHASE_RELISTING,		/* producing output */
+  PHASES
+};
 
-  if (inputs % 16 == 0)
-    input_array = (struct input *)
-      xrealloc (input_array, (inputs + 16) * sizeof (struct input));
+static const char *const phase_name_array[PHASES] =
+{
+  "study", "sort", "clustering", "indirects", "mergings", "relisting"
+};
 
-  input = input_array + inputs++;
-  if (strcmp (name, "") == 0 || strcmp (name, "-") == 0)
-    if (stdin_swallowed)
-      error (EXIT_ERROR, 0, _("only one file may be standard input"));
-    else
-      {
-	input->file_name = STDIN_PRINTED_NAME;
-	if (fstat (fileno (stdin), &input->stat_buffer) != 0)
-	  error (EXIT_ERROR, errno, "%s", input->file_name);
-	swallow_input (input);
-	stdin_swallowed = 1;
-      }
-  else
-    {
-      input->file_name = name;
-      if (stat (input->file_name, &input->stat_buffer) != 0)
-	error (EXIT_ERROR, errno, "%s", input->file_name);
-      if ((input->stat_buffer.st_mode & S_IFMT) == S_IFDIR)
-	error (EXIT_ERROR, 0, _("directories not supported"));
-      input->memory_copy = NULL;
-    }
+static int stats_json = 0;	/* if statistics are wanted */
+static double phase_wall_array[PHASES]; /* wall clock seconds per phase */
+static double phase_cpu_array[PHASES]; /* processor seconds per phase */
+static double first_wall;	/* wall clock when processing started */
+static double first_cpu;	/* processor time when processing started */
+static double last_wall;	/* wall clock at end of last phase */
+static double last_cpu;		/* processor time at end of last phase */
+
+/* Calls to sort helpers, which are only ever used by a single thread.  */
+static unsigned long long checksum_run_comparisons = 0;
+static unsigned long long doubling_comparisons = 0;
+static unsigned long long gram_comparisons = 0;
+
+/*---------------------------------------------------------------.
+| Return the current wall clock, then processor time in *CPU.    |
+`---------------------------------------------------------------*/
+
+static double
+stats_clock (double *cpu)
+{
+  struct timespec wall;
+  struct rusage usage;
+
+  clock_gettime (CLOCK_MONOTONIC, &wall);
+  getrusage (RUSAGE_SELF, &usage);
+  *cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+	  + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+  return wall.tv_sec + wall.tv_nsec / 1e9;
 }
 
-/*-------------------------------.
-| Prepare INPUT for re-reading.  |
-`-------------------------------*/
+/*---------------------------------------------------------------.
+| Account the time elapsed since the previous phase to PHASE.    |
+`---------------------------------------------------------------*/
 
 static void
-open_input (struct input *input)
+end_phase (enum phase phase)
 {
-  if (input->memory_copy)
-    input->limit = input->memory_copy;
-  else
-    {
-      if (input->file = fopen (input->file_name, "r"), !input->file)
-	error (EXIT_ERROR, errno, "%s", input->file_name);
+  double wall;
+  double cpu;
 
-      input->line = NULL;
-    }
-  input->line_allocated = 0;
+  if (!stats_json)
+    return;
+
+  wall = stats_clock (&cpu);
+  phase_wall_array[phase] += wall - last_wall;
+  phase_cpu_array[phase] += cpu - last_cpu;
+  last_wall = wall;
+  last_cpu = cpu;
 }
+
+/* Items.  */
 
-static void
-close_input (struct input *input)
+/* Each item has a type which is meaningful to the clustering process.
+   NORMAL items and DELIMS items fully participate in cluster
+   construction, yet only NORMAL items are worth participating into building
+   the minimum size count, merely DELIMS items do not.  WHITE items, even if
+   they do exist in input files, are a little like if they were just not
+   there: they are often skipped over.  SENTINEL items do not correspond to
+   any real input item, they are used to mark file boundaries, and may not
+   compare equally to any other item.
+
+   The names NORMAL, DELIMS, WHITE and SENTINEL are a bit generic and are
+   used mainly to trigger the imagination of the reader.  Practice may be
+   quite different.  For example, actual white items may well be classified
+   as DELIMS or NORMAL, items having only delimiters may be seen as NORMAL,
+   items making up a block comment may be considered as WHITE.  Moreover,
+   SENTINEL items could be introduced at function boundaries, say, if we
+   wanted to limit cluster members to a single function, etc.  */
+
+enum type
+{
+  NORMAL,			/* meaningful, countable items */
+  DELIMS,			/* items having only delimiters */
+  WHITE,			/* white items */
+  SENTINEL			/* file boundaries */
+};
+
+/* Comparison work is done on checksums of items, rather than input items
+   themselves.  The following array maintains one entry for each item,
+   whether a real item or a sentinel.  Checksums, which are meaningful only
+   for NORMAL or DELIMS items, are computed so they ignore parts of the item
+   which are not really meaningful for the purpose of comparisons.
+
+   If SAFER_SLOWER has been selected, checksums may be avoided and pointers
+   used instead.  For pointers to occupy the full space they might need, the
+   type bits are kept apart but tightly packed.  Otherwise, the TYPE bits
+   are part of the structured item, eating out some chekcsum space.  */
+
+#define BITS_PER_CHAR		8
+#define BITS_PER_TYPE		2
+#define BITS_PER_WORD		(sizeof (unsigned) * BITS_PER_CHAR)
+#define TYPES_PER_WORD		(BITS_PER_WORD / BITS_PER_TYPE)
+
+#if SAFER_SLOWER
+
+# define ITEM			union item
+
+union item
+{
+  unsigned checksum;
+  char *pointer;
+};
+
+static union item *item_array = NULL;
+static unsigned *type_array = NULL;
+static int items = 0;
+
+static inline enum type
+item_type (ITEM * item)
+{
+  int position = item - item_array;
+  int shift = position % TYPES_PER_WORD * BITS_PER_TYPE;
+  unsigned *pointer = type_array + position / TYPES_PER_WORD;
+
+  return (enum type) (MASK (BITS_PER_TYPE) & *pointer >> shift);
+}
+
+static inline void
+set_item_type (ITEM * item, enum type type)
+{
+  int position = item - item_array;
+  int shift = position % TYPES_PER_WORD * BITS_PER_TYPE;
+  unsigned *pointer = type_array + position / TYPES_PER_WORD;
+
+  *pointer &= ~MASK (BITS_PER_TYPE) << shift;
+  *pointer |= type << shift;
+}
+
+#else /* not SAFER_SLOWER */
+
+# define ITEM			struct item
+
+struct item
+{
+  enum type type:BITS_PER_TYPE;
+  unsigned checksum:BITS_PER_WORD - BITS_PER_TYPE;
+};
+
+static struct item *item_array = NULL;
+static int items = 0;
+
+static inline enum type
+item_type (ITEM * item)
+{
+  return item->type;
+}
+
+static inline void
+set_item_type (ITEM * item, enum type type)
+{
+  item->type = type;
+}
+
+#endif /* not SAFER_SLOWER */
+
+#if DEBUGGING
+
+/*---------------------.
+| Dump a given INPUT.  |
+`---------------------*/
+
+static void
+dump_item (ITEM * item)
+{
+  static const char *item_type_string[4] = { "", "delim", "white", "SENTIN" };
+
+  fprintf (stderr, "(%ld)\t%s\t%08x\n", (long) (item - item_array),
+	   item_type_string[item_type (item)], item->checksum);
+}
+
+/*------------------.
+| Dump all items.  |
+`------------------*/
+
+static void
+dump_all_items (void)
+{
+  int counter;
+
+  fputs ("\f\n", stderr);
+  for (counter = 0; counter < items; counter++)
+    dump_item (item_array + counter);
+}
+
+#endif /* DEBUGGING */
+
+/* Runs of items are compared while clustering, skipping over white items.
+   To avoid decoding types at each step, a compact view then holds all
+   non-white items and sentinels, in order, split into plain arrays: moving
+   to the next or previous non-white item is a mere increment or decrement.
+   Each sentinel gets its own checksum, above all item checksums, so
+   compared runs always differ by the time they reach a sentinel.  */
+
+static unsigned *compact_checksum_array = NULL; /* checksum of each entry */
+static unsigned char *compact_type_array = NULL; /* type of each entry */
+static int *compact_item_array = NULL; /* item index for each entry */
+static int compact_items = 0;	/* number of entries in compact view */
+
+#define SENTINEL_CHECKSUM(Counter) \
+  ((1U << (BITS_PER_WORD - BITS_PER_TYPE)) + (Counter))
+
+/*-------------------------------------------.
+| Build the compact view out of ITEM_ARRAY.  |
+`-------------------------------------------*/
+
+static void
+prepare_compact_view (void)
+{
+  int counter;
+  int sentinels = 0;
+  ITEM *item;
+
+  compact_checksum_array = (unsigned *) xmalloc (items * sizeof (unsigned));
+  compact_type_array = (unsigned char *) xmalloc (items);
+  compact_item_array = (int *) xmalloc (items * sizeof (int));
+  compact_items = 0;
+
+  for (counter = 0; counter < items; counter++)
+    {
+      item = item_array + counter;
+      if (item_type (item) == WHITE)
+	continue;
+
+      compact_checksum_array[compact_items]
+	= (item_type (item) == SENTINEL
+	   ? SENTINEL_CHECKSUM (sentinels++) : item->checksum);
+      compact_type_array[compact_items] = item_type (item);
+      compact_item_array[compact_items] = counter;
+      compact_items++;
+    }
+}
+
+/*---------------------------.
+| Release the compact view.  |
+`---------------------------*/
+
+static void
+free_compact_view (void)
+{
+  free (compact_checksum_array);
+  compact_checksum_array = NULL;
+  free (compact_type_array);
+  compact_type_array = NULL;
+  free (compact_item_array);
+  compact_item_array = NULL;
+  compact_items = 0;
+}
+
+/*------------------------------------------------------------------.
+| Sort helper.  Compare two item indices.  Lower indices go first.  |
+`------------------------------------------------------------------*/
+
+static int
+compare_for_positions (const void *void_first, const void *void_second)
+{
+#define value1 *((int *) void_first)
+#define value2 *((int *) void_second)
+
+  return value1 - value2;
+
+#undef value1
+#undef value2
+}
+
+/*-------------------------------------------------------------------------.
+| Sort helper.  Compare two item indices.  Items having identical	   |
+| checksums should be brought together.  Whenever two checksums are equal, |
+| items are then ordered by the checksum of the following items, and this  |
+| way going forward until a difference is found.			   |
+`-------------------------------------------------------------------------*/
+
+static int
+compare_for_checksum_runs (const void *void_first, const void *void_second)
+{
+#define value1 *((int *) void_first)
+#define value2 *((int *) void_second)
+
+  const unsigned *checksum1 = compact_checksum_array + value1;
+  const unsigned *checksum2 = compact_checksum_array + value2;
+
+  checksum_run_comparisons++;
+  if (value1 == value2)
+    return 0;
+
+  /* Seek forward for a difference.  Distinct sentinels always differ.  */
+
+  while (*checksum1 == *checksum2
+#if SAFER_SLOWER
+	 /* Full width checksums might collide with sentinel ones.  */
+	 && compact_type_array[checksum1 - compact_checksum_array] != SENTINEL
+	 && compact_type_array[checksum2 - compact_checksum_array] != SENTINEL
+#endif
+    )
+    {
+      checksum1++;
+      checksum2++;
+    }
+
+  /* Sentinels are never equal (unless really the same).  They go after
+     all checksums, and compare so to stabilise the sort.  */
+
+  if (compact_type_array[checksum1 - compact_checksum_array] == SENTINEL)
+    return (compact_type_array[checksum2 - compact_checksum_array] == SENTINEL
+	    ? value1 - value2 : 1);
+
+  if (compact_type_array[checksum2 - compact_checksum_array] == SENTINEL)
+    return -1;
+
+  /* Order checksums.  */
+
+  return *checksum1 < *checksum2 ? -1 : 1;
+
+#undef value1
+#undef value2
+}
+
+/* Input files are studied independently of one another, possibly in
+   parallel, each into its own item buffer.  Buffers are later copied into
+   the single ITEM_ARRAY, in input order and separated by sentinels.  */
+
+struct item_buffer
+{
+  ITEM *array;			/* studied items */
+#if SAFER_SLOWER
+  unsigned char *type_array;	/* type of each studied item */
+#endif
+  int items;			/* number of studied items */
+  size_t allocated;		/* allocated entries in array */
+  int reported;			/* item count to report when verbose */
+};
+
+/*---------------------------------------------------------------------.
+| Allocate BUFFER for the items expected out of SIZE bytes of input,   |
+| so most inputs get studied without having to grow their buffer.      |
+`---------------------------------------------------------------------*/
+
+static void
+size_item_buffer (struct item_buffer *buffer, off_t size)
+{
+  /* Average item lengths are a rough guess, good enough to avoid most
+     reallocations without wasting much memory.  */
+
+  off_t expected = size / (word_mode ? 6 : 32) + 64;
+
+  if (expected > INT_MAX / (off_t) sizeof (ITEM))
+    expected = INT_MAX / sizeof (ITEM);
+
+  buffer->allocated = expected;
+  buffer->array = (ITEM *) xmalloc (buffer->allocated * sizeof (ITEM));
+#if SAFER_SLOWER
+  buffer->type_array = (unsigned char *) xmalloc (buffer->allocated);
+#endif
+}
+
+/*----------------------------------.
+| Add a new item at end of BUFFER.  |
+`----------------------------------*/
+
+static inline void
+new_item (struct item_buffer *buffer, enum type type, int checksum)
+{
+  ITEM *item;
+
+  if (buffer->items == buffer->allocated)
+    {
+      buffer->array = (ITEM *)
+	x2nrealloc (buffer->array, &buffer->allocated, sizeof (ITEM));
+#if SAFER_SLOWER
+      buffer->type_array = (unsigned char *)
+	xrealloc (buffer->type_array, buffer->allocated);
+#endif
+    }
+
+  item = buffer->array + buffer->items;
+#if SAFER_SLOWER
+  buffer->type_array[buffer->items] = type;
+#else
+  set_item_type (item, type);
+#endif
+  item->checksum = checksum;
+  buffer->items++;
+}
+
+/*------------------------------------------------------------------.
+| Append all items from BUFFER to ITEM_ARRAY, then release BUFFER.  |
+`------------------------------------------------------------------*/
+
+static void
+copy_item_buffer (struct item_buffer *buffer)
+{
+#if SAFER_SLOWER
+  int counter;
+
+  for (counter = 0; counter < buffer->items; counter++)
+    {
+      item_array[items + counter] = buffer->array[counter];
+      set_item_type (item_array + items + counter,
+		     (enum type) buffer->type_array[counter]);
+    }
+  free (buffer->type_array);
+#else
+  memcpy (item_array + items, buffer->array, buffer->items * sizeof (ITEM));
+#endif
+  items += buffer->items;
+
+  free (buffer->array);
+  buffer->array = NULL;
+  buffer->items = 0;
+  buffer->allocated = 0;
+}
+
+/*------------------------------------------.
+| Add a new sentinel at end of ITEM_ARRAY.  |
+`------------------------------------------*/
+
+static void
+new_sentinel (void)
+{
+  ITEM *item = item_array + items++;
+
+  set_item_type (item, SENTINEL);
+  item->checksum = 0;
+}
+
+/*------------------------------------------------------------------------.
+| Find how many identical normal items follow, given two start entries of |
+| the compact view.  Ensure matchable items correspond to each other,	  |
+| white items being already left out.  The starting items may not be	  |
+| sentinels.  Fuzzy items, if any, ought to be embedded and correspond to |
+| each other, and the count stops at the last matching item.		  |
+`------------------------------------------------------------------------*/
+
+static int
+identical_size (int index1, int index2)
+{
+  const unsigned *checksum1 = compact_checksum_array + index1;
+  const unsigned *checksum2 = compact_checksum_array + index2;
+  const unsigned char *type1 = compact_type_array + index1;
+  const unsigned char *type2 = compact_type_array + index2;
+  int normal_count = 0;
+  int mismatch_count = 0;
+  int matched_count = 0;	/* normal count up to last matching item */
+
+  while (1)
+    {
+      if (*checksum1 == *checksum2
+#if 0
+	  /* Just assume that identical checksums imply identical types.  */
+	  && *type1 == *type2
+#endif
+	)
+	{
+	  if (*type1 == NORMAL)
+	    normal_count++;
+	  matched_count = normal_count;
+	}
+      else if (normal_count > 0 && mismatch_count < tolerance)
+	{
+	  if (*type1 == NORMAL && *type2 == NORMAL)
+	    normal_count++;
+	  mismatch_count++;
+	}
+      else
+	break;
+
+      checksum1++, type1++;
+      checksum2++, type2++;
+
+      if (*type1 == SENTINEL || *type2 == SENTINEL)
+	break;
+    }
+
+  return matched_count;
+}
+
+/* Once all inputs are studied, a few arrays index item_array, so item
+   counting and member sizing need not scan items.  NORMAL_COUNT_ARRAY
+   gives, for each item index, how many normal items precede it.  Normal
+   items being numbered in order from 0, MEMBER_END_ARRAY gives, for each
+   normal item, the limit of a cluster member whose last normal item is
+   that one: just after it, or if DELIMS items follow it before the next
+   normal item or sentinel, at the last of these (which is excluded).  */
+
+static int *normal_count_array = NULL;
+static int *member_end_array = NULL;
+
+/*------------------------------------------------.
+| Build the index arrays, once item_array is set. |
+`------------------------------------------------*/
+
+static void
+prepare_item_index (void)
+{
+  int counter;
+  int normals = 0;
+  int last_delims = -1;		/* last DELIMS item after current one */
+
+  normal_count_array = (int *) xmalloc ((items + 1) * sizeof (int));
+  for (counter = 0; counter < items; counter++)
+    {
+      normal_count_array[counter] = normals;
+      if (item_type (item_array + counter) == NORMAL)
+	normals++;
+    }
+  normal_count_array[items] = normals;
+
+  member_end_array = (int *) xmalloc ((normals + 1) * sizeof (int));
+  for (counter = items - 1; counter >= 0; counter--)
+    switch (item_type (item_array + counter))
+      {
+      case NORMAL:
+	member_end_array[normal_count_array[counter]]
+	  = last_delims < 0 ? counter + 1 : last_delims;
+	/* Fall through.  */
+
+      case SENTINEL:
+	last_delims = -1;
+	break;
+
+      case DELIMS:
+	if (last_delims < 0)
+	  last_delims = counter;
+	break;
+
+      case WHITE:
+	break;
+      }
+}
+
+/*-----------------------------------------------------------------------.
+| Count normal items from START to FINISH (excluded).  However, if there |
+| are MAXIMUM or more normal input items, return a negative number.      |
+`-----------------------------------------------------------------------*/
+
+static int
+item_distance (int start, int finish, int maximum)
+{
+  int counter = normal_count_array[finish] - normal_count_array[start];
+
+  assert (start < finish);
+  assert (maximum > 0);
+
+  return counter < maximum ? counter : -1;
+}
+
+/* Files.  */
+
+/* All input files use a single continuous item counting scheme.  To revert
+   item numbers back to actual file and item references, the following array
+   maintains the cumulated number items seen prior to the beginning of each
+   file, for each file given as argument to the program.  To ease some
+   algorithms, a few sentinel items exist: one before the first file, one
+   between each file, and one after the last file.  Each file counts all
+   sentinels preceding it.  */
+
+/* Lines matching the -F expression are saved while studying, so each
+   hunk header only needs a binary search for the last one before it.  As
+   for GNU diff, only the start of such lines is shown.  */
+
+#define FUNCTION_TEXT_SIZE 44	/* room for 40 characters and a NUL */
+
+struct function_line
+{
+  int item;			/* item index of line, within its file */
+  char text[FUNCTION_TEXT_SIZE]; /* start of line, trailing white out */
+};
+
+struct input
+{
+  const char *file_name;	/* name of input file */
+  struct stat stat_buffer;	/* stat information for the file */
+  char nick_name[8];		/* short name of the file */
+  FILE *file;			/* file being read */
+  char *memory_copy;		/* buffer containing the file, or NULL */
+
+  /* Reading the file, one line or one character at a time.  */
+  char *line;			/* line from file */
+  char *cursor;			/* cursor into line, or NULL at end of file */
+  char *limit;			/* limit value for cursor */
+  size_t line_allocated;	/* allocated length of line */
+  int line_number;		/* number of lines read so far */
+  unsigned char *ignored_lines;	/* bitmap of ignored lines, or NULL */
+  struct function_line *function_array; /* lines matching -F, in order */
+  int functions;		/* number of entries in function_array */
+  int line_count;		/* number of lines, once studied */
+  int reported_items;		/* item count to report when verbose */
+  off_t line_offset;		/* file offset of line */
+  off_t next_offset;		/* file offset of next line */
+
+  /* Pooling of streams, when many files are read in parallel.  */
+  short pooled;			/* if FILE may be suspended */
+  off_t suspended_offset;	/* where to resume reading once suspended */
+  unsigned long last_use;	/* stream pool clock at last read */
+
+  /* Whole file comparison.  */
+  unsigned long long content_hash; /* hash of contents, or of checksums */
+  off_t bytes_read;		/* bytes read from file, all passes */
+  int content_items;		/* number of items hashed, if checksums */
+
+  /* Rescanning of the file, one item at a time.  */
+  int first_item;		/* index of first item in this file */
+  int item_limit;		/* one past last item index in this file */
+  int item;			/* index of next item to consider */
+  off_t *item_offset;		/* file offset of each item, or NULL */
+  int *item_length;		/* length of each item, in word mode */
+  short indexable;		/* if study results may be saved */
+  short from_index;		/* if study results came from the index */
+
+  /* Merging views.  */
+  int *indirect_cursor;		/* cursor into indirect_array */
+  int *indirect_limit;		/* one past limit value of indirect_cursor */
+  int next_head;		/* next input with same cluster at head, or -1 */
+  int previous_head;		/* previous such input, or -1 */
+  struct watch *watch_array;	/* live clusters having members here */
+  size_t watches;		/* number of entries in watch_array */
+  size_t watches_allocated;	/* allocated entries in watch_array */
+
+  /* Output control.  */
+  short listing_allowed;	/* if difference output allowed */
+  const char *user_start;	/* user string before difference */
+  const char *user_stop;	/* user string after difference */
+  const char *term_start;	/* terminal string before difference */
+  const char *term_stop;	/* terminal string after difference */
+};
+
+static struct input *input_array = NULL;
+static int inputs = 0;
+static size_t allocated_inputs = 0;
+
+int common_listing_allowed;	/* if common output allowed */
+
+/* Convenience macros.  */
+
+#define left (input_array + 0)
+#define right (input_array + 1)
+
+#define INPUT_MEMBER(Input) \
+  (member_array + *(Input)->indirect_cursor)
+
+#define INPUT_CLUSTER(Input) \
+  (cluster_array + member_array[*(Input)->indirect_cursor].cluster_number)
+
+#if DEBUGGING
+
+/*---------------------.
+| Dump a given INPUT.  |
+`---------------------*/
+
+static void
+dump_input (struct input *input)
+{
+  fprintf (stderr, "%s1,%d\t%7d\t%s\n",
+	   input->nick_name, input->item_limit - input->first_item,
+	   input->first_item, input->file_name);
+}
+
+/*------------------.
+| Dump all inputs.  |
+`------------------*/
+
+static void
+dump_all_inputs (void)
+{
+  int counter;
+
+  fputs ("\f\n", stderr);
+  for (counter = 0; counter < inputs; counter++)
+    dump_input (input_array + counter);
+}
+
+#endif /* DEBUGGING */
+
+/*---------------------------------------------------------------------.
+| Swallow the whole INPUT into a contiguous region of memory.  In the  |
+| INPUT structure, file name and stat buffer are already initialised.  |
+`---------------------------------------------------------------------*/
+
+/* Define to initial buffer size when swallowing input.  */
+#define SWALLOW_BUFFER_STEP 20000
+
+static void
+swallow_input (struct input *input)
+{
+  int handle;			/* file descriptor number */
+  size_t allocated_length;	/* allocated length of memory buffer */
+  size_t length;		/* total length read so far */
+  int read_length;		/* number of character gotten on last read */
+
+  /* Standard input is already opened.  In all other cases, open the file
+     from its name.  */
+
+  if (strcmp (input->file_name, STDIN_PRINTED_NAME) == 0)
+    handle = fileno (stdin);
+  else if (handle = open (input->file_name, O_RDONLY), handle < 0)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+
+  /* If the file is a plain, regular file, allocate the memory buffer all at
+     once and swallow the file in one blow.  In other cases, read the file
+     repeatedly in smaller chunks until we have it all, reallocating memory
+     once in a while, as we go.  */
+
+#if MSDOS
+
+  /* On MSDOS, we cannot predict in memory size from file size, because of
+     end of line conversions.  */
+
+#else
+
+  if (S_ISREG (input->stat_buffer.st_mode))
+    {
+      input->memory_copy = (char *)
+	xmalloc ((size_t) input->stat_buffer.st_size);
+
+      if (read
+	  (handle, input->memory_copy,
+	   (size_t) input->stat_buffer.st_size) != input->stat_buffer.st_size)
+	error (EXIT_ERROR, errno, "%s", input->file_name);
+    }
+  else
+#endif
+
+    {
+      input->memory_copy = xmalloc ((size_t) SWALLOW_BUFFER_STEP);
+      allocated_length = SWALLOW_BUFFER_STEP;
+
+      length = 0;
+      while (read_length = read (handle, input->memory_copy + length,
+				 allocated_length - length), read_length > 0)
+	{
+	  length += read_length;
+	  if (length == allocated_length)
+	    input->memory_copy = (char *)
+	      x2realloc (input->memory_copy, &allocated_length);
+	}
+
+      if (read_length < 0)
+	error (EXIT_ERROR, errno, "%s", input->file_name);
+
+      /* Later rereading relies on the size of the memory copy.  */
+
+      input->stat_buffer.st_size = length;
+    }
+
+  input->bytes_read += input->stat_buffer.st_size;
+
+  /* Close the file, but only if it was not the standard input.  */
+
+  if (handle != fileno (stdin))
+    close (handle);
+}
+
+/*-------------------------------------------.
+| Register a file NAME to be later studied.  |
+`-------------------------------------------*/
+
+static void
+new_input (const char *name)
+{
+  static int stdin_swallowed = 0;
+  struct input *input;
+
+  /* Add a new input file descriptor, read in stdin right away.  */
+
+  if (inputs == allocated_inputs)
+    input_array = (struct input *)
+      x2nrealloc (input_array, &allocated_inputs, sizeof (struct input));
+
+  input = input_array + inputs++;
+  input->bytes_read = 0;
+  if (strcmp (name, "") == 0 || strcmp (name, "-") == 0)
+    if (stdin_swallowed)
+      error (EXIT_ERROR, 0, _("only one file may be standard input"));
+    else
+      {
+	input->file_name = STDIN_PRINTED_NAME;
+	if (fstat (fileno (stdin), &input->stat_buffer) != 0)
+	  error (EXIT_ERROR, errno, "%s", input->file_name);
+	swallow_input (input);
+	stdin_swallowed = 1;
+      }
+  else
+    {
+      input->file_name = name;
+      input->memory_copy = NULL;
+      if (stat (input->file_name, &input->stat_buffer) != 0)
+	{
+	  if (errno != ENOENT || !new_file)
+	    error (EXIT_ERROR, errno, "%s", input->file_name);
+
+	  /* A missing file is then taken as being empty.  */
+
+	  memset (&input->stat_buffer, 0, sizeof input->stat_buffer);
+	  input->stat_buffer.st_mode = S_IFREG;
+	  input->memory_copy = xmalloc (1);
+	}
+      if ((input->stat_buffer.st_mode & S_IFMT) == S_IFDIR)
+	error (EXIT_ERROR, 0, _("%s: directories need option -r"),
+	       input->file_name);
+    }
+}
+
+/* Directory traversal.  */
+
+/* With option -r, all files found while walking through directories
+   become inputs, in the order of their sorted names, so all of them share
+   the same item space and clusters may show blocks moved or copied
+   between files.  Files or directories whose base name matches an
+   exclusion pattern are ignored, and so are files whose path, relative
+   to the directory given as argument, sorts before the starting file.  */
+
+/*------------------------------------------------------------------.
+| Add PATTERN to the exclusion patterns, recognising simple kinds   |
+| which do not need fnmatch.					    |
+`------------------------------------------------------------------*/
+
+static void
+add_exclude (const char *pattern)
+{
+  struct exclude_pattern *exclude;
+
+  if (excludes == allocated_excludes)
+    exclude_array = (struct exclude_pattern *)
+      x2nrealloc (exclude_array, &allocated_excludes,
+		  sizeof (struct exclude_pattern));
+
+  exclude = exclude_array + excludes++;
+  if (!strpbrk (pattern, "*?[\\"))
+    {
+      exclude->kind = EXCLUDE_LITERAL;
+      exclude->string = pattern;
+    }
+  else if (pattern[0] == '*' && !strpbrk (pattern + 1, "*?[\\"))
+    {
+      exclude->kind = EXCLUDE_SUFFIX;
+      exclude->string = pattern + 1;
+    }
+  else
+    {
+      exclude->kind = EXCLUDE_GLOB;
+      exclude->string = pattern;
+    }
+  exclude->length = strlen (exclude->string);
+}
+
+/*-----------------------------------------------------------------.
+| Add exclusion patterns read from FILE_NAME, one per line.	   |
+`-----------------------------------------------------------------*/
+
+static void
+add_exclude_file (const char *file_name)
+{
+  FILE *file;
+  char *line = NULL;
+  size_t allocated = 0;
+  ssize_t length;
+
+  if (strcmp (file_name, "-") == 0)
+    file = stdin;
+  else if (file = fopen (file_name, "r"), !file)
+    error (EXIT_ERROR, errno, "%s", file_name);
+
+  while (length = getline (&line, &allocated, file), length >= 0)
+    {
+      if (length > 0 && line[length - 1] == '\n')
+	line[--length] = '\0';
+      if (length > 0)
+	add_exclude (xstrdup (line));
+    }
+
+  free (line);
+  if (file != stdin)
+    fclose (file);
+}
+
+/*--------------------------------------------------------------.
+| Return non-zero if base NAME matches an exclusion pattern.	|
+`--------------------------------------------------------------*/
+
+static int
+excluded_name (const char *name)
+{
+  struct exclude_pattern *exclude;
+  size_t length = strlen (name);
+
+  for (exclude = exclude_array; exclude < exclude_array + excludes;
+       exclude++)
+    switch (exclude->kind)
+      {
+      case EXCLUDE_LITERAL:
+	if (length == exclude->length && memcmp (name, exclude->string,
+						 length) == 0)
+	  return 1;
+	break;
+
+      case EXCLUDE_SUFFIX:
+	if (length >= exclude->length
+	    && memcmp (name + length - exclude->length, exclude->string,
+		       exclude->length) == 0)
+	  return 1;
+	break;
+
+      case EXCLUDE_GLOB:
+	if (fnmatch (exclude->string, name, 0) == 0)
+	  return 1;
+	break;
+      }
+
+  return 0;
+}
+
+/*-----------------------------------------------------------------.
+| Compare two directory entry names, for sorting.		   |
+`-----------------------------------------------------------------*/
+
+static int
+compare_for_names (const void *void_first, const void *void_second)
+{
+  return strcmp (*(char *const *) void_first, *(char *const *) void_second);
+}
+
+/*-------------------------------------------------------------------.
+| Compare RELATIVE, a path below a directory argument, with the      |
+| starting file, in the order files get visited while walking, that  |
+| is, one path component at a time.  Return a negative value if      |
+| RELATIVE comes first, zero if both are the same, positive else.  A |
+| DIRECTORY leading to the starting file compares equal to it.	     |
+`-------------------------------------------------------------------*/
+
+static int
+compare_with_starting_file (const char *relative, int directory)
+{
+  const char *cursor = starting_file;
+  unsigned char character1;
+  unsigned char character2;
+
+  while (*relative && *relative == *cursor)
+    relative++, cursor++;
+
+  if (directory && *relative == '\0' && *cursor == '/')
+    return 0;
+
+  /* A component ending sorts before any longer one.  */
+
+  character1 = *relative == '/' ? '\0' : *relative;
+  character2 = *cursor == '/' ? '\0' : *cursor;
+  if (character1 != character2)
+    return character1 < character2 ? -1 : 1;
+
+  /* Both components end here, yet one path goes deeper.  */
+
+  return *relative ? 1 : *cursor ? -1 : 0;
+}
+
+/* Directories being walked, from the argument down, to detect loops.  */
+struct walk_level
+{
+  dev_t device;			/* device of directory */
+  ino_t inode;			/* inode of directory */
+};
+
+static struct walk_level *walk_array = NULL;
+static int walk_levels = 0;
+static size_t allocated_walk_levels = 0;
+
+/*-------------------------------------------------------------------.
+| Register all files below directory PATH as inputs.  The first SKIP |
+| characters of paths below give the directory given as argument,    |
+| and STAT_BUFFER describes PATH.				     |
+`-------------------------------------------------------------------*/
+
+static void
+walk_directory (const char *path, size_t skip, struct stat *stat_buffer)
+{
+  DIR *directory;
+  struct dirent *entry;
+  char **name_array = NULL;
+  size_t allocated_names = 0;
+  int names = 0;
+  int counter;
+  struct stat entry_stat;
+
+  for (counter = 0; counter < walk_levels; counter++)
+    if (walk_array[counter].device == stat_buffer->st_dev
+	&& walk_array[counter].inode == stat_buffer->st_ino)
+      {
+	error (0, 0, _("%s: recursive directory loop"), path);
+	return;
+      }
+
+  if (walk_levels == allocated_walk_levels)
+    walk_array = (struct walk_level *)
+      x2nrealloc (walk_array, &allocated_walk_levels,
+		  sizeof (struct walk_level));
+  walk_array[walk_levels].device = stat_buffer->st_dev;
+  walk_array[walk_levels].inode = stat_buffer->st_ino;
+  walk_levels++;
+
+  /* Read all names first, so directories are not kept open while
+     descending, and files get registered in a predictable order.  */
+
+  if (directory = opendir (path), !directory)
+    error (EXIT_ERROR, errno, "%s", path);
+  while (errno = 0, entry = readdir (directory), entry)
+    if (strcmp (entry->d_name, ".") != 0 && strcmp (entry->d_name, "..") != 0
+	&& !excluded_name (entry->d_name))
+      {
+	if (names == allocated_names)
+	  name_array = (char **)
+	    x2nrealloc (name_array, &allocated_names, sizeof (char *));
+	name_array[names++] = xstrdup (entry->d_name);
+      }
+  if (errno)
+    error (EXIT_ERROR, errno, "%s", path);
+  closedir (directory);
+
+  if (names > 1)
+    qsort (name_array, names, sizeof (char *), compare_for_names);
+
+  for (counter = 0; counter < names; counter++)
+    {
+      size_t path_length = strlen (path);
+      char *entry_path = xmalloc (path_length + strlen (name_array[counter])
+				  + 2);
+      const char *entry_relative;
+
+      strcpy (entry_path, path);
+      if (path_length == 0 || entry_path[path_length - 1] != '/')
+	entry_path[path_length++] = '/';
+      strcpy (entry_path + path_length, name_array[counter]);
+      entry_relative = entry_path + skip;
+      free (name_array[counter]);
+
+      if (stat (entry_path, &entry_stat) != 0)
+	error (EXIT_ERROR, errno, "%s", entry_path);
+
+      if (S_ISDIR (entry_stat.st_mode))
+	{
+	  /* All files below are visited before the starting file if this
+	     directory is, unless it leads to the starting file.  */
+
+	  if (starting_file
+	      && compare_with_starting_file (entry_relative, 1) < 0)
+	    {
+	      free (entry_path);
+	      continue;
+	    }
+	  walk_directory (entry_path, skip, &entry_stat);
+	  free (entry_path);
+	}
+      else if (!S_ISREG (entry_stat.st_mode))
+	{
+	  error (0, 0, _("%s: not a regular file, ignored"), entry_path);
+	  free (entry_path);
+	}
+      else if (starting_file
+	       && compare_with_starting_file (entry_relative, 0) < 0)
+	free (entry_path);
+      else
+	new_input (entry_path);
+    }
+
+  free (name_array);
+  walk_levels--;
+}
+
+/*------------------------------------------------------------------.
+| Register NAME as an input, or all files below it if a directory   |
+| and recursion is wanted.					    |
+`------------------------------------------------------------------*/
+
+static void
+new_input_or_tree (const char *name)
+{
+  struct stat stat_buffer;
+
+  if (recursive && strcmp (name, "-") != 0 && strcmp (name, "") != 0
+      && stat (name, &stat_buffer) == 0 && S_ISDIR (stat_buffer.st_mode))
+    {
+      size_t length = strlen (name);
+
+      walk_directory (name, name[length - 1] == '/' ? length : length + 1,
+		      &stat_buffer);
+    }
+  else
+    new_input (name);
+}
+
+/* Merged listings read all input files in parallel.  Files not copied in
+   memory each need their own stream, yet there might be many more input
+   files than available file descriptors.  While the stream pool is active,
+   inputs share at most MAXIMUM_STREAMS open streams: when one more is
+   needed, the least recently read stream gets closed after its position is
+   saved, and is later reopened at that position when read again.
+
+   Only relist_merged_lines uses the pool, and main does not reach it for
+   now: -c and -u yield diffs of two files through relist_diff_hunks.
+   Other listings and reports read their inputs one at a time.  */
+
+static struct input **stream_array = NULL; /* inputs having open streams */
+static int streams = 0;		/* number of entries in stream_array */
+static int maximum_streams = 0;	/* allowed open streams, 0 if no pool */
+static unsigned long stream_clock = 0; /* clock for least recent use */
+
+/*-------------------------------------------------------------------.
+| Activate the stream pool, sized from the file descriptors limit.   |
+`-------------------------------------------------------------------*/
+
+static void
+start_stream_pool (void)
+{
+  long open_maximum = -1;
+
+#ifdef _SC_OPEN_MAX
+  open_maximum = sysconf (_SC_OPEN_MAX);
+#endif
+
+  /* Leave plenty of descriptors for standard files, pipes and pagers.  */
+
+  maximum_streams = open_maximum > 0 ? open_maximum / 2 : 16;
+  if (maximum_streams < 4)
+    maximum_streams = 4;
+
+  stream_array = (struct input **)
+    xmalloc (maximum_streams * sizeof (struct input *));
+  streams = 0;
+}
+
+/*-------------------------------------------------------------------.
+| Deactivate the stream pool, once all pooled inputs are closed.     |
+`-------------------------------------------------------------------*/
+
+static void
+stop_stream_pool (void)
+{
+  assert (streams == 0);
+
+  free (stream_array);
+  stream_array = NULL;
+  maximum_streams = 0;
+}
+
+/*----------------------------------------------------------------------.
+| Close the stream for pooled INPUT, remembering where to resume later. |
+`----------------------------------------------------------------------*/
+
+static void
+suspend_input (struct input *input)
+{
+  struct input **cursor;
+
+  input->suspended_offset = ftello (input->file);
+  if (input->suspended_offset < 0)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+  fclose (input->file);
+  input->file = NULL;
+
+  for (cursor = stream_array; *cursor != input; cursor++)
+    ;
+  *cursor = stream_array[--streams];
+}
+
+/*---------------------------------------------------------------------.
+| Reopen the stream for pooled INPUT where it was suspended, first     |
+| suspending the least recently read stream if the pool is full.       |
+`---------------------------------------------------------------------*/
+
+static void
+resume_input (struct input *input)
+{
+  if (streams == maximum_streams)
+    {
+      struct input **cursor;
+      struct input *oldest = stream_array[0];
+
+      for (cursor = stream_array + 1; cursor < stream_array + streams;
+	   cursor++)
+	if ((*cursor)->last_use < oldest->last_use)
+	  oldest = *cursor;
+      suspend_input (oldest);
+    }
+
+  if (input->file = fopen (input->file_name, "r"), !input->file)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+  if (input->suspended_offset > 0
+      && fseeko (input->file, input->suspended_offset, SEEK_SET) != 0)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+
+  stream_array[streams++] = input;
+  input->last_use = ++stream_clock;
+}
+
+/*-----------------------------------------------------------------------.
+| Ensure pooled INPUT has an open stream before it gets read, and hint   |
+| the system that the data it is about to read will be needed soon.	 |
+`-----------------------------------------------------------------------*/
+
+static void
+prefetch_input (struct input *input)
+{
+  if (!input->pooled || input->file)
+    return;
+
+  resume_input (input);
+#if HAVE_POSIX_FADVISE
+  posix_fadvise (fileno (input->file), input->suspended_offset, 0,
+		 POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*-------------------------------.
+| Prepare INPUT for re-reading.  |
+`-------------------------------*/
+
+static void
+open_input (struct input *input)
+{
+  if (input->memory_copy)
+    input->limit = input->memory_copy;
+  else
+    {
+      /* Pooled inputs only get a stream once they are first read.  */
+
+      input->pooled = maximum_streams > 0;
+      input->suspended_offset = 0;
+      if (input->pooled)
+	input->file = NULL;
+      else if (input->file = fopen (input->file_name, "r"), !input->file)
+	error (EXIT_ERROR, errno, "%s", input->file_name);
+
+      input->line = NULL;
+    }
+  input->line_allocated = 0;
+  input->line_number = 0;
+  input->next_offset = 0;
+}
+
+static void
+close_input (struct input *input)
+{
+  if (input->line_allocated > 0)
+    free (input->line);
+
+  if (!input->memory_copy && input->file)
+    {
+      if (input->pooled)
+	suspend_input (input);
+      else
+	fclose (input->file);
+    }
+}
+
+/*-------------------------------------------------------------------------.
+| Prepare INPUT for next line, then available from INPUT->LINE through     |
+| INPUT->LIMIT (excluded).  INPUT->CURSOR will point to first character of |
+| the line, or will be NULL at end of file.                                |
+`-------------------------------------------------------------------------*/
+
+static void
+input_line (struct input *input)
+{
+  if (input->memory_copy)
+    {
+      const char *limit = input->memory_copy + input->stat_buffer.st_size;
+      char *cursor;
+
+      input->line = input->limit;
+
+      cursor = memchr (input->line, '\n', limit - input->line);
+      if (!cursor)
+	cursor = (char *) limit;
+
+      if (cursor < limit)
+	{
+	  cursor++;
+	  input->cursor = input->line;
+	}
+      else if (cursor == input->line)
+	input->cursor = NULL;
+      else
+	input->cursor = input->line;
+
+      input->limit = cursor;
+    }
+  else
+    {
+      int length;
+
+      if (input->pooled)
+	{
+	  if (!input->file)
+	    resume_input (input);
+	  input->last_use = ++stream_clock;
+	}
+
+      length = getline (&input->line, &input->line_allocated, input->file);
+
+      if (length < 0)
+	input->cursor = NULL;
+      else
+	{
+	  input->cursor = input->line;
+	  input->limit = input->line + length;
+	  input->bytes_read += length;
+	}
+    }
+
+  input->line_offset = input->next_offset;
+  if (input->cursor)
+    {
+      input->line_number++;
+      input->next_offset += input->limit - input->line;
+    }
+}
+
+/*--------------------------------------------------------------------.
+| Have INPUT, in line mode, read ITEM next, merely moving within its  |
+| memory copy or seeking its stream to the offset found while	      |
+| studying.							      |
+`--------------------------------------------------------------------*/
+
+static void
+seek_input_item (struct input *input, int item)
+{
+  off_t offset = input->item_offset[item - input->first_item];
+
+  assert (!word_mode && input->item <= item);
+
+  if (input->memory_copy)
+    input->limit = input->memory_copy + offset;
+  else if (input->pooled && !input->file)
+    input->suspended_offset = offset;
+  else if (fseeko (input->file, offset, SEEK_SET) != 0)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+
+  input->next_offset = offset;
+  input->line_number += item - input->item;
+  input->item = item;
+}
+
+/*-----------------------------------------------------------------------.
+| Return non-zero if the line just read from INPUT is to be ignored.	 |
+| Once INPUT has been studied, the decision is merely looked up.	 |
+`-----------------------------------------------------------------------*/
+
+#define LINE_IGNORED(Input, Line) \
+  ((Input)->ignored_lines[(Line) / BITS_PER_CHAR] \
+   & (1 << (Line) % BITS_PER_CHAR))
+
+static inline int
+ignored_input_line (struct input *input)
+{
+  if (ignore_regexps == 0)
+    return 0;
+
+  if (input->ignored_lines)
+    return LINE_IGNORED (input, input->line_number - 1);
+
+  return ignored_line (input->line, input->limit - input->line);
+}
+
+/*-------------------------------------------------------------------------.
+| Prepare INPUT for next character, then available through *INPUT->CURSOR, |
+| unless INPUT->CURSOR is NULL for indicating end of file.                 |
+`-------------------------------------------------------------------------*/
+
+static void
+input_character_helper (struct input *input)
+{
+  /* Read in a new line, but skip ignorable ones.  FIXME: This is just not
+     right.  Ignorable lines may need copying!  */
+
+  do
+    input_line (input);
+  while (input->cursor && ignored_input_line (input));
+
+  assert (!input->cursor || input->cursor < input->limit);
+}
+
+static inline void
+input_character (struct input *input)
+{
+  assert (input->cursor);
+  input->cursor++;
+  if (input->cursor == input->limit)
+    input_character_helper (input);
+}
+
+/*---------------------------------------------------------------------.
+| Set *START to where the next item of INPUT begins in the current     |
+| line, from the cursor on, and return its length.  If the item is not |
+| within that line, return zero with *START set to the line limit.     |
+`---------------------------------------------------------------------*/
+
+static inline int
+locate_item (struct input *input, const char **start)
+{
+  /* Items found while studying need not be found again.  */
+
+  if (input->item_offset)
+    {
+      if (input->item < input->item_limit)
+	{
+	  int index = input->item - input->first_item;
+	  off_t offset = input->item_offset[index];
+
+	  if (offset < input->next_offset)
+	    {
+	      *start = input->line + (offset - input->line_offset);
+	      return input->item_length[index];
+	    }
+	}
+      *start = input->limit;
+      return 0;
+    }
+
+  return find_item (input->line, input->cursor, input->limit, start);
+}
+
+/*--------------------------------------------------------------------.
+| Have the ignored lines bitmap of INPUT, of which ALLOCATED bytes    |
+| are already allocated, extend far enough to hold LINE.              |
+`--------------------------------------------------------------------*/
+
+static void
+grow_ignored_lines (struct input *input, size_t *allocated, int line)
+{
+  size_t previous = *allocated;
+
+  while (line / BITS_PER_CHAR >= *allocated)
+    input->ignored_lines = x2nrealloc (input->ignored_lines, allocated, 1);
+  memset (input->ignored_lines + previous, 0, *allocated - previous);
+}
+
+/*-------------------------------------------------------------------.
+| Construct descriptors for all items of a given INPUT file, storing |
+| them into BUFFER.						     |
+`-------------------------------------------------------------------*/
+
+static void
+study_input (struct input *input, struct item_buffer *buffer)
+{
+#if SAVE_AND_SLOW
+# define ADJUST_CHECKSUM(Character)                                \
+  checksum = (checksum << 5) + (checksum >> (BITS_PER_WORD - 5))   \
+    + (Character & 0xFF)
+#else
+  /* For diffs, characters are mixed in by multiplication, as a mere
+     rotation loses the first characters of longer items, once they get
+     shifted out, and a patch would then miss changes in indentation.
+     High bits, which would not fit next to the type, are folded down.  */
+# define ADJUST_CHECKSUM(Character)                                \
+  checksum = (diff_hunks                                           \
+	      ? (checksum ^ (Character & 0xFF)) * 16777619U          \
+	      : (checksum << 5)                                    \
+		+ (checksum >> (BITS_PER_WORD - BITS_PER_TYPE - 5))  \
+		+ (Character & 0xFF))
+# define FOLD_CHECKSUM()                                           \
+  do                                                               \
+    if (diff_hunks)                                                \
+      checksum ^= checksum >> (BITS_PER_WORD - BITS_PER_TYPE);     \
+  while (0)
+#endif
+
+  int item_count;		/* number of items read */
+  size_t bitmap_allocated;	/* allocated bytes in ignored lines bitmap */
+  size_t offsets_allocated;	/* allocated entries in item offsets */
+  size_t functions_allocated;	/* allocated entries in function_array */
+
+  /* Read the file and checksum all items.  */
+
+  open_input (input);
+  item_count = 0;
+  input->ignored_lines = NULL;
+  bitmap_allocated = 0;
+  input->function_array = NULL;
+  input->functions = 0;
+  functions_allocated = 0;
+
+  /* Item positions may only be used if the input can be read again from
+     anywhere.  */
+
+  input->item_offset = NULL;
+  input->item_length = NULL;
+  offsets_allocated = 0;
+  if (input->memory_copy || S_ISREG (input->stat_buffer.st_mode))
+    {
+      offsets_allocated = buffer->allocated;
+      input->item_offset = (off_t *)
+	xmalloc (offsets_allocated * sizeof (off_t));
+      if (word_mode)
+	input->item_length = (int *)
+	  xmalloc (offsets_allocated * sizeof (int));
+    }
+
+#define RECORD_ITEM(Offset, Length)					\
+  do									\
+    if (input->item_offset)						\
+      {									\
+	if (buffer->items > offsets_allocated)				\
+	  {								\
+	    input->item_offset = x2nrealloc (input->item_offset,		\
+					     &offsets_allocated,	\
+					     sizeof (off_t));		\
+	    if (word_mode)						\
+	      input->item_length = xnrealloc (input->item_length,	\
+					      offsets_allocated,	\
+					      sizeof (int));		\
+	  }								\
+	input->item_offset[buffer->items - 1] = (Offset);		\
+	if (word_mode)							\
+	  input->item_length[buffer->items - 1] = (Length);		\
+      }									\
+  while (0)
+
+  /* Read all lines.  */
+
+  while (input_line (input), input->cursor)
+    {
+      /* Save lines which may later head hunks, in line mode, where each
+	 line is an item.  */
+
+      if (function_regexp && !word_mode
+	  && re_search (function_regexp, input->line,
+			input->limit - input->line, 0,
+			input->limit - input->line, NULL) >= 0)
+	{
+	  struct function_line *function;
+	  int length = input->limit - input->line;
+
+	  if (input->functions == functions_allocated)
+	    input->function_array = (struct function_line *)
+	      x2nrealloc (input->function_array, &functions_allocated,
+			  sizeof (struct function_line));
+	  function = input->function_array + input->functions++;
+	  function->item = buffer->items;
+
+	  if (length > FUNCTION_TEXT_SIZE - 4)
+	    length = FUNCTION_TEXT_SIZE - 4;
+	  while (length > 0 && isspace ((unsigned char) input->line[length - 1]))
+	    length--;
+	  memset (function->text, 0, FUNCTION_TEXT_SIZE);
+	  memcpy (function->text, input->line, length);
+	}
+
+      /* Possibly check if the line should be ignored.  Decisions are kept,
+	 so later passes over the file do not match lines again.  */
+
+      if (ignored_line (input->line, input->limit - input->line))
+	{
+	  int line = input->line_number - 1;
+
+	  grow_ignored_lines (input, &bitmap_allocated, line);
+	  input->ignored_lines[line / BITS_PER_CHAR]
+	    |= 1 << line % BITS_PER_CHAR;
+
+	  if (!word_mode)
+	    {
+	      new_item (buffer, WHITE, 0);
+	      RECORD_ITEM (input->line_offset, 0);
+	    }
+	  continue;
+	}
+
+      /* The line is not being ignored.  */
+
+      /* We prefer `cursor < buffer + length' over `*cursor' in the loop
+         tests, so embedded NULs can be handled.  */
+
+      if (word_mode)
+	{
+	  const char *cursor = input->line;
+	  const char *start;
+	  int length;
+	  unsigned checksum;
+
+	  while (length = find_item (input->line, cursor, input->limit,
+				     &start),
+		 length > 0)
+	    {
+	      checksum = 0;
+	      for (cursor = start; cursor < start + length; cursor++)
+		ADJUST_CHECKSUM (*cursor);
+#ifdef FOLD_CHECKSUM
+	      FOLD_CHECKSUM ();
+#endif
+	      new_item (buffer, NORMAL, checksum);
+	      RECORD_ITEM (input->line_offset + (start - input->line), length);
+	      item_count++;
+	    }
+	}
+      else
+	{
+	  char *cursor;
+	  unsigned checksum = 0;
+	  int line_has_delims = 0;
+	  int line_has_alnums = 0;
+
+	  for (cursor = input->line; cursor < input->limit; cursor++)
+	    if (isspace (*cursor))
+	      {
+		if (!ignore_all_space)
+		  {
+		    if (ignore_space_change)
+		      {
+			ADJUST_CHECKSUM (' ');
+			while (cursor + 1 < input->limit
+			       && isspace (cursor[1]))
+			  cursor++;
+		      }
+		    else
+		      ADJUST_CHECKSUM (*cursor);
+		  }
+	      }
+	    else if (isalpha (*cursor))
+	      {
+		line_has_alnums = 1;
+		if (ignore_case && islower (*cursor))
+		  {
+		    char character = toupper (*cursor);
+
+		    ADJUST_CHECKSUM (character);
+		  }
+		else
+		  ADJUST_CHECKSUM (*cursor);
+	      }
+	    else if (isdigit (*cursor))
+	      {
+		line_has_alnums = 1;
+		ADJUST_CHECKSUM (*cursor);
+	      }
+	    else
+	      {
+		line_has_delims = 1;
+		ADJUST_CHECKSUM (*cursor);
+	      }
+
+	  /* Register the checksum.  */
+
+#ifdef FOLD_CHECKSUM
+	  FOLD_CHECKSUM ();
+#endif
+	  if (line_has_alnums)
+	    new_item (buffer, NORMAL, checksum);
+	  else if (line_has_delims)
+	    new_item (buffer, ignore_delimiters ? DELIMS : NORMAL, checksum);
+	  else if (ignore_blank_lines)
+	    new_item (buffer, WHITE, checksum);
+	  else
+	    new_item (buffer, ignore_delimiters ? DELIMS : NORMAL, checksum);
+	  RECORD_ITEM (input->line_offset, 0);
+
+	  item_count++;
+	}
+    }
+
+  buffer->reported = item_count;
+
+  /* Have the bitmap cover all lines, ignored or not.  */
+
+  if (ignore_regexps > 0)
+    grow_ignored_lines (input, &bitmap_allocated, input->line_number);
+  input->line_count = input->line_number;
+
+  /* Cleanup.  */
+
+  close_input (input);
+
+#undef ADJUST_CHECKSUM
+#undef FOLD_CHECKSUM
+#undef RECORD_ITEM
+}
+
+/*------------------------.
+| Study all input files.  |
+`------------------------*/
+
+/* If all input files fit in MAXIMUM_TOTAL_BUFFER, they are all swallowed in
+   memory at once.  Otherwise, they are read from disk one line at a time.
+   A fixed value is far than ideal: we should consider how much real memory
+   space is available, and I do not know how to do this portably.  */
+#define MAXIMUM_TOTAL_BUFFER 500000
+
+/* Item buffers, one per input file, while studying.  */
+static struct item_buffer *study_buffer_array = NULL;
+
+/* If input files should be swallowed before being studied.  */
+static int swallow_all_inputs = 0;
+
+/* Study index.  */
+
+/* With --index, whatever studying found for each input file is saved into
+   an index file, so later runs over the same files may skip studying them.
+   The index is merely a memory image, mapped back as is, and only good for
+   the kind of machine which wrote it.  Entries are keyed by file name, and
+   an entry is only reused if the size, modification time and status change
+   time of its file did not change, and if the index was written under the
+   same options.  Times are compared to the nanosecond where the system
+   records them, as a file may well be rewritten within the same second,
+   and the status change time cannot be set back the way the modification
+   time may.  Entries for files not compared in the current run are kept.  */
+
+#define INDEX_MAGIC "mdiff index 3\n"
+
+#if HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+# define STAT_MTIME_NS(Stat) ((Stat).st_mtim.tv_nsec)
+# define STAT_CTIME_NS(Stat) ((Stat).st_ctim.tv_nsec)
+#else
+# define STAT_MTIME_NS(Stat) 0
+# define STAT_CTIME_NS(Stat) 0
+#endif
+
+/* Data layout checked when reading an index, including byte order.  */
+#define INDEX_LAYOUT \
+  ((unsigned) (sizeof (off_t) << 24 | sizeof (struct index_entry) << 16 \
+	       | 0x0102))
+
+#define INDEX_ALIGN(Size) (((Size) + 7) & ~(size_t) 7)
+
+/* Presence of optional arrays in an entry.  */
+#define INDEX_OFFSETS 1		/* item offsets */
+#define INDEX_LENGTHS 2		/* item lengths, word mode only */
+#define INDEX_IGNORED 4		/* ignored lines bitmap */
+#define INDEX_FUNCTIONS 8	/* lines matching -F */
+
+struct index_header
+{
+  char magic[16];		/* INDEX_MAGIC, padded with NULs */
+  unsigned layout;		/* INDEX_LAYOUT */
+  unsigned options_length;	/* length of options string */
+  unsigned long long entries;	/* number of entries */
+};
+
+/* Each entry is followed by the file name with its NUL, then item
+   checksums, item types, and optional arrays, each padded to 8 bytes.  */
+
+struct index_entry
+{
+  unsigned long long size;	/* file size */
+  long long mtime;		/* file modification time */
+  long long ctime;		/* file status change time */
+  int mtime_ns;			/* nanoseconds of modification time */
+  int ctime_ns;			/* nanoseconds of status change time */
+  unsigned long long hash;	/* hash of counts and arrays, as a check */
+  unsigned name_length;		/* length of file name */
+  int items;			/* number of items */
+  int reported;			/* item count to report when verbose */
+  int lines;			/* number of lines */
+  int flags;			/* INDEX_OFFSETS, INDEX_LENGTHS, etc. */
+  int functions;		/* number of lines matching -F */
+};
+
+/* Entries, as found in the mapped index.  */
+
+struct indexed_file
+{
+  const char *name;		/* file name */
+  const struct index_entry *entry; /* entry header */
+  const unsigned *checksums;	/* item checksums */
+  const unsigned char *types;	/* item types */
+  const off_t *offsets;		/* item offsets, or NULL */
+  const int *lengths;		/* item lengths, or NULL */
+  const unsigned char *ignored;	/* ignored lines bitmap, or NULL */
+  const struct function_line *functions; /* lines matching -F, or NULL */
+  size_t length;		/* total length of entry in index */
+};
+
+static struct indexed_file *indexed_array = NULL;
+static int indexed_files = 0;
+
+/* A shard is an index written by --build-shard, holding entries for all
+   files it studied, in order, followed by a trailer and the sorted seeds
+   of its own compact view.  Many shards are built separately, each by its
+   own process, then --merge-shards restores all their files in order and
+   merges their sorted seeds, which is much cheaper than sorting again.
+   As all files are surrounded by sentinels, runs of checksums compare the
+   same way within a shard as within the whole.  */
+
+#define SHARD_MAGIC "mdiff shard 1\n"
+
+struct shard_trailer
+{
+  char magic[16];		/* SHARD_MAGIC, padded with NULs */
+  unsigned long long compact_items; /* entries in shard compact view */
+  unsigned long long sorted;	/* number of sorted seeds */
+};
+
+/* Shards, as found while merging.  */
+
+struct shard
+{
+  const char *name;		/* shard file name */
+  const int *sorted_array;	/* sorted seeds, in shard compact view */
+  int sorted;			/* number of entries in sorted_array */
+  int compact_items;		/* entries in shard compact view */
+  int base;			/* offset of shard within whole compact view */
+  int cursor;			/* next entry in sorted_array, while merging */
+};
+
+static struct shard *shard_array = NULL;
+static int shards = 0;
+
+/*-------------------------------------------------------------------.
+| Return a string representing all options which alter studying, so  |
+| an index written under different options is not used.		     |
+`-------------------------------------------------------------------*/
+
+static char *
+index_options (void)
+{
+  size_t length = 64;
+  char *string;
+  char *cursor;
+  int counter;
+
+  if (item_regexp_string)
+    length += strlen (item_regexp_string) + 3;
+  for (counter = 0; counter < ignore_regexps; counter++)
+    length += strlen (ignore_string_array[counter]) + 3;
+  if (show_function_line)
+    length += strlen (show_function_line) + 3;
+
+  string = xmalloc (length);
+  cursor = string;
+  cursor += sprintf (cursor, "W%dw%db%dB%di%dj%dD%d\n", word_mode,
+		     ignore_all_space, ignore_space_change, ignore_blank_lines,
+		     ignore_case, ignore_delimiters, diff_hunks);
+  if (item_regexp_string)
+    cursor += sprintf (cursor, "O %s\n", item_regexp_string);
+  for (counter = 0; counter < ignore_regexps; counter++)
+    cursor += sprintf (cursor, "I %s\n", ignore_string_array[counter]);
+  if (show_function_line)
+    cursor += sprintf (cursor, "F %s\n", show_function_line);
+
+  return string;
+}
+
+/*---------------------------------------------------------.
+| Return HASH updated with the SIZE bytes found at DATA.   |
+`---------------------------------------------------------*/
+
+static unsigned long long
+hash_index_data (unsigned long long hash, const void *data, size_t size)
+{
+  const unsigned char *cursor = (const unsigned char *) data;
+  const unsigned char *limit = cursor + size;
+
+  for (; cursor < limit; cursor++)
+    hash = (hash ^ *cursor) * 1099511628211ULL;
+
+  return hash;
+}
+
+/*-----------------------------------------------------------------------.
+| Return a hash of all counts and arrays of the INDEXED entry, which get |
+| used as they are once the entry is reused.				 |
+`-----------------------------------------------------------------------*/
+
+static unsigned long long
+hash_indexed_file (const struct indexed_file *indexed)
+{
+  const struct index_entry *entry = indexed->entry;
+  unsigned long long hash = 14695981039346656037ULL;
+  size_t items = entry->items;
+
+  hash = hash_index_data (hash, &entry->items, sizeof entry->items);
+  hash = hash_index_data (hash, &entry->reported, sizeof entry->reported);
+  hash = hash_index_data (hash, &entry->lines, sizeof entry->lines);
+  hash = hash_index_data (hash, &entry->flags, sizeof entry->flags);
+  hash = hash_index_data (hash, &entry->functions, sizeof entry->functions);
+  hash = hash_index_data (hash, indexed->checksums, items * sizeof (unsigned));
+  hash = hash_index_data (hash, indexed->types, items);
+  if (indexed->offsets)
+    hash = hash_index_data (hash, indexed->offsets, items * sizeof (off_t));
+  if (indexed->lengths)
+    hash = hash_index_data (hash, indexed->lengths, items * sizeof (int));
+  if (indexed->ignored)
+    hash = hash_index_data (hash, indexed->ignored,
+			    entry->lines / BITS_PER_CHAR + 1);
+  if (indexed->functions)
+    hash = hash_index_data (hash, indexed->functions,
+			    entry->functions * sizeof (struct function_line));
+
+  return hash;
+}
+
+/*---------------------------------------------------------------------.
+| Return nonzero if the arrays of the INDEXED entry make sense for a   |
+| file of its recorded size, so it may not derail comparisons.	       |
+`---------------------------------------------------------------------*/
+
+static int
+check_indexed_file (const struct indexed_file *indexed)
+{
+  const struct index_entry *entry = indexed->entry;
+  off_t size = entry->size;
+  off_t previous = 0;
+  int counter;
+
+  if (entry->reported < 0 || entry->reported > entry->items)
+    return 0;
+
+  for (counter = 0; counter < entry->items; counter++)
+    {
+      if (indexed->types[counter] >= SENTINEL)
+	return 0;
+      if (indexed->offsets)
+	{
+	  off_t offset = indexed->offsets[counter];
+
+	  if (offset < previous || offset > size)
+	    return 0;
+	  if (indexed->lengths && (indexed->lengths[counter] < 0
+				   || indexed->lengths[counter]
+				   > size - offset))
+	    return 0;
+	  previous = offset;
+	}
+    }
+
+  for (counter = 0; counter < entry->functions; counter++)
+    if (indexed->functions[counter].item < 0
+	|| indexed->functions[counter].item >= entry->items)
+      return 0;
+
+  return 1;
+}
+
+static int
+compare_for_indexed_names (const void *void_first, const void *void_second)
+{
+  return strcmp (((const struct indexed_file *) void_first)->name,
+		 ((const struct indexed_file *) void_second)->name);
+}
+
+/*-----------------------------------------------------------------------.
+| Map index file NAME and append its entries to INDEXED_ARRAY.  Set      |
+| *REST to whatever follows entries in the file, and *LIMIT to its end.  |
+| Return zero if the file may not be used, in which case only complain   |
+| if COMPLAIN is nonzero: a missing index, or one written elsewhere or   |
+| under other options, may be merely ignored.                            |
+`-----------------------------------------------------------------------*/
+
+static int
+map_index_file (const char *name, int complain,
+		const char **rest, const char **limit)
+{
+  int handle;
+  struct stat stat_buffer;
+  const char *map;
+  const char *cursor;
+  const struct index_header *header;
+  char *options;
+  unsigned long long counter;
+  int first_entry = indexed_files;
+
+  handle = open (name, O_RDONLY);
+  if (handle < 0)
+    {
+      if (complain || errno != ENOENT)
+	error (complain ? EXIT_ERROR : 0, errno, "%s", name);
+      return 0;
+    }
+  if (fstat (handle, &stat_buffer) != 0)
+    error (EXIT_ERROR, errno, "%s", name);
+  if (stat_buffer.st_size < (off_t) sizeof (struct index_header))
+    {
+      close (handle);
+      goto unusable;
+    }
+  map = mmap (NULL, stat_buffer.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+  close (handle);
+  if (map == MAP_FAILED)
+    error (EXIT_ERROR, errno, "%s", name);
+
+  /* Check that the index may be used.  */
+
+  header = (const struct index_header *) map;
+  *limit = map + stat_buffer.st_size;
+  cursor = map + sizeof (struct index_header);
+  options = index_options ();
+
+  if (strncmp (header->magic, INDEX_MAGIC, sizeof header->magic) != 0
+      || header->layout != INDEX_LAYOUT
+      || header->options_length != strlen (options)
+      || *limit - cursor < INDEX_ALIGN (header->options_length)
+      || memcmp (cursor, options, header->options_length) != 0)
+    {
+      free (options);
+      munmap ((void *) map, stat_buffer.st_size);
+      goto unusable;
+    }
+  free (options);
+  cursor += INDEX_ALIGN (header->options_length);
+
+  /* Locate all entries.  */
+
+  if (header->entries > (*limit - cursor) / sizeof (struct index_entry))
+    goto corrupted;
+  indexed_array = (struct indexed_file *)
+    xrealloc (indexed_array, ((indexed_files + header->entries + 1)
+			      * sizeof (struct indexed_file)));
+
+  for (counter = 0; counter < header->entries; counter++)
+    {
+      struct indexed_file *indexed = indexed_array + indexed_files;
+      const struct index_entry *entry = (const struct index_entry *) cursor;
+      const char *start = cursor;
+      size_t items;
+
+#define TAKE(Pointer, Type, Count)					\
+      do								\
+	{								\
+	  size_t length = INDEX_ALIGN ((Count) * sizeof (Type));	\
+									\
+	  if (*limit - cursor < length)					\
+	    goto corrupted;						\
+	  Pointer = (const Type *) cursor;				\
+	  cursor += length;						\
+	}								\
+      while (0)
+
+      if (*limit - cursor < sizeof (struct index_entry)
+	  || entry->items < 0 || entry->lines < 0 || entry->functions < 0)
+	goto corrupted;
+      cursor += sizeof (struct index_entry);
+      items = entry->items;
+
+      indexed->entry = entry;
+      TAKE (indexed->name, char, entry->name_length + 1);
+      TAKE (indexed->checksums, unsigned, items);
+      TAKE (indexed->types, unsigned char, items);
+      indexed->offsets = NULL;
+      if (entry->flags & INDEX_OFFSETS)
+	TAKE (indexed->offsets, off_t, items);
+      indexed->lengths = NULL;
+      if (entry->flags & INDEX_LENGTHS)
+	TAKE (indexed->lengths, int, items);
+      indexed->ignored = NULL;
+      if (entry->flags & INDEX_IGNORED)
+	TAKE (indexed->ignored, unsigned char,
+	      entry->lines / BITS_PER_CHAR + 1);
+      indexed->functions = NULL;
+      if (entry->flags & INDEX_FUNCTIONS)
+	TAKE (indexed->functions, struct function_line, entry->functions);
+#undef TAKE
+
+      if (indexed->name[entry->name_length] != '\0')
+	goto corrupted;
+      indexed->length = cursor - start;
+      indexed_files++;
+    }
+
+  *rest = cursor;
+  return 1;
+
+corrupted:
+  if (complain)
+    error (EXIT_ERROR, 0, _("%s: corrupted shard"), name);
+  error (0, 0, _("%s: corrupted index, ignored"), name);
+
+  /* Forget entries already located, they point into the mapping.  */
+
+  indexed_files = first_entry;
+  munmap ((void *) map, stat_buffer.st_size);
+  return 0;
+
+unusable:
+  if (complain)
+    error (EXIT_ERROR, 0, _("%s: not written by this program, on this \
+kind of machine, with these options"), name);
+  return 0;
+}
+
+/*--------------------------------------------------------------------.
+| Load the index file, if any.  Entries get sorted by name, for quick |
+| lookups.							      |
+`--------------------------------------------------------------------*/
+
+static void
+load_index (void)
+{
+  const char *rest;
+  const char *limit;
+
+  if (!map_index_file (index_name, 0, &rest, &limit))
+    indexed_files = 0;
+
+  if (indexed_files > 0)
+    qsort (indexed_array, indexed_files, sizeof (struct indexed_file),
+	   compare_for_indexed_names);
+}
+
+/*------------------------------------------------------------------------.
+| Load all COUNT shards named in NAME_ARRAY, registering their files as   |
+| inputs, in order.  Entries then get sorted by name, as for an index.    |
+`------------------------------------------------------------------------*/
+
+static void
+load_shards (int count, char *const *name_array)
+{
+  struct shard *shard;
+  int base = 0;
+
+  shard_array = (struct shard *) xmalloc (count * sizeof (struct shard));
+
+  for (shard = shard_array; shard < shard_array + count; shard++)
+    {
+      const char *cursor;
+      const char *limit;
+      const struct shard_trailer *trailer;
+      int first_entry = indexed_files;
+      int counter;
+
+      shard->name = name_array[shard - shard_array];
+      map_index_file (shard->name, 1, &cursor, &limit);
+
+      trailer = (const struct shard_trailer *) cursor;
+      if (limit - cursor < sizeof (struct shard_trailer)
+	  || strncmp (trailer->magic, SHARD_MAGIC, sizeof trailer->magic) != 0)
+	error (EXIT_ERROR, 0, _("%s: not a shard"), shard->name);
+      cursor += sizeof (struct shard_trailer);
+
+      if (trailer->compact_items < 2 || trailer->compact_items > INT_MAX
+	  || trailer->sorted > trailer->compact_items
+	  || limit - cursor < trailer->sorted * sizeof (int))
+	error (EXIT_ERROR, 0, _("%s: corrupted shard"), shard->name);
+
+      shard->sorted_array = (const int *) cursor;
+      shard->sorted = trailer->sorted;
+      shard->compact_items = trailer->compact_items;
+      for (counter = 0; counter < shard->sorted; counter++)
+	if (shard->sorted_array[counter] <= 0
+	    || shard->sorted_array[counter] >= shard->compact_items - 1)
+	  error (EXIT_ERROR, 0, _("%s: corrupted shard"), shard->name);
+
+      /* Consecutive shards share the sentinel between them.  */
+
+      shard->base = base;
+      base += shard->compact_items - 1;
+      shard->cursor = 0;
+      shards++;
+
+      for (counter = first_entry; counter < indexed_files; counter++)
+	new_input (indexed_array[counter].name);
+    }
+
+  if (indexed_files > 0)
+    qsort (indexed_array, indexed_files, sizeof (struct indexed_file),
+	   compare_for_indexed_names);
+}
+
+/*----------------------------------------------------------------------.
+| Return the index entry which INPUT may reuse instead of being studied |
+| again, or NULL if none.						|
+`----------------------------------------------------------------------*/
+
+static const struct indexed_file *
+find_indexed_file (struct input *input)
+{
+  struct indexed_file key;
+  const struct indexed_file *indexed;
+
+  if (indexed_files == 0 || input->memory_copy
+      || !S_ISREG (input->stat_buffer.st_mode))
+    return NULL;
+
+  key.name = input->file_name;
+  indexed = bsearch (&key, indexed_array, indexed_files,
+		     sizeof (struct indexed_file), compare_for_indexed_names);
+
+  if (!indexed
+      || indexed->entry->size != input->stat_buffer.st_size
+      || indexed->entry->mtime != input->stat_buffer.st_mtime
+      || indexed->entry->mtime_ns != STAT_MTIME_NS (input->stat_buffer)
+      || indexed->entry->ctime != input->stat_buffer.st_ctime
+      || indexed->entry->ctime_ns != STAT_CTIME_NS (input->stat_buffer)
+      || indexed->entry->hash != hash_indexed_file (indexed)
+      || !check_indexed_file (indexed))
+    return NULL;
+
+  return indexed;
+}
+
+/*----------------------------------------------------------------.
+| Fill BUFFER for INPUT with items saved in the INDEXED entry.    |
+`----------------------------------------------------------------*/
+
+static void
+restore_indexed_file (struct input *input,
+		      const struct indexed_file *indexed,
+		      struct item_buffer *buffer)
+{
+  int counter;
+
+  for (counter = 0; counter < indexed->entry->items; counter++)
+    new_item (buffer, (enum type) indexed->types[counter],
+	      indexed->checksums[counter]);
+  buffer->reported = indexed->entry->reported;
+
+  /* The mapped index stays around, its arrays are used as they are.  */
+
+  input->item_offset = (off_t *) indexed->offsets;
+  input->item_length = (int *) indexed->lengths;
+  input->ignored_lines = (unsigned char *) indexed->ignored;
+  input->function_array = (struct function_line *) indexed->functions;
+  input->functions = indexed->entry->functions;
+  input->line_count = indexed->entry->lines;
+}
+
+/*-------------------------------------------------.
+| Write SIZE bytes from DATA into FILE, padded.    |
+`-------------------------------------------------*/
+
+static void
+write_index_data (FILE *file, const void *data, size_t size)
+{
+  static const char zeroes[8];
+
+  fwrite (data, size, 1, file);
+  fwrite (zeroes, INDEX_ALIGN (size) - size, 1, file);
+}
+
+/*---------------------------------------------------------------.
+| Write into FILE an index header announcing ENTRIES entries.    |
+`---------------------------------------------------------------*/
+
+static void
+write_index_header (FILE *file, unsigned long long entries)
+{
+  struct index_header header;
+  char *options = index_options ();
+
+  memset (&header, 0, sizeof header);
+  strncpy (header.magic, INDEX_MAGIC, sizeof header.magic);
+  header.layout = INDEX_LAYOUT;
+  header.options_length = strlen (options);
+  header.entries = entries;
+  write_index_data (file, &header, sizeof header);
+  write_index_data (file, options, header.options_length);
+  free (options);
+}
+
+/*----------------------------------------------------------------.
+| Write into FILE an index entry for INPUT, once fully studied.   |
+`----------------------------------------------------------------*/
+
+static void
+write_index_entry (FILE *file, struct input *input)
+{
+  struct index_entry entry;
+  struct indexed_file indexed;
+  int items = input->item_limit - input->first_item;
+  ITEM *item = item_array + input->first_item;
+  unsigned *checksum_array;
+  unsigned char *type_array;
+  int counter;
+
+  checksum_array = (unsigned *) xmalloc (items * sizeof (unsigned) + 1);
+  type_array = (unsigned char *) xmalloc (items + 1);
+  for (counter = 0; counter < items; counter++)
+    {
+      checksum_array[counter] = item[counter].checksum;
+      type_array[counter] = item_type (item + counter);
+    }
+
+  memset (&entry, 0, sizeof entry);
+  entry.size = input->stat_buffer.st_size;
+  entry.mtime = input->stat_buffer.st_mtime;
+  entry.mtime_ns = STAT_MTIME_NS (input->stat_buffer);
+  entry.ctime = input->stat_buffer.st_ctime;
+  entry.ctime_ns = STAT_CTIME_NS (input->stat_buffer);
+  entry.name_length = strlen (input->file_name);
+  entry.items = items;
+  entry.reported = input->reported_items;
+  entry.lines = input->line_count;
+  if (input->item_offset)
+    entry.flags |= INDEX_OFFSETS;
+  if (input->item_length)
+    entry.flags |= INDEX_LENGTHS;
+  if (input->ignored_lines)
+    entry.flags |= INDEX_IGNORED;
+  if (input->function_array)
+    entry.flags |= INDEX_FUNCTIONS;
+  entry.functions = input->functions;
+
+  /* Hash arrays as they are about to be written.  */
+
+  indexed.entry = &entry;
+  indexed.checksums = checksum_array;
+  indexed.types = type_array;
+  indexed.offsets = input->item_offset;
+  indexed.lengths = input->item_length;
+  indexed.ignored = input->ignored_lines;
+  indexed.functions = input->function_array;
+  entry.hash = hash_indexed_file (&indexed);
+
+  write_index_data (file, &entry, sizeof entry);
+  write_index_data (file, input->file_name, entry.name_length + 1);
+  write_index_data (file, checksum_array, items * sizeof (unsigned));
+  write_index_data (file, type_array, items);
+  if (input->item_offset)
+    write_index_data (file, input->item_offset, items * sizeof (off_t));
+  if (input->item_length)
+    write_index_data (file, input->item_length, items * sizeof (int));
+  if (input->ignored_lines)
+    write_index_data (file, input->ignored_lines,
+		      entry.lines / BITS_PER_CHAR + 1);
+  if (input->function_array)
+    write_index_data (file, input->function_array,
+		      input->functions * sizeof (struct function_line));
+
+  free (checksum_array);
+  free (type_array);
+}
+
+/*----------------------------------------------------------------------.
+| Write the index file anew, with entries for all indexable inputs, and |
+| old entries for other files.  The old index only gets replaced once   |
+| the new one is complete.						|
+`----------------------------------------------------------------------*/
+
+static void
+save_index (void)
+{
+  struct input *input;
+  unsigned long long entries;
+  char *new_name;
+  char *kept_array;		/* if old entry is to be copied */
+  FILE *file;
+  int counter;
+
+  /* Old entries are kept, unless their file got studied anew.  */
+
+  kept_array = xmalloc (indexed_files + 1);
+  memset (kept_array, 1, indexed_files);
+  entries = 0;
+  for (input = input_array; input < input_array + inputs; input++)
+    if (input->indexable)
+      {
+	if (indexed_files > 0)
+	  {
+	    struct indexed_file key;
+	    const struct indexed_file *indexed;
+
+	    key.name = input->file_name;
+	    indexed = bsearch (&key, indexed_array, indexed_files,
+			       sizeof (struct indexed_file),
+			       compare_for_indexed_names);
+	    if (indexed)
+	      kept_array[indexed - indexed_array] = 0;
+	  }
+	entries++;
+      }
+  for (counter = 0; counter < indexed_files; counter++)
+    if (kept_array[counter])
+      entries++;
+
+  new_name = xmalloc (strlen (index_name) + 5);
+  sprintf (new_name, "%s.new", index_name);
+  file = fopen (new_name, "w");
+  if (!file)
+    error (EXIT_ERROR, errno, "%s", new_name);
+
+  write_index_header (file, entries);
+  for (input = input_array; input < input_array + inputs; input++)
+    if (input->indexable)
+      write_index_entry (file, input);
+
+  /* Copy other old entries as they are.  */
+
+  for (counter = 0; counter < indexed_files; counter++)
+    if (kept_array[counter])
+      fwrite (indexed_array[counter].entry, indexed_array[counter].length, 1,
+	      file);
+
+  if (ferror (file) || fclose (file) != 0)
+    error (EXIT_ERROR, errno, "%s", new_name);
+  if (rename (new_name, index_name) != 0)
+    error (EXIT_ERROR, errno, "%s", index_name);
+
+  free (new_name);
+  free (kept_array);
+}
+
+
+/*--------------------------------------------------------------------.
+| Study input number JOB into its own item buffer.  As buffers are    |
+| not shared, many such jobs may run at once.			      |
+`--------------------------------------------------------------------*/
+
+static void
+study_job (int job)
+{
+  struct input *input = input_array + job;
+  const struct indexed_file *indexed = NULL;
+
+  /* Inputs already in memory are standard input or missing files, these
+     are never indexed.  */
+
+  input->indexable = !input->memory_copy
+    && S_ISREG (input->stat_buffer.st_mode);
+  if (input->indexable)
+    indexed = find_indexed_file (input);
+  input->from_index = indexed != NULL;
+
+  size_item_buffer (study_buffer_array + job, input->stat_buffer.st_size);
+  if (indexed)
+    {
+      restore_indexed_file (input, indexed, study_buffer_array + job);
+      return;
+    }
+
+  if (swallow_all_inputs && !input->memory_copy)
+    swallow_input (input);
+  study_input (input, study_buffer_array + job);
+}
+
+static void
+study_all_inputs (void)
+{
+  struct input *input;
+  struct item_buffer *buffer;
+  off_t total_size;
+  int total_items;
+
+  /* Compute nick names for all files.  */
+
+  if (inputs == 2)
+    {
+      /* If only two input files, just mimick `diff' output.  */
+
+      strcpy (input_array[0].nick_name, "-");
+      strcpy (input_array[1].nick_name, "+");
+    }
+  else
+    {
+      int name_length = 1;
+      int file_limit = 26;
+
+      /* Choose nick names as sequences of lower case letters.  */
+
+      while (inputs > file_limit)
+	{
+	  name_length++;
+	  file_limit *= 26;
+	}
+
+      for (input = input_array; input < input_array + inputs; input++)
+	{
+	  int value = input - input_array;
+	  char *cursor = input->nick_name + name_length;
+
+	  *cursor-- = '\0';
+	  while (cursor >= input->nick_name)
+	    {
+	      *cursor-- = value % 26 + 'a';
+	      value /= 26;
+	    }
+	}
+    }
+
+  /* Swallow all files not already copied in memory, if room permits.  */
+
+  total_size = 0;
+  for (input = input_array; input < input_array + inputs; input++)
+    total_size += input->stat_buffer.st_size;
+
+  swallow_all_inputs = total_size <= MAXIMUM_TOTAL_BUFFER;
+
+  /* Compute all checksums, possibly studying many inputs in parallel.  */
+
+  study_buffer_array = (struct item_buffer *)
+    xmalloc (inputs * sizeof (struct item_buffer));
+  memset (study_buffer_array, 0, inputs * sizeof (struct item_buffer));
+
+  if (index_name)
+    load_index ();
+
+  run_in_parallel (study_job, inputs);
+
+  /* When merging shards, all their files should be exactly as studied.  */
+
+  if (merge_shards)
+    for (input = input_array; input < input_array + inputs; input++)
+      if (!input->from_index)
+	error (EXIT_ERROR, 0, _("%s: changed since its shard was built"),
+	       input->file_name);
+
+  /* Gather all items into a single array, in input order, with a sentinel
+     before the first file, one between each file, and one after the last
+     file.  The numbering is then the same as if files were studied one
+     after another.  */
+
+  total_items = inputs + 1;
+  for (buffer = study_buffer_array;
+       buffer < study_buffer_array + inputs; buffer++)
+    total_items += buffer->items;
+
+  item_array = (ITEM *) xmalloc (total_items * sizeof (ITEM));
+#if SAFER_SLOWER
+  type_array = (unsigned *)
+    xmalloc ((total_items / TYPES_PER_WORD + 1) * sizeof (unsigned));
+#endif
+  items = 0;
+
+  new_sentinel ();
+  for (input = input_array; input < input_array + inputs; input++)
+    {
+      buffer = study_buffer_array + (input - input_array);
+
+      if (verbose)
+	{
+	  fprintf (stderr, _("Reading %s"), input->file_name);
+	  fprintf (stderr, ngettext (", %d item\n", ", %d items\n",
+				     buffer->reported), buffer->reported);
+	}
+
+      input->first_item = items;
+      input->reported_items = buffer->reported;
+      copy_item_buffer (buffer);
+      input->item_limit = items;
+      new_sentinel ();
+    }
+
+  /* Save the index if anything got studied anew.  */
+
+  if (index_name)
+    {
+      int reused = 0;
+      int studied = 0;
+
+      for (input = input_array; input < input_array + inputs; input++)
+	if (input->from_index)
+	  reused++;
+	else if (input->indexable)
+	  studied++;
+
+      if (studied > 0)
+	save_index ();
+
+      if (verbose)
+	{
+	  fprintf (stderr, _("Index summary:"));
+	  fprintf (stderr, ngettext (" %d file reused,", " %d files reused,",
+				     reused), reused);
+	  fprintf (stderr, ngettext (" %d file studied\n",
+				     " %d files studied\n", studied), studied);
+	}
+    }
+
+  free (study_buffer_array);
+  study_buffer_array = NULL;
+
+  prepare_item_index ();
+
+  if (verbose)
+    {
+      fprintf (stderr, _("Read summary:"));
+      fprintf (stderr, ngettext (" %d file,", " %d files,", inputs), inputs);
+      fprintf (stderr, ngettext (" %d item\n", " %d items\n",
+				 items - inputs - 1), items - inputs - 1);
+    }
+
+#if DEBUGGING
+  if (debugging)
+    {
+      dump_all_items ();
+      dump_all_inputs ();
+    }
+#endif
+}
+
+/* Whole input comparisons.  */
+
+/* When merely asked whether inputs differ, each input after the first is
+   compared, as a whole, with the first input, and no clustering occurs.
+   Unless some differences are to be ignored, inputs get reduced to their
+   size and a hash of their contents, computed while streaming through them.
+   Otherwise, inputs are studied as usual, and get reduced to the sequence
+   of checksums of their items, ignored items excepted.  */
+
+/* Define to the size of chunks read while hashing a file, a multiple of
+   the size of hashed words.  */
+#define HASH_BUFFER_SIZE (64 * 1024)
+
+/* Multiplier for mixing hashed words, from the golden ratio.  */
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+/*-------------------------------------------------------------------.
+| Return HASH updated with the LENGTH bytes at BLOCK.  Hashing whole |
+| contents at once or in pieces gives the same result, provided all  |
+| pieces but the last have a length multiple of a word size.	     |
+`-------------------------------------------------------------------*/
+
+static unsigned long long
+hash_block (unsigned long long hash, const char *block, size_t length)
+{
+  unsigned long long word;
+
+  for (; length >= sizeof word; block += sizeof word, length -= sizeof word)
+    {
+      memcpy (&word, block, sizeof word);
+      hash = (hash ^ word) * HASH_MULTIPLIER;
+      hash ^= hash >> 29;
+    }
+  for (; length > 0; block++, length--)
+    {
+      hash = (hash ^ (unsigned char) *block) * HASH_MULTIPLIER;
+      hash ^= hash >> 29;
+    }
+  return hash;
+}
+
+/*-------------------------------------------------------------------.
+| Hash the contents of input number JOB.  As nothing is shared, many |
+| such jobs may run at once.					     |
+`-------------------------------------------------------------------*/
+
+static void
+hash_job (int job)
+{
+  struct input *input = input_array + job;
+  unsigned long long hash = 0;
+  int handle;			/* file descriptor number */
+  char *buffer;			/* chunk of file being hashed */
+  size_t length;		/* length of chunk read so far */
+  ssize_t read_length;		/* number of characters gotten on last read */
+
+  /* Standard input is already copied in memory.  */
+
+  if (input->memory_copy)
+    {
+      input->content_hash = hash_block (hash, input->memory_copy,
+					input->stat_buffer.st_size);
+      return;
+    }
+
+  if (handle = open (input->file_name, O_RDONLY), handle < 0)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+#if HAVE_POSIX_FADVISE
+  posix_fadvise (handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  /* Only fill chunks completely, so words get aligned the same way as if
+     the file was copied in memory.  */
+
+  buffer = (char *) xmalloc (HASH_BUFFER_SIZE);
+  do
+    {
+      length = 0;
+      while (length < HASH_BUFFER_SIZE
+	     && (read_length = read (handle, buffer + length,
+				     HASH_BUFFER_SIZE - length)) > 0)
+	length += read_length;
+      if (read_length < 0)
+	error (EXIT_ERROR, errno, "%s", input->file_name);
+      hash = hash_block (hash, buffer, length);
+      input->bytes_read += length;
+    }
+  while (length == HASH_BUFFER_SIZE);
+
+  free (buffer);
+  close (handle);
+  input->content_hash = hash;
+}
+
+/*-----------------------------------------------------------------.
+| Return non-zero if some option asks for ignoring differences, so |
+| inputs should be compared through their item checksums.	   |
+`-----------------------------------------------------------------*/
+
+static int
+comparing_items (void)
+{
+  return (ignore_all_space || ignore_blank_lines || ignore_case
+	  || ignore_regexps > 0 || ignore_space_change || word_mode);
+}
+
+/*-------------------------------------------------------------------.
+| Hash the checksums of all non-white items of an already studied    |
+| INPUT.							     |
+`-------------------------------------------------------------------*/
+
+static void
+hash_input_items (struct input *input)
+{
+  unsigned long long hash = 0;
+  int count = 0;
+  ITEM *item;
+
+  for (item = item_array + input->first_item;
+       item < item_array + input->item_limit; item++)
+    if (item_type (item) != WHITE)
+      {
+	hash = (hash ^ item->checksum) * HASH_MULTIPLIER;
+	hash ^= hash >> 29;
+	count++;
+      }
+
+  input->content_hash = hash;
+  input->content_items = count;
+}
+
+/*-------------------------------------------------------------------.
+| Return non-zero if both studied inputs have the same non-white     |
+| items, when comparing through item checksums.			     |
+`-------------------------------------------------------------------*/
+
+static int
+same_input_items (struct input *input1, struct input *input2)
+{
+  ITEM *item1 = item_array + input1->first_item;
+  ITEM *item2 = item_array + input2->first_item;
+  ITEM *limit1 = item_array + input1->item_limit;
+  ITEM *limit2 = item_array + input2->item_limit;
+
+  while (1)
+    {
+      while (item1 < limit1 && item_type (item1) == WHITE)
+	item1++;
+      while (item2 < limit2 && item_type (item2) == WHITE)
+	item2++;
+      if (item1 == limit1 || item2 == limit2)
+	return item1 == limit1 && item2 == limit2;
+      if (item1->checksum != item2->checksum)
+	return 0;
+      item1++;
+      item2++;
+    }
+}
+
+/*------------------------------------------------------------------.
+| Open INPUT for comparing its bytes, returning a file descriptor,  |
+| or -1 if the input is already copied in memory.		    |
+`------------------------------------------------------------------*/
+
+static int
+open_input_contents (struct input *input)
+{
+  int handle;
+
+  if (input->memory_copy)
+    return -1;
+
+  if (handle = open (input->file_name, O_RDONLY), handle < 0)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+#if HAVE_POSIX_FADVISE
+  posix_fadvise (handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  return handle;
+}
+
+/*----------------------------------------------------------------------.
+| Return LENGTH bytes of INPUT found at OFFSET, reading them from       |
+| HANDLE into BUFFER unless INPUT is in memory.  Return NULL if the     |
+| file got shorter than it was.						|
+`----------------------------------------------------------------------*/
+
+static const char *
+read_input_contents (struct input *input, int handle, char *buffer,
+		     off_t offset, size_t length)
+{
+  size_t done = 0;		/* length read so far */
+  ssize_t read_length;		/* number of characters gotten on last read */
+
+  if (input->memory_copy)
+    return input->memory_copy + offset;
+
+  while (done < length)
+    {
+      read_length = read (handle, buffer + done, length - done);
+      if (read_length < 0)
+	error (EXIT_ERROR, errno, "%s", input->file_name);
+      if (read_length == 0)
+	return NULL;
+      done += read_length;
+    }
+
+  input->bytes_read += length;
+  return buffer;
+}
+
+/*-------------------------------------------------------------------.
+| Return non-zero if INPUT1 and INPUT2, already known to have the    |
+| same size and hash, really have the same bytes.  Hashes may        |
+| collide, so equal hashes alone never prove inputs identical.	     |
+`-------------------------------------------------------------------*/
+
+static int
+same_input_contents (struct input *input1, struct input *input2)
 {
-  if (input->line_allocated > 0)
-    free (input->line);
+  int handle1 = open_input_contents (input1);
+  int handle2 = open_input_contents (input2);
+  char *buffer1 = (char *) xmalloc (HASH_BUFFER_SIZE);
+  char *buffer2 = (char *) xmalloc (HASH_BUFFER_SIZE);
+  off_t size = input1->stat_buffer.st_size;
+  off_t offset;
+  size_t length;
+  const char *chunk1;
+  const char *chunk2;
+  int same = 1;
+
+  for (offset = 0; same && offset < size; offset += length)
+    {
+      length = (size - offset < HASH_BUFFER_SIZE
+		? (size_t) (size - offset) : HASH_BUFFER_SIZE);
+      chunk1 = read_input_contents (input1, handle1, buffer1, offset, length);
+      chunk2 = read_input_contents (input2, handle2, buffer2, offset, length);
+      same = chunk1 && chunk2 && memcmp (chunk1, chunk2, length) == 0;
+    }
 
-  if (!input->memory_copy)
-    fclose (input->file);
+  free (buffer1);
+  free (buffer2);
+  if (handle1 >= 0)
+    close (handle1);
+  if (handle2 >= 0)
+    close (handle2);
+  return same;
 }
 
-/*-------------------------------------------------------------------------.
-| Prepare INPUT for next line, then available from INPUT->LINE through     |
-| INPUT->LIMIT (excluded).  INPUT->CURSOR will point to first character of |
-| the line, or will be NULL at end of file.                                |
-`-------------------------------------------------------------------------*/
+/*------------------------------------------------------------------.
+| Report which inputs differ from the first one, or are identical   |
+| to it, as requested.  Inputs should be hashed, or studied if ITEM |
+| checksums are to be compared.					    |
+`------------------------------------------------------------------*/
 
 static void
-input_line (struct input *input)
+report_whole_inputs (int items_only)
 {
-  if (input->memory_copy)
+  struct input *input;
+  int identical;
+
+  if (items_only)
+    for (input = input_array; input < input_array + inputs; input++)
+      hash_input_items (input);
+
+  for (input = input_array + 1; input < input_array + inputs; input++)
     {
-      const char *limit = input->memory_copy + input->stat_buffer.st_size;
-      char *cursor;
+      if (items_only)
+	identical = (input->content_items == input_array->content_items
+		     && input->content_hash == input_array->content_hash
+		     && same_input_items (input_array, input));
+      else
+	identical = (input->stat_buffer.st_size
+		     == input_array->stat_buffer.st_size
+		     && input->content_hash == input_array->content_hash
+		     && same_input_contents (input_array, input));
 
-      input->line = input->limit;
+      if (!identical)
+	{
+	  if (brief)
+	    printf (_("Files %s and %s differ\n"),
+		    input_array->file_name, input->file_name);
+	  exit_status = EXIT_DIFFERENCE;
+	}
+      else if (report_identical_files)
+	printf (_("Files %s and %s are identical\n"),
+		input_array->file_name, input->file_name);
+    }
 
-      for (cursor = input->line; cursor < limit && *cursor != '\n'; cursor++)
-	;
+  fflush (stdout);
+}
+
+/* Near duplicates.  */
+
+/* For a first pass over many inputs, pairs of inputs likely to share much
+   of their contents may be found without any clustering.  The sequence of
+   non-white item checksums of each input is cut into overlapping grams,
+   each gram gets hashed, and winnowing retains the smallest hash within
+   each window of consecutive grams as a fingerprint.  The set of
+   fingerprints of each input is then summarised by a MinHash signature,
+   for which the proportion of equal values between two inputs estimates
+   how much their fingerprint sets overlap.  Signatures are cut into bands,
+   and only inputs having a whole band in common get compared, so most
+   pairs of inputs are never even looked at.  */
+
+#define NEAR_LINE_GRAM 5	/* items per gram, line mode */
+#define NEAR_WORD_GRAM 10	/* items per gram, word mode */
+#define NEAR_WINDOW 4		/* grams per winnowing window */
+#define NEAR_HASHES 64		/* values in a signature */
+#define NEAR_BANDS 16		/* bands in a signature */
+#define NEAR_ROWS (NEAR_HASHES / NEAR_BANDS)
+
+static unsigned *near_signature_array; /* NEAR_HASHES values per input */
+static char *near_empty_array;	/* if input has no fingerprint */
+
+struct near_pair
+{
+  int first;			/* index of first input */
+  int second;			/* index of second input, after first */
+  int similarity;		/* estimated percentage, once computed */
+};
 
-      if (cursor < limit)
+/* Bucket entry while searching for bands in common.  */
+
+struct near_bucket
+{
+  unsigned long long hash;	/* hash of band values */
+  int input;			/* index of input */
+};
+
+/*------------------------------------------------------------------.
+| Return a well mixed hash of VALUE, different for each SEED.	    |
+`------------------------------------------------------------------*/
+
+static inline unsigned
+near_hash (unsigned long long value, int seed)
+{
+  value ^= (seed + 1) * HASH_MULTIPLIER;
+  value *= HASH_MULTIPLIER;
+  value ^= value >> 29;
+  value *= HASH_MULTIPLIER;
+  return value >> 32;
+}
+
+/*-------------------------------------------------------------------.
+| Compute the MinHash signature of input number JOB, from winnowed   |
+| fingerprints of its items.  As nothing is shared, many such jobs   |
+| may run at once.						     |
+`-------------------------------------------------------------------*/
+
+static void
+near_job (int job)
+{
+  struct input *input = input_array + job;
+  unsigned *signature = near_signature_array + job * NEAR_HASHES;
+  int gram = word_mode ? NEAR_WORD_GRAM : NEAR_LINE_GRAM;
+  unsigned *checksum_array;
+  unsigned long long *gram_array;
+  int count = 0;
+  int grams;
+  int chosen = -1;		/* gram last retained as fingerprint */
+  ITEM *item;
+  int counter;
+  int index;
+
+  for (counter = 0; counter < NEAR_HASHES; counter++)
+    signature[counter] = UINT_MAX;
+
+  checksum_array = (unsigned *)
+    xmalloc ((input->item_limit - input->first_item + 1) * sizeof (unsigned));
+  for (item = item_array + input->first_item;
+       item < item_array + input->item_limit; item++)
+    if (item_type (item) != WHITE)
+      checksum_array[count++] = item->checksum;
+
+  /* Hash all grams.  A short input still gets a single, shorter gram.  */
+
+  grams = count < gram ? (count > 0) : count - gram + 1;
+  near_empty_array[job] = grams == 0;
+  gram_array = (unsigned long long *)
+    xmalloc ((grams + 1) * sizeof (unsigned long long));
+  for (counter = 0; counter < grams; counter++)
+    {
+      unsigned long long hash = 0;
+
+      for (index = counter; index < counter + gram && index < count; index++)
 	{
-	  cursor++;
-	  input->cursor = input->line;
+	  hash = (hash ^ checksum_array[index]) * HASH_MULTIPLIER;
+	  hash ^= hash >> 29;
 	}
-      else if (cursor == input->line)
-	input->cursor = NULL;
-      else
-	input->cursor = input->line;
+      gram_array[counter] = hash;
+    }
 
-      input->limit = cursor;
+  /* Winnow, retaining the rightmost smallest hash of each window, and
+     fold each new fingerprint into the signature.  */
+
+  for (counter = 0; counter + NEAR_WINDOW <= grams
+	 || (counter == 0 && grams > 0); counter++)
+    {
+      int best = counter;
+
+      for (index = counter + 1;
+	   index < counter + NEAR_WINDOW && index < grams; index++)
+	if (gram_array[index] <= gram_array[best])
+	  best = index;
+
+      if (best != chosen)
+	{
+	  chosen = best;
+	  for (index = 0; index < NEAR_HASHES; index++)
+	    {
+	      unsigned value = near_hash (gram_array[best], index);
+
+	      if (value < signature[index])
+		signature[index] = value;
+	    }
+	}
     }
-  else
+
+  free (checksum_array);
+  free (gram_array);
+}
+
+/*--------------------------------------------------------------.
+| Sort helper.  Compare two bucket entries, by hash then input. |
+`--------------------------------------------------------------*/
+
+static int
+compare_for_near_buckets (const void *void_first, const void *void_second)
+{
+  const struct near_bucket *first = (const struct near_bucket *) void_first;
+  const struct near_bucket *second = (const struct near_bucket *) void_second;
+
+  if (first->hash != second->hash)
+    return first->hash < second->hash ? -1 : 1;
+  return first->input - second->input;
+}
+
+/*-------------------------------------------------------------------.
+| Sort helper.  Compare two pairs, by decreasing similarity, then by |
+| input order.							     |
+`-------------------------------------------------------------------*/
+
+static int
+compare_for_near_pairs (const void *void_first, const void *void_second)
+{
+  const struct near_pair *first = (const struct near_pair *) void_first;
+  const struct near_pair *second = (const struct near_pair *) void_second;
+
+  if (first->similarity != second->similarity)
+    return second->similarity - first->similarity;
+  if (first->first != second->first)
+    return first->first - second->first;
+  return first->second - second->second;
+}
+
+/*-------------------------------------------------------------------.
+| Report all pairs of studied inputs which look similar at least to  |
+| the NEAR_DUPLICATES percentage, most similar pairs first.	     |
+`-------------------------------------------------------------------*/
+
+static void
+report_near_duplicates (void)
+{
+  struct near_bucket *bucket_array;
+  struct near_pair *pair_array = NULL;
+  size_t allocated_pairs = 0;
+  int pairs = 0;
+  int candidates;
+  int reported;
+  int buckets;
+  int band;
+  int counter;
+
+  near_signature_array = (unsigned *)
+    xmalloc (inputs * NEAR_HASHES * sizeof (unsigned));
+  near_empty_array = xmalloc (inputs);
+  run_in_parallel (near_job, inputs);
+
+  /* Gather candidate pairs, from inputs sharing at least one band.  */
+
+  bucket_array = (struct near_bucket *)
+    xmalloc ((inputs + 1) * sizeof (struct near_bucket));
+  for (band = 0; band < NEAR_BANDS; band++)
     {
-      int length
-	= getline (&input->line, &input->line_allocated, input->file);
+      int start;
 
-      if (length < 0)
-	input->cursor = NULL;
-      else
+      buckets = 0;
+      for (counter = 0; counter < inputs; counter++)
+	if (!near_empty_array[counter])
+	  {
+	    const unsigned *value
+	      = near_signature_array + counter * NEAR_HASHES + band * NEAR_ROWS;
+	    unsigned long long hash = 0;
+	    int row;
+
+	    for (row = 0; row < NEAR_ROWS; row++)
+	      {
+		hash = (hash ^ value[row]) * HASH_MULTIPLIER;
+		hash ^= hash >> 29;
+	      }
+	    bucket_array[buckets].hash = hash;
+	    bucket_array[buckets].input = counter;
+	    buckets++;
+	  }
+      qsort (bucket_array, buckets, sizeof (struct near_bucket),
+	     compare_for_near_buckets);
+
+      for (start = 0; start < buckets; start = counter)
 	{
-	  input->cursor = input->line;
-	  input->limit = input->line + length;
+	  int first;
+
+	  for (counter = start + 1;
+	       counter < buckets
+		 && bucket_array[counter].hash == bucket_array[start].hash;
+	       counter++)
+	    ;
+	  for (first = start; first < counter; first++)
+	    {
+	      int second;
+
+	      for (second = first + 1; second < counter; second++)
+		{
+		  if (pairs == allocated_pairs)
+		    pair_array = (struct near_pair *)
+		      x2nrealloc (pair_array, &allocated_pairs,
+				  sizeof (struct near_pair));
+		  pair_array[pairs].first = bucket_array[first].input;
+		  pair_array[pairs].second = bucket_array[second].input;
+		  pair_array[pairs].similarity = 0;
+		  pairs++;
+		}
+	    }
 	}
     }
+  free (bucket_array);
+
+  /* Estimate similarity once for each distinct pair, keeping pairs which
+     are similar enough.  */
+
+  if (pairs > 0)
+    qsort (pair_array, pairs, sizeof (struct near_pair),
+	   compare_for_near_pairs);
+  candidates = 0;
+  reported = 0;
+  for (counter = 0; counter < pairs; counter++)
+    if (counter == 0
+	|| pair_array[counter].first != pair_array[counter - 1].first
+	|| pair_array[counter].second != pair_array[counter - 1].second)
+      {
+	const unsigned *value1
+	  = near_signature_array + pair_array[counter].first * NEAR_HASHES;
+	const unsigned *value2
+	  = near_signature_array + pair_array[counter].second * NEAR_HASHES;
+	int equals = 0;
+	int index;
+
+	for (index = 0; index < NEAR_HASHES; index++)
+	  if (value1[index] == value2[index])
+	    equals++;
+
+	candidates++;
+	pair_array[reported] = pair_array[counter];
+	pair_array[reported].similarity = equals * 100 / NEAR_HASHES;
+	if (pair_array[reported].similarity >= near_duplicates)
+	  reported++;
+      }
+  if (reported > 0)
+    qsort (pair_array, reported, sizeof (struct near_pair),
+	   compare_for_near_pairs);
+
+  for (counter = 0; counter < reported; counter++)
+    printf (_("Files %s and %s are about %d%% similar\n"),
+	    input_array[pair_array[counter].first].file_name,
+	    input_array[pair_array[counter].second].file_name,
+	    pair_array[counter].similarity);
+  fflush (stdout);
+
+  if (verbose)
+    {
+      fprintf (stderr, _("Near summary:"));
+      fprintf (stderr, ngettext (" %d candidate pair,",
+				 " %d candidate pairs,",
+				 candidates), candidates);
+      fprintf (stderr, ngettext (" %d pair reported\n",
+				 " %d pairs reported\n", reported), reported);
+    }
+
+  free (pair_array);
+  free (near_signature_array);
+  free (near_empty_array);
+}
+
+/* Item references.  */
+
+struct reference
+{
+  struct input *input;		/* input file for reference */
+  int number;			/* item number for reference */
+};
+
+/*-------------------------------------------------------------------------.
+| Explicit a reference for internal item NUMBER.  The first sentinel has   |
+| line 0, other sentinels have one more than number of lines in the file.  |
+`-------------------------------------------------------------------------*/
+
+static struct reference
+get_reference (int number)
+{
+  struct input *input;
+  struct input *low;		/* first input still possible */
+  struct input *high;		/* one past last input still possible */
+  struct reference result;
+
+  assert (number < items);
+
+  /* Binary search for the first input having NUMBER before or at the
+     sentinel following it.  */
+
+  low = input_array;
+  high = input_array + inputs - 1;
+  while (low < high)
+    {
+      input = low + (high - low) / 2;
+      if (number >= input->item_limit + 1)
+	low = input + 1;
+      else
+	high = input;
+    }
+  input = low;
+
+  result.input = input;
+  result.number = number - input->first_item + 1;
+  return result;
+}
+
+/*------------------------------------------------------------------------.
+| Produce a short string referencing an internal item NUMBER.  The result |
+| is statically allocated into a ring of little buffers.                  |
+`------------------------------------------------------------------------*/
+
+static char *
+reference_string (int number)
+{
+#define RING_LENGTH 4
+
+  struct reference reference;
+  static char buffer[RING_LENGTH][32];
+  static int next = RING_LENGTH - 1;
+
+  if (next == RING_LENGTH - 1)
+    next = 0;
+  else
+    next++;
+
+  reference = get_reference (number);
+
+  if (number == reference.input->item_limit)
+    sprintf (buffer[next], "%s.EOF", reference.input->nick_name);
+  else
+    sprintf (buffer[next], "%s%d",
+	     reference.input->nick_name, reference.number);
+
+  return buffer[next];
+
+#undef RING_LENGTH
+}
+
+#if DEBUGGING
+
+/*-------------------------------------------------------------------------.
+| Dump a reference to a given item in compilation error format.  Ensure at |
+| least one space, and in fact, enough to align diagnostics as we go.      |
+`-------------------------------------------------------------------------*/
+
+static void
+dump_reference (int item)
+{
+  struct reference reference;
+  char buffer[32];
+  static int last_width = 0;
+  int width;
+
+  reference = get_reference (item);
+  sprintf (buffer, "%d", reference.number);
+
+  fprintf (stderr, "%s:%s: ", reference.input->file_name, buffer);
+  width = strlen (reference.input->file_name) + strlen (buffer);
+  if (width < last_width)
+    while (width++ < last_width)
+      putc (' ', stderr);
+  else
+    last_width = width;
+}
+
+#endif /* DEBUGGING */
+
+/* Clusters and members.  */
+
+/* A cluster represents one set of items which is repeated at two or more
+   places in the input files, while each repetition is called a cluster
+   member.  The member size is an item count which excludes white items.  */
+
+struct cluster
+{
+  int first_member;		/* index in member_array array */
+  int item_count;		/* size of each member */
+  int item_limit;		/* one past last item of all members */
+};
+
+static struct cluster *cluster_array = NULL;
+int clusters = 0;
+static size_t allocated_clusters = 0;
+
+/* A cluster member starts at some item number and runs for a given number
+   of items.  Ignorable items may be embedded in a cluster member, so
+   cluster members of a single cluster may have different lengths, but a
+   cluster member never starts nor end with an white item.  Sentinels
+   are never part of any cluster.  By construction, all cluster members of a
+   same cluster are next to each other.  */
+
+struct member
+{
+  int cluster_number;		/* ordinal of cluster, counted from 0 */
+  int first_item;		/* number of first item for this member */
+  int item_count;		/* real number of items in this member */
+};
+
+static struct member *member_array = NULL;
+static int members = 0;
+static size_t allocated_members = 0;
+
+/* Convenience macros.  */
+
+#define MEMBER_LIMIT(Cluster) \
+  (member_array + ((Cluster) + 1)->first_member)
+
+#define MEMBERS(Cluster) \
+  (((Cluster) + 1)->first_member - (Cluster)->first_member)
+
+/*---------------------------------------------------------------------.
+| Find how many input items are part of a cluster member starting at   |
+| FIRST_ITEM and having COUNT normal items.  The returned count	       |
+| includes embedded items having less significance, but exclude last   |
+| white items.							       |
+`---------------------------------------------------------------------*/
+
+static int
+member_size (int first_item, int count)
+{
+  int last_normal = normal_count_array[first_item] + count - 1;
+
+  /* There cannot be a sentinel before COUNT normal items.  */
+
+  assert (last_normal < normal_count_array[items]);
+  return member_end_array[last_normal] - first_item;
 }
 
-/*-------------------------------------------------------------------------.
-| Prepare INPUT for next character, then available through *INPUT->CURSOR, |
-| unless INPUT->CURSOR is NULL for indicating end of file.                 |
-`-------------------------------------------------------------------------*/
+/*----------------------------------------------------------------.
+| Return how many input items are part of a given cluster MEMBER. |
+`----------------------------------------------------------------*/
+
+static inline int
+real_member_size (struct member *member)
+{
+  return member->item_count;
+}
+
+#if DEBUGGING
+
+/*-----------------------.
+| Dump a given CLUSTER.  |
+`-----------------------*/
 
 static void
-input_character_helper (struct input *input)
+dump_cluster (struct cluster *cluster)
 {
   int counter;
+  struct member *member;
 
-  /* Read in a new line, but skip ignorable ones.  FIXME: This is just not
-     right.  Ignorable lines may need copying!  */
-
-  do
+  fprintf (stderr, "{%ld},%d",
+	   (long) (cluster - cluster_array), cluster->item_count);
+  for (counter = cluster->first_member;
+       counter < (cluster + 1)->first_member; counter++)
     {
-      input_line (input);
+      member = member_array + counter;
+      fprintf (stderr, "%c[%d] %s,%d",
+	       counter == cluster->first_member ? '\t' : ' ', counter,
+	       reference_string (member->first_item),
+	       real_member_size (member));
+    }
+  putc ('\n', stderr);
+}
 
-      /* Possibly check if the line should be ignored.  */
+/*--------------------.
+| Dump all clusters.  |
+`--------------------*/
 
-      for (counter = 0; counter < ignore_regexps; counter++)
-	if (re_match (ignore_regexp_array[counter],
-		      input->line, input->limit - input->line, 0, NULL) > 0)
-	  break;
-    }
-  while (counter < ignore_regexps);
+static void
+dump_all_clusters (void)
+{
+  int counter;
 
-  assert (!input->cursor || input->cursor < input->limit);
+  fputs ("\f\n", stderr);
+  for (counter = 0; counter < clusters; counter++)
+    dump_cluster (cluster_array + counter);
 }
 
-static inline void
-input_character (struct input *input)
+/*----------------------.
+| Dump a given MEMBER.  |
+`----------------------*/
+
+static void
+dump_member (struct member *member)
 {
-  assert (input->cursor);
-  input->cursor++;
-  if (input->cursor == input->limit)
-    input_character_helper (input);
+  fprintf (stderr, " [%ld]\t{%d}\t%s,%d+\n",
+	   (long) (member - member_array), member->cluster_number,
+	   reference_string (member->first_item),
+	   cluster_array[member->cluster_number].item_count);
 }
 
-/*------------------------------------------------------------.
-| Construct descriptors for all items of a given INPUT file.  |
-`------------------------------------------------------------*/
+/*-------------------.
+| Dump all members.  |
+`-------------------*/
 
 static void
-study_input (struct input *input)
+dump_all_members (void)
 {
-#if SAVE_AND_SLOW
-# define ADJUST_CHECKSUM(Character)                                \
-  checksum = (checksum << 5) + (checksum >> (BITS_PER_WORD - 5))   \
-    + (Character & 0xFF)
-#else
-# define ADJUST_CHECKSUM(Character)                                \
-  checksum = (checksum << 5) +                                     \
-    (checksum >> (BITS_PER_WORD - BITS_PER_TYPE - 5))              \
-    + (Character & 0xFF)
-#endif
+  int counter;
 
-  int item_count;		/* number of items read */
-  char *buffer = NULL;		/* line buffer */
-  int length = 0;		/* actual line length in buffer */
+  fputs ("\f\n", stderr);
+  for (counter = 0; counter < members; counter++)
+    dump_member (member_array + counter);
+}
 
-  /* Read the file and checksum all items.  */
+#endif /* DEBUGGING */
 
-  if (verbose)
-    fprintf (stderr, _("Reading %s"), input->file_name);
+/*----------------------------------------------------------------------.
+| Sort helper.  Compare two member indices, using the original input    |
+| order.  When two members have the same start, put the longest first.  |
+`----------------------------------------------------------------------*/
 
-  open_input (input);
-  input->first_item = items;
-  item_count = 0;
+static int
+compare_for_member_start (const void *void_first, const void *void_second)
+{
+#define value1 *((int *) void_first)
+#define value2 *((int *) void_second)
 
-  /* Read all lines.  */
+  int result;
 
-  while (input_line (input), input->cursor)
-    {
-      int counter;
+  struct member *member1 = member_array + value1;
+  struct member *member2 = member_array + value2;
 
-      /* Possibly check if the line should be ignored.  */
+  result = member1->first_item - member2->first_item;
+  if (result)
+    return result;
 
-      for (counter = 0; counter < ignore_regexps; counter++)
-	if (re_match (ignore_regexp_array[counter],
-		      input->line, input->limit - input->line, 0, NULL) > 0)
-	  break;
+  return (cluster_array[member2->cluster_number].item_count
+	  - cluster_array[member1->cluster_number].item_count);
 
-      if (counter < ignore_regexps)
-	{
-	  if (!word_mode)
-	    new_item (WHITE, 0);
-	  continue;
-	}
+#undef value1
+#undef value2
+}
 
-      /* The line is not being ignored.  */
+/*---------------------------------------------------------------------.
+| Add a new cluster, for which each member has COUNT non-white items.  |
+`---------------------------------------------------------------------*/
 
-      /* We prefer `cursor < buffer + length' over `*cursor' in the loop
-         tests, so embedded NULs can be handled.  */
+static inline void
+new_cluster (int count)
+{
+  struct cluster *cluster;
 
-      if (word_mode)
-	{
-	  char *cursor = input->line;
-	  unsigned checksum;
+  if (clusters == allocated_clusters)
+    cluster_array = (struct cluster *)
+      x2nrealloc (cluster_array, &allocated_clusters, sizeof (struct cluster));
 
-	  /* FIXME: Might be simplified out of the line loop.  */
+  cluster = cluster_array + clusters++;
+  cluster->first_member = members;
+  cluster->item_count = count;
+  cluster->item_limit = 0;
+}
 
-	  while (cursor < input->limit)
-	    {
-	      while (cursor < input->limit && isspace (*cursor))
-		cursor++;
+/*---------------------------.
+| Add a new cluster member.  |
+`---------------------------*/
 
-	      if (cursor < input->limit)
-		{
-		  checksum = 0;
-		  while (cursor < input->limit && !isspace (*cursor))
-		    {
-		      ADJUST_CHECKSUM (*cursor);
-		      cursor++;
-		    }
-		  new_item (NORMAL, checksum);
-		  item_count++;
-		}
-	    }
-	}
-      else
-	{
-	  char *cursor;
-	  unsigned checksum = 0;
-	  int line_has_delims = 0;
-	  int line_has_alnums = 0;
+static inline void
+new_member (int item)
+{
+  struct cluster *cluster = cluster_array + clusters - 1;
+  struct member *member;
 
-	  for (cursor = input->line; cursor < input->limit; cursor++)
-	    if (isspace (*cursor))
-	      {
-		if (!ignore_all_space)
-		  {
-		    if (ignore_space_change)
-		      {
-			ADJUST_CHECKSUM (' ');
-			while (cursor + 1 < buffer + length
-			       && isspace (cursor[1]))
-			  cursor++;
-		      }
-		    else
-		      ADJUST_CHECKSUM (*cursor);
-		  }
-	      }
-	    else if (isalpha (*cursor))
-	      {
-		line_has_alnums = 1;
-		if (ignore_case && islower (*cursor))
-		  {
-		    char character = toupper (*cursor);
+  if (members == allocated_members)
+    member_array = (struct member *)
+      x2nrealloc (member_array, &allocated_members, sizeof (struct member));
 
-		    ADJUST_CHECKSUM (character);
-		  }
-		else
-		  ADJUST_CHECKSUM (*cursor);
-	      }
-	    else if (isdigit (*cursor))
-	      {
-		line_has_alnums = 1;
-		ADJUST_CHECKSUM (*cursor);
-	      }
-	    else
-	      {
-		line_has_delims = 1;
-		ADJUST_CHECKSUM (*cursor);
-	      }
+  member = member_array + members++;
+  member->cluster_number = clusters - 1;
+  member->first_item = item;
+  member->item_count = member_size (item, cluster->item_count);
 
-	  /* Register the checksum.  */
+  if (item + member->item_count > cluster->item_limit)
+    cluster->item_limit = item + member->item_count;
+}
 
-	  if (line_has_alnums)
-	    new_item (NORMAL, checksum);
-	  else if (line_has_delims)
-	    new_item (ignore_delimiters ? DELIMS : NORMAL, checksum);
-	  else if (ignore_blank_lines)
-	    new_item (WHITE, checksum);
-	  else
-	    new_item (ignore_delimiters ? DELIMS : NORMAL, checksum);
+/*------------------------------------.
+| Output a cluster explanation line.  |
+`------------------------------------*/
 
-	  item_count++;
-	}
+static void
+explain_member (char prefix, struct member *quote)
+{
+  struct cluster *cluster = cluster_array + quote->cluster_number;
+  struct member *member;
+  int counter;
+  struct reference reference;
+
+  putc (prefix, output_file);
+  for (member = member_array + cluster->first_member;
+       member < MEMBER_LIMIT (cluster); member++)
+    {
+      reference = get_reference (member->first_item);
+      fprintf (output_file, member == quote ? " %s%d,%d" : " (%s%d,%d)",
+	       reference.input->nick_name, reference.number,
+	       real_member_size (member));
     }
+  putc ('\n', output_file);
+}
 
-  input->item_limit = items;
+/* Once sorted, the indirect item array is a sequence of sets, each being a
+   run of items beginning with the same run of checksums.  Each set is
+   distributed into clusters independently of all others, so sets are
+   processed in parallel by chunks.  Each chunk job saves its clusters into
+   its own cluster buffer, as a sequence of integers: for each cluster, its
+   normal item count, then its number of members, then the item index of
+   each member.  Buffers are later turned into clusters in chunk order, so
+   the result does not depend on the number of workers.  */
 
-  /* Cleanup.  */
+struct cluster_buffer
+{
+  int *array;			/* saved clusters */
+  int used;			/* number of used entries in array */
+  size_t allocated;		/* allocated entries in array */
+  int pruned;			/* set members left out for speed */
+};
 
-  close_input (input);
+static int *set_item_array;	/* sorted indirect items, in compact view */
+static int set_items;		/* number of entries in set_item_array */
+static int *pair_size_array;	/* identical size of each item and next */
+static struct cluster_buffer *cluster_buffer_array;
+static int cluster_jobs;	/* number of chunks */
+static int speed_limit;		/* frequency and set limit, for speed */
+static char *frequent_seed_array; /* items too frequent to seed, or NULL */
 
-  if (verbose)
-    fprintf (stderr, ngettext (", %d item\n", ", %d items\n", item_count),
-	     item_count);
+/*-----------------------------------------.
+| Save VALUE at the end of cluster BUFFER. |
+`-----------------------------------------*/
 
-#undef ADJUST_CHECKSUM
+static inline void
+save_in_cluster_buffer (struct cluster_buffer *buffer, int value)
+{
+  if (buffer->used == buffer->allocated)
+    buffer->array = (int *)
+      x2nrealloc (buffer->array, &buffer->allocated, sizeof (int));
+  buffer->array[buffer->used++] = value;
 }
 
-/*------------------------.
-| Study all input files.  |
-`------------------------*/
-
-/* If all input files fit in MAXIMUM_TOTAL_BUFFER, they are all swallowed in
-   memory at once.  Otherwise, they are read from disk one line at a time.
-   A fixed value is far than ideal: we should consider how much real memory
-   space is available, and I do not know how to do this portably.  */
-#define MAXIMUM_TOTAL_BUFFER 500000
+/*----------------------------------------------------------------------.
+| Distribute the set of SIZES + 1 items starting at CLUSTER_SET among   |
+| clusters, saved into BUFFER.  For a given index, SIZE_ARRAY[index]    |
+| initially describes the common item size between CLUSTER_SET[index]   |
+| and CLUSTER_SET[index + 1].  SORTER_ARRAY has room for SIZES + 1      |
+| entries.								|
+`----------------------------------------------------------------------*/
 
 static void
-study_all_inputs (void)
+extract_clusters (struct cluster_buffer *buffer, int *cluster_set,
+		  int *size_array, int sizes, int *sorter_array)
 {
-  struct input *input;
-  int total_size;
+  int *member_set;		/* index for first member in current cluster */
+  int *size;			/* cursor in size_array */
+
+  /* Here is a bag of starts indices for members of the same cluster (having
+     all CLUSTER_SIZE worth items).  These indices are values selected out
+     of CLUSTER_SET.  */
+  int sorters;			/* number of members in sorter_array */
+  int *cursor;			/* cursor into sorter_array */
 
-  /* Compute nick names for all files.  */
+  int compact;			/* entry in compact view */
+  int back;			/* distance to a preceding entry */
 
-  if (inputs == 2)
-    {
-      /* If only two input files, just mimick `diff' output.  */
+  int cluster_size;		/* size of current cluster */
+  int size_value;		/* current size, or previous cluster size */
+  int counter;			/* all purpose counter */
+  unsigned checksum;		/* possible common cheksum of previous items */
 
-      strcpy (input_array[0].nick_name, "-");
-      strcpy (input_array[1].nick_name, "+");
-    }
-  else
+  /* Output all clusters of the set from the tallest to the shortest.
+     Here, size refers to number of items in members, and not to the
+     number of members in a cluster.  (In fact, it is very expectable
+     that shortest clusters have more members.)  */
+
+  cluster_size = 0;
+  while (1)
     {
-      int name_length = 1;
-      int file_limit = 26;
+      /* Discover the maximum cluster size not yet processed.  */
 
-      /* Choose nick names as sequences of lower case letters.  */
+      size_value = cluster_size;
+      cluster_size = 0;
 
-      while (inputs > file_limit)
-	{
-	  name_length++;
-	  file_limit *= 26;
-	}
+      for (size = size_array; size < size_array + sizes; size++)
+	if ((size_value == 0 || *size < size_value)
+	    && *size > cluster_size)
+	  cluster_size = *size;
 
-      for (input = input_array; input < input_array + inputs; input++)
+      /* If the cluster size did not decrease, we cannot do more.  */
+
+      if (cluster_size == 0)
+	break;
+
+      /* Consider all consecutive members having at least the cluster
+	 size in common: they form a cluster.  But any gap in the
+	 sequence represents a change of cluster: same length, but
+	 different contents.  */
+
+      size = size_array;
+      while (1)
 	{
-	  int value = input - input_array;
-	  char *cursor = input->nick_name + name_length;
+	  /* Find all members for one cluster.  However, after having
+	     skipped over the gap, just break out if nothing remains.  */
 
-	  *cursor-- = '\0';
-	  while (cursor >= input->nick_name)
+	  while (size < size_array + sizes && *size < cluster_size)
+	    size++;
+	  if (size == size_array + sizes)
+	    break;
+
+	  member_set = cluster_set + (size - size_array);
+	  sorters = 1;
+	  while (size < size_array + sizes && *size >= cluster_size)
 	    {
-	      *cursor-- = value % 26 + 'a';
-	      value /= 26;
+	      sorters++;
+	      size++;
 	    }
-	}
-    }
 
-  /* Swallow all files not already copied in memory, if room permits.  */
+	  /* No cluster may be a proper subset of another.  That is, if
+	     all putative members are preceded by identical items, then
+	     they are indeed part of a bigger cluster, which has already
+	     been or will later be caught.  In such case, just avoid
+	     retaining them here.  This also prevents quadratic
+	     behaviour which, I presume, would be heavy on computation.
 
-  total_size = 0;
-  for (input = input_array; input < input_array + inputs; input++)
-    total_size += input->stat_buffer.st_size;
+	     When speeding large files, items too frequent to seed do not
+	     start any bigger cluster, so look further back for one which
+	     does.
 
-  if (total_size <= MAXIMUM_TOTAL_BUFFER)
-    for (input = input_array; input < input_array + inputs; input++)
-      if (!input->memory_copy)
-	swallow_input (input);
+	     This test may be defeated by tolerant matches.  Maybe
+	     tolerant matches will just go away.  Surely, tolerant
+	     matches later require subset member elimination.  */
 
-  /* Compute all checksums.  */
+	  for (back = 1;; back++)
+	    {
+	      compact = member_set[0] - back;
+	      if (compact_type_array[compact] == SENTINEL)
+		break;
+	      checksum = compact_checksum_array[compact];
 
-  new_sentinel ();
-  for (input = input_array; input < input_array + inputs; input++)
-    {
-      study_input (input);
-      new_sentinel ();
-    }
+	      for (counter = 1; counter < sorters; counter++)
+		{
+		  compact = member_set[counter] - back;
+		  if (compact_type_array[compact] == SENTINEL
+		      || compact_checksum_array[compact] != checksum)
+		    break;
+		}
+	      if (counter < sorters
+		  || !frequent_seed_array || !frequent_seed_array[compact])
+		break;
+	    }
+	  if (compact_type_array[compact] != SENTINEL && counter == sorters)
+	    continue;
 
-  if (verbose)
-    {
-      fprintf (stderr, _("Read summary:"));
-      fprintf (stderr, ngettext (" %d file,", " %d files,", inputs), inputs);
-      fprintf (stderr, ngettext (" %d item\n", " %d items\n",
-				 items - inputs - 1), items - inputs - 1);
-    }
+	  /* Skip any cluster member overlapping with the previous
+	     member of the same cluster.  If doing so, chop the size of
+	     the first member just before the overlap point: this should
+	     later trigger a cluster having this reduced size.  */
 
-#if DEBUGGING
-  if (debugging)
-    {
-      dump_all_items ();
-      dump_all_inputs ();
+	  memcpy (sorter_array, member_set, sorters * sizeof (int));
+	  qsort (sorter_array, sorters, sizeof (int),
+		 compare_for_positions);
+	  cursor = sorter_array;
+	  for (counter = 1; counter < sorters; counter++)
+	    {
+	      size_value
+		= item_distance (compact_item_array[*cursor],
+				 compact_item_array[sorter_array[counter]],
+				 cluster_size);
+	      if (size_value < 0)
+		*++cursor = sorter_array[counter];
+	      else
+		{
+		  int counter2;
+
+		  for (counter2 = 0; counter2 < sizes; counter2++)
+		    if (cluster_set[counter2] == *cursor
+			|| cluster_set[counter2] == sorter_array[counter])
+		      {
+			assert (size_value < size_array[counter2]);
+			size_array[counter2] = size_value;
+			break;
+		      }
+		  assert (counter2 < sizes);
+		}
+	    }
+	  sorters = cursor - sorter_array + 1;
+
+	  /* Save the cluster only if at least two members remain.  */
+
+	  if (sorters >= 2)
+	    {
+	      save_in_cluster_buffer (buffer, cluster_size);
+	      save_in_cluster_buffer (buffer, sorters);
+	      for (counter = 0; counter < sorters; counter++)
+		save_in_cluster_buffer
+		  (buffer, compact_item_array[sorter_array[counter]]);
+	    }
+	}
     }
-#endif
 }
-
-/* Item references.  */
 
-struct reference
+/*----------------------------------------------------------------------.
+| Compute identical sizes for the pairs of sorted items within a chunk. |
+`----------------------------------------------------------------------*/
+
+static void
+measure_job (int job)
 {
-  struct input *input;		/* input file for reference */
-  int number;			/* item number for reference */
-};
+  int pairs = set_items - 1;
+  int start = (long long) pairs * job / cluster_jobs;
+  int finish = (long long) pairs * (job + 1) / cluster_jobs;
+  int counter;
 
-/*-------------------------------------------------------------------------.
-| Explicit a reference for internal item NUMBER.  The first sentinel has   |
-| line 0, other sentinels have one more than number of lines in the file.  |
-`-------------------------------------------------------------------------*/
+  for (counter = start; counter < finish; counter++)
+    pair_size_array[counter]
+      = identical_size (set_item_array[counter], set_item_array[counter + 1]);
+}
 
-static struct reference
-get_reference (int number)
+/*----------------------------------------------------------------------------.
+| Extract clusters from all sets starting within a chunk of sorted            |
+| items.								      |
+`----------------------------------------------------------------------------*/
+
+static void
+cluster_job (int job)
 {
-  struct input *input;
-  struct reference result;
+  struct cluster_buffer *buffer = cluster_buffer_array + job;
+  int start = (long long) set_items * job / cluster_jobs;
+  int finish = (long long) set_items * (job + 1) / cluster_jobs;
 
-  assert (number < items);
+  int *size_array = NULL;	/* private copy of pair sizes for a set */
+  size_t allocated_sizes = 0;	/* allocated entries for size_array */
+  int *sorter_array = NULL;	/* for ensuring members are in nice order */
+  int sizes;			/* number of pairs in current set */
+  int extract_sizes;		/* number of pairs retained */
+  int position;			/* start of current set */
 
-  /* FIXME: if we are studying many files, linear searches become a bit
-     crude, binary searches would be better in such cases.  */
+  /* A set started in a previous chunk is processed by that chunk.  */
 
-  for (input = input_array; number >= input->item_limit + 1; input++)
-    ;
+  position = start;
+  while (position < finish && position > 0
+	 && pair_size_array[position - 1] >= minimum_size)
+    position++;
 
-  result.input = input;
-  result.number = number - input->first_item + 1;
-  return result;
-}
+  for (; position < finish; position += sizes + 1)
+    {
+      /* Find all members beginning with the same run of checksums.  These
+         will be later distributed among a few clusters of various sizes,
+         and so, are common to the incoming set of clusters.  */
 
-/*------------------------------------------------------------------------.
-| Produce a short string referencing an internal item NUMBER.  The result |
-| is statically allocated into a ring of little buffers.                  |
-`------------------------------------------------------------------------*/
+      sizes = 0;
+      while (position + sizes + 1 < set_items
+	     && pair_size_array[position + sizes] >= minimum_size)
+	sizes++;
 
-static char *
-reference_string (int number)
-{
-#define RING_LENGTH 4
+      /* This test is not necessary for the algorithm to work, but this
+         fairly common case might be worth a bit of speedup.  Maybe!  */
 
-  struct reference reference;
-  static char buffer[RING_LENGTH][20];
-  static int next = RING_LENGTH - 1;
+      if (sizes == 0)
+	continue;
 
-  if (next == RING_LENGTH - 1)
-    next = 0;
-  else
-    next++;
+      /* When speeding large files, only consider the first members of
+	 big sets.  Members are sorted so the most similar runs follow
+	 each other, so this mainly loses clusters having fewer items.  */
 
-  reference = get_reference (number);
+      if (speed_large_files && sizes >= speed_limit)
+	{
+	  buffer->pruned += sizes + 1 - speed_limit;
+	  extract_sizes = speed_limit - 1;
+	}
+      else
+	extract_sizes = sizes;
 
-  if (number == reference.input->item_limit)
-    sprintf (buffer[next], "%s.EOF", reference.input->nick_name);
-  else
-    sprintf (buffer[next], "%s%d",
-	     reference.input->nick_name, reference.number);
+      if (extract_sizes > allocated_sizes)
+	{
+	  allocated_sizes = extract_sizes;
+	  size_array = (int *)
+	    x2nrealloc (size_array, &allocated_sizes, sizeof (int));
+	  sorter_array = (int *)
+	    xrealloc (sorter_array, (allocated_sizes + 1) * sizeof (int));
+	}
+      memcpy (size_array, pair_size_array + position,
+	      extract_sizes * sizeof (int));
 
-  return buffer[next];
+      extract_clusters (buffer, set_item_array + position, size_array,
+			extract_sizes, sorter_array);
+    }
 
-#undef RING_LENGTH
+  free (size_array);
+  free (sorter_array);
 }
 
-#if DEBUGGING
-
-/*-------------------------------------------------------------------------.
-| Dump a reference to a given item in compilation error format.  Ensure at |
-| least one space, and in fact, enough to align diagnostics as we go.      |
-`-------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------.
+| Return an array of flags telling, for each entry of the compact view, |
+| if its checksum occurs more than LIMIT times overall.			|
+`----------------------------------------------------------------------*/
 
-static void
-dump_reference (int item)
+static char *
+find_frequent_checksums (int limit)
 {
-  struct reference reference;
-  char buffer[20];
-  static int last_width = 0;
-  int width;
+  struct bucket
+  {
+    unsigned checksum;		/* checksum of entries in bucket */
+    int count;			/* number of entries, 0 if bucket unused */
+  };
 
-  reference = get_reference (item);
-  sprintf (buffer, "%d", reference.number);
+  struct bucket *bucket_array;
+  struct bucket *bucket;
+  size_t buckets = 1024;
+  char *frequent_array = (char *) xmalloc (compact_items);
+  int counter;
 
-  fprintf (stderr, "%s:%s: ", reference.input->file_name, buffer);
-  width = strlen (reference.input->file_name) + strlen (buffer);
-  if (width < last_width)
-    while (width++ < last_width)
-      putc (' ', stderr);
-  else
-    last_width = width;
-}
+  while (buckets < 2 * (size_t) compact_items)
+    buckets *= 2;
+  bucket_array = (struct bucket *) xcalloc (buckets, sizeof (struct bucket));
 
-#endif /* DEBUGGING */
-
-/* Clusters and members.  */
+  /* Hash checksums with linear probing, counting occurrences.  */
 
-/* A cluster represents one set of items which is repeated at two or more
-   places in the input files, while each repetition is called a cluster
-   member.  The member size is an item count which excludes white items.  */
+  for (counter = 0; counter < compact_items; counter++)
+    {
+      unsigned checksum = compact_checksum_array[counter];
+
+      bucket = bucket_array + (checksum * 2654435761U & (buckets - 1));
+      while (bucket->count > 0 && bucket->checksum != checksum)
+	if (++bucket == bucket_array + buckets)
+	  bucket = bucket_array;
+      bucket->checksum = checksum;
+      bucket->count++;
+    }
 
-struct cluster
-{
-  short first_member;		/* index in member_array array */
-  short item_count;		/* size of each member */
-};
+  for (counter = 0; counter < compact_items; counter++)
+    {
+      unsigned checksum = compact_checksum_array[counter];
 
-static struct cluster *cluster_array = NULL;
-int clusters = 0;
+      bucket = bucket_array + (checksum * 2654435761U & (buckets - 1));
+      while (bucket->checksum != checksum)
+	if (++bucket == bucket_array + buckets)
+	  bucket = bucket_array;
+      frequent_array[counter] = bucket->count > limit;
+    }
 
-/* A cluster member starts at some item number and runs for a given number
-   of items.  Ignorable items may be embedded in a cluster member, so
-   cluster members of a single cluster may have different lengths, but a
-   cluster member never starts nor end with an white item.  Sentinels
-   are never part of any cluster.  By construction, all cluster members of a
-   same cluster are next to each other.  */
+  free (bucket_array);
+  return frequent_array;
+}
 
-struct member
+/* Comparing runs item by item gets slow on repetitive inputs, as long
+   identical runs are walked over again and again.  So when speeding large
+   files, the compact view is rather sorted by prefix doubling: entries are
+   ranked on their first item, then on their first two items, then four,
+   etc., each round sorting entries on pairs of ranks from the previous
+   round.  The longest common prefix between entries next to each other in
+   the sorted order then comes out of a single linear pass (the method of
+   Kasai et al.), and yields identical sizes.  This gives the same results
+   as compare_for_checksum_runs and identical_size, provided there is no
+   tolerance for mismatches.  */
+
+static int *doubling_rank_array; /* rank of each entry, for current round */
+static int doubling_step;	/* entries accounted for by a single rank */
+
+/*-------------------------------------------------------------------.
+| Sort helper.  Compare two compact view entries on their rank, then |
+| on the rank of the entry DOUBLING_STEP further.		     |
+`-------------------------------------------------------------------*/
+
+static int
+compare_for_doubling (const void *void_first, const void *void_second)
 {
-  short cluster_number;		/* ordinal of cluster, counted from 0 */
-  int first_item;		/* number of first item for this member */
-};
+#define value1 *((int *) void_first)
+#define value2 *((int *) void_second)
 
-static struct member *member_array = NULL;
-static int members = 0;
+  int rank1 = doubling_rank_array[value1];
+  int rank2 = doubling_rank_array[value2];
 
-/* Convenience macros.  */
+  doubling_comparisons++;
+  if (rank1 != rank2)
+    return rank1 < rank2 ? -1 : 1;
 
-#define MEMBER_LIMIT(Cluster) \
-  (member_array + ((Cluster) + 1)->first_member)
+  /* An entry too close to the end has a rank which is already unique.  */
 
-#define MEMBERS(Cluster) \
-  (((Cluster) + 1)->first_member - (Cluster)->first_member)
+  rank1 = (value1 + doubling_step < compact_items
+	   ? doubling_rank_array[value1 + doubling_step] : -1);
+  rank2 = (value2 + doubling_step < compact_items
+	   ? doubling_rank_array[value2 + doubling_step] : -1);
+
+  return rank1 < rank2 ? -1 : rank1 > rank2;
+
+#undef value1
+#undef value2
+}
 
 /*---------------------------------------------------------------------.
-| Find how many input items are part of a given cluster MEMBER.  The   |
-| returned count includes embedded items having less significance, but |
-| exclude last white items.                                            |
+| Sort all NORMAL and DELIMS entries of the compact view, except those |
+| flagged in FREQUENT_ARRAY, into SORTED_ARRAY, and return how many.   |
+| Also set PAIR_SIZE_ARRAY for each sorted entry and the next one.     |
 `---------------------------------------------------------------------*/
 
 static int
-real_member_size (struct member *member)
+sort_by_doubling (int *sorted_array, const char *frequent_array)
 {
-  int number = cluster_array[member->cluster_number].item_count;
-  ITEM *item = item_array + member->first_item;
-  ITEM *last_item;
-
-  /* Skip over NUMBER normal items.  */
-
-  while (number > 0)
-    switch (item_type (item))
-      {
-      case NORMAL:
-	number--;
-	/* Fall through.  */
+  int *suffix_array = (int *) xmalloc (compact_items * sizeof (int));
+  int *rank_array = (int *) xmalloc (compact_items * sizeof (int));
+  int *other_array = (int *) xmalloc (compact_items * sizeof (int));
+  int *swap;
+  int sorted = 0;
+  int counter;
+  int common;			/* common prefix with previous entry */
+  int minimum;			/* smallest common prefix since last kept */
+  int entry;
 
-      case DELIMS:
-      case WHITE:
-	item++;
-	break;
+  /* Initial ranks are checksums, sentinels being unique and last.  */
 
-      case SENTINEL:
-	/* Cannot happen.  */
-	abort ();
-      }
+  for (counter = 0; counter < compact_items; counter++)
+    {
+      suffix_array[counter] = counter;
+      rank_array[counter] = compact_checksum_array[counter];
+    }
 
-  /* Skip over supplementary matchable or white items, return the item
-     count as for the last normal or matchable item.  */
+  for (doubling_step = 1;; doubling_step *= 2)
+    {
+      doubling_rank_array = rank_array;
+      qsort (suffix_array, compact_items, sizeof (int), compare_for_doubling);
 
-  last_item = item;
-  while (1)
-    switch (item_type (item))
-      {
-      case NORMAL:
-      case SENTINEL:
-	return last_item - item_array - member->first_item;
+      other_array[suffix_array[0]] = 0;
+      for (counter = 1; counter < compact_items; counter++)
+	other_array[suffix_array[counter]]
+	  = (other_array[suffix_array[counter - 1]]
+	     + (compare_for_doubling (suffix_array + counter - 1,
+				      suffix_array + counter) != 0));
 
-      case DELIMS:
-	last_item = item++;
-	break;
+      swap = rank_array;
+      rank_array = other_array;
+      other_array = swap;
 
-      case WHITE:
-	item++;
+      if (rank_array[suffix_array[compact_items - 1]] == compact_items - 1)
 	break;
-      }
-}
+    }
 
-#if DEBUGGING
+  /* Compute common prefixes, in sorted order, into OTHER_ARRAY.  */
 
-/*-----------------------.
-| Dump a given CLUSTER.  |
-`-----------------------*/
+  common = 0;
+  for (entry = 0; entry < compact_items; entry++)
+    if (rank_array[entry] > 0)
+      {
+	int previous = suffix_array[rank_array[entry] - 1];
+
+	while (compact_checksum_array[entry + common]
+	       == compact_checksum_array[previous + common])
+	  common++;
+	other_array[rank_array[entry]] = common;
+	if (common > 0)
+	  common--;
+      }
+    else
+      common = 0;
 
-static void
-dump_cluster (struct cluster *cluster)
-{
-  int counter;
-  struct member *member;
+  /* Retain seeds, measuring identical sizes from common prefixes.  */
 
-  fprintf (stderr, "{%ld},%d",
-	   (long) (cluster - cluster_array), cluster->item_count);
-  for (counter = cluster->first_member;
-       counter < (cluster + 1)->first_member; counter++)
+  minimum = INT_MAX;
+  for (counter = 0; counter < compact_items; counter++)
     {
-      member = member_array + counter;
-      fprintf (stderr, "%c[%d] %s,%d",
-	       counter == cluster->first_member ? '\t' : ' ', counter,
-	       reference_string (member->first_item),
-	       real_member_size (member));
-    }
-  putc ('\n', stderr);
-}
+      entry = suffix_array[counter];
+      if (counter > 0 && other_array[counter] < minimum)
+	minimum = other_array[counter];
 
-/*--------------------.
-| Dump all clusters.  |
-`--------------------*/
+      if ((compact_type_array[entry] == NORMAL
+	   || compact_type_array[entry] == DELIMS)
+	  && !(frequent_array && frequent_array[entry]))
+	{
+	  if (sorted > 0)
+	    {
+	      int previous = sorted_array[sorted - 1];
 
-static void
-dump_all_clusters (void)
-{
-  int counter;
+	      pair_size_array[sorted - 1]
+		= (normal_count_array[compact_item_array[previous + minimum]]
+		   - normal_count_array[compact_item_array[previous]]);
+	    }
+	  sorted_array[sorted++] = entry;
+	  minimum = INT_MAX;
+	}
+    }
 
-  fputs ("\f\n", stderr);
-  for (counter = 0; counter < clusters; counter++)
-    dump_cluster (cluster_array + counter);
+  free (suffix_array);
+  free (rank_array);
+  free (other_array);
+  return sorted;
 }
 
-/*----------------------.
-| Dump a given MEMBER.  |
-`----------------------*/
-
-static void
-dump_member (struct member *member)
+/* With some tolerance for mismatches, runs which differ early are not
+   brought next to each other by sorting, and comparing neighbours only
+   misses them.  Seeds rather get grouped on their first few entries, a
+   gram, using a hash of each gram as an index.  Within each group, a
+   pivot gets extended against all other seeds, allowing up to TOLERANCE
+   mismatched items, and seeds matching the pivot well enough follow it,
+   by decreasing sizes.  Any pair size then is the size of the later seed
+   against the pivot, so sets describe clusters around their pivot, and
+   get extracted as usual.  Seeds not matching a pivot are tried against
+   another pivot, a few times.  Mismatches are substitutions only, as all
+   members of a cluster have the same number of normal items.  */
+
+#define TOLERANCE_GRAM 3	/* maximum number of entries in a gram */
+#define TOLERANCE_PIVOTS 16	/* maximum number of pivots per group */
+
+static unsigned long long *gram_hash_array; /* hash of gram of each entry */
+static int gram_size;		/* number of entries in a gram */
+
+struct tolerant_seed
 {
-  fprintf (stderr, " [%ld]\t{%d}\t%s,%d+\n",
-	   (long) (member - member_array), member->cluster_number,
-	   reference_string (member->first_item),
-	   cluster_array[member->cluster_number].item_count);
-}
+  int entry;			/* entry in compact view */
+  int size;			/* size against pivot */
+};
 
-/*-------------------.
-| Dump all members.  |
-`-------------------*/
+/*-----------------------------------------------------------------.
+| Return non-zero if two compact view entries start the same gram. |
+`-----------------------------------------------------------------*/
 
-static void
-dump_all_members (void)
+static inline int
+same_gram (int entry1, int entry2)
 {
-  int counter;
-
-  fputs ("\f\n", stderr);
-  for (counter = 0; counter < members; counter++)
-    dump_member (member_array + counter);
+  return (gram_hash_array[entry1] == gram_hash_array[entry2]
+	  && memcmp (compact_checksum_array + entry1,
+		     compact_checksum_array + entry2,
+		     gram_size * sizeof (unsigned)) == 0);
 }
 
-#endif /* DEBUGGING */
-
-/*----------------------------------------------------------------------.
-| Sort helper.  Compare two member indices, using the original input    |
-| order.  When two members have the same start, put the longest first.  |
-`----------------------------------------------------------------------*/
+/*--------------------------------------------------------------------.
+| Sort helper.  Compare two compact view entries on their gram hash,  |
+| then on their gram, then on their position.			      |
+`--------------------------------------------------------------------*/
 
 static int
-compare_for_member_start (const void *void_first, const void *void_second)
+compare_for_grams (const void *void_first, const void *void_second)
 {
 #define value1 *((int *) void_first)
 #define value2 *((int *) void_second)
 
   int result;
 
-  struct member *member1 = member_array + value1;
-  struct member *member2 = member_array + value2;
+  gram_comparisons++;
+  if (gram_hash_array[value1] != gram_hash_array[value2])
+    return gram_hash_array[value1] < gram_hash_array[value2] ? -1 : 1;
 
-  result = member1->first_item - member2->first_item;
+  result = memcmp (compact_checksum_array + value1,
+		   compact_checksum_array + value2,
+		   gram_size * sizeof (unsigned));
   if (result)
     return result;
 
-  return (cluster_array[member2->cluster_number].item_count
-	  - cluster_array[member1->cluster_number].item_count);
+  return value1 - value2;
 
 #undef value1
 #undef value2
 }
 
-/*---------------------------------------------------------------------.
-| Add a new cluster, for which each member has COUNT non-white items.  |
-`---------------------------------------------------------------------*/
+/*--------------------------------------------------------------------.
+| Sort helper.  Compare two tolerant seeds, by decreasing size, then  |
+| by position.							      |
+`--------------------------------------------------------------------*/
 
-static inline void
-new_cluster (int count)
+static int
+compare_for_tolerant_seeds (const void *void_first, const void *void_second)
 {
-  struct cluster *cluster;
+  const struct tolerant_seed *first = (const struct tolerant_seed *) void_first;
+  const struct tolerant_seed *second
+    = (const struct tolerant_seed *) void_second;
 
-  if (clusters % 8 == 0)
-    cluster_array = (struct cluster *)
-      xrealloc (cluster_array, (clusters + 8) * sizeof (struct cluster));
+  if (first->size != second->size)
+    return second->size - first->size;
+  return first->entry - second->entry;
+}
 
-  cluster = cluster_array + clusters++;
-  cluster->first_member = members;
-  cluster->item_count = count;
+/*--------------------------------------------------------------------.
+| Group the COUNT seeds of SORTED_ARRAY by their gram, dropping those |
+| too close to a sentinel for having a full gram, and return how many |
+| seeds remain.							      |
+`--------------------------------------------------------------------*/
+
+static int
+sort_by_grams (int *sorted_array, int count)
+{
+  int sorted = 0;
+  int counter;
+
+  gram_size = minimum_size < TOLERANCE_GRAM ? minimum_size : TOLERANCE_GRAM;
+  gram_hash_array = (unsigned long long *)
+    xmalloc (compact_items * sizeof (unsigned long long));
+
+  for (counter = 0; counter < count; counter++)
+    {
+      int entry = sorted_array[counter];
+      unsigned long long hash = 0;
+      int index;
+
+      for (index = entry; index < entry + gram_size; index++)
+	{
+	  if (compact_type_array[index] == SENTINEL)
+	    break;
+	  hash = (hash ^ compact_checksum_array[index]) * HASH_MULTIPLIER;
+	  hash ^= hash >> 29;
+	}
+      if (index < entry + gram_size)
+	continue;
+
+      gram_hash_array[entry] = hash;
+      sorted_array[sorted++] = entry;
+    }
+
+  qsort (sorted_array, sorted, sizeof (int), compare_for_grams);
+  return sorted;
 }
 
-/*---------------------------.
-| Add a new cluster member.  |
-`---------------------------*/
+/*--------------------------------------------------------------------.
+| Return non-zero if a run of SIZE normal items starting at ENTRY and |
+| matching the run at PIVOT is merely the tail of a longer run, which |
+| starts at the nearest earlier gram in common, going backwards       |
+| through no more than TOLERANCE mismatches.			      |
+`--------------------------------------------------------------------*/
 
-static inline void
-new_member (int item)
+static int
+covered_tolerant_seed (int pivot, int entry, int size)
 {
-  struct member *member;
+  int before1 = pivot;
+  int before2 = entry;
+  int mismatch_count = 0;
 
-  if (members % 8 == 0)
-    member_array = (struct member *)
-      xrealloc (member_array, (members + 8) * sizeof (struct member));
+  while (1)
+    {
+      before1--;
+      before2--;
 
-  member = member_array + members++;
-  member->cluster_number = clusters - 1;
-  member->first_item = item;
+      if (compact_type_array[before1] == SENTINEL
+	  || compact_type_array[before2] == SENTINEL)
+	return 0;
+
+      if (compact_checksum_array[before1] != compact_checksum_array[before2])
+	{
+	  if (++mismatch_count > tolerance)
+	    return 0;
+	}
+      else if (memcmp (compact_checksum_array + before1,
+		       compact_checksum_array + before2,
+		       gram_size * sizeof (unsigned)) == 0)
+	return (identical_size (before1, before2)
+		>= (normal_count_array[compact_item_array[pivot]]
+		    - normal_count_array[compact_item_array[before1]] + size));
+    }
 }
 
-/*------------------------------------.
-| Output a cluster explanation line.  |
-`------------------------------------*/
+/*---------------------------------------------------------------------.
+| Reorder all groups of seeds starting within a chunk of seeds sorted  |
+| by grams into sets, and compute pair sizes, allowing for mismatches. |
+`---------------------------------------------------------------------*/
 
 static void
-explain_member (char prefix, struct member *quote)
+tolerant_job (int job)
 {
-  struct cluster *cluster = cluster_array + quote->cluster_number;
-  struct member *member;
-  int counter;
-  struct reference reference;
+  int start = (long long) set_items * job / cluster_jobs;
+  int finish = (long long) set_items * (job + 1) / cluster_jobs;
+  struct tolerant_seed *seed_array = NULL;
+  size_t allocated_seeds = 0;
+  int position;			/* start of current group */
+  int limit;			/* end of current group */
 
-  putc (prefix, output_file);
-  for (member = member_array + cluster->first_member;
-       member < MEMBER_LIMIT (cluster); member++)
+  /* A group started in a previous chunk is processed by that chunk.  */
+
+  position = start;
+  while (position < finish && position > 0
+	 && same_gram (set_item_array[position - 1], set_item_array[position]))
+    position++;
+
+  for (; position < finish; position = limit)
     {
-      reference = get_reference (member->first_item);
-      fprintf (output_file, member == quote ? " %s%d,%d" : " (%s%d,%d)",
-	       reference.input->nick_name, reference.number,
-	       real_member_size (member));
+      int pivots;
+
+      limit = position + 1;
+      while (limit < set_items
+	     && same_gram (set_item_array[position], set_item_array[limit]))
+	limit++;
+
+      if (limit - position > allocated_seeds)
+	{
+	  allocated_seeds = limit - position;
+	  seed_array = (struct tolerant_seed *)
+	    x2nrealloc (seed_array, &allocated_seeds,
+			sizeof (struct tolerant_seed));
+	}
+
+      /* Extend each pivot against all seeds left in the group.  */
+
+      for (pivots = 0; limit - position >= 2 && pivots < TOLERANCE_PIVOTS;
+	   pivots++)
+	{
+	  int pivot = set_item_array[position];
+	  int seeds = 0;
+	  int others = 0;
+	  int counter;
+
+	  for (counter = position + 1; counter < limit; counter++)
+	    {
+	      int entry = set_item_array[counter];
+	      int size = identical_size (pivot, entry);
+
+	      if (size >= minimum_size
+		  && !covered_tolerant_seed (pivot, entry, size))
+		{
+		  seed_array[seeds].entry = entry;
+		  seed_array[seeds].size = size;
+		  seeds++;
+		}
+	      else
+		set_item_array[position + 1 + others++] = entry;
+	    }
+
+	  /* Seeds left for another pivot go at the end of the group.  */
+
+	  memmove (set_item_array + limit - others,
+		   set_item_array + position + 1, others * sizeof (int));
+	  qsort (seed_array, seeds, sizeof (struct tolerant_seed),
+		 compare_for_tolerant_seeds);
+	  for (counter = 0; counter < seeds; counter++)
+	    {
+	      set_item_array[position + 1 + counter] = seed_array[counter].entry;
+	      pair_size_array[position + counter] = seed_array[counter].size;
+	    }
+	  position += seeds + 1;
+	  pair_size_array[position - 1] = 0;
+	}
+
+      for (; position < limit; position++)
+	pair_size_array[position] = 0;
     }
-  putc ('\n', output_file);
+
+  free (seed_array);
 }
 
-/*----------------------.
-| Search for clusters.  |
-`----------------------*/
+/*---------------------------------------------------------------------.
+| Sort all seeds of the compact view, and write them into a new shard  |
+| named SHARD_NAME, after index entries for all inputs.		       |
+`---------------------------------------------------------------------*/
 
 static void
-prepare_clusters (void)
+save_shard (void)
 {
-  /* The array of indirect items have similar contents next to each other.  */
-  int *indirect_item_array = xmalloc (items * sizeof (int));
-  int indirect_items = 0;	/* number of entries in indirect_item_array */
-  int *cluster_set;		/* index for first member in set of clusters */
-  int *member_set;		/* index for first member in current cluster */
+  int *sorted_array;
+  int sorted = 0;
+  struct input *input;
+  struct shard_trailer trailer;
+  FILE *file;
+  int counter;
 
-  /* For a given index, SIZE_ARRAY[index] describes the common item size
-     between item CLUSTER_SET[index] and CLUSTER_SET[index + 1].  */
-  int *size_array = NULL;
-  int allocated_sizes = 0;	/* allocated entries for size_array */
-  int sizes;			/* number of entries in size_array */
-  int *size;			/* cursor in size_array */
+  for (input = input_array; input < input_array + inputs; input++)
+    if (!input->indexable)
+      error (EXIT_ERROR, 0, _("%s: only regular files may go into a shard"),
+	     input->file_name);
 
-  /* Here is a bag of starts indices for members of the same cluster (having
-     all CLUSTER_SIZE worth items).  These indices are values selected out
-     of INDIRECT_ITEM_ARRAY, between FIRST and LAST (included).  */
-  int *sorter_array = NULL;	/* for ensuring members are in nice order */
-  int sorters;			/* number of members in sorter_array */
-  int *sorter;			/* cursor into sorter_array */
-  int *cursor;			/* cursor into sorter_array */
+  /* Sort all seeds, leaving frequency decisions to the merge.  */
 
-  ITEM *item;			/* cursor in item_array */
+  prepare_compact_view ();
+  sorted_array = (int *) xmalloc ((compact_items + 1) * sizeof (int));
+  if (speed_large_files)
+    {
+      pair_size_array = (int *) xmalloc ((compact_items + 1) * sizeof (int));
+      sorted = sort_by_doubling (sorted_array, NULL);
+      free (pair_size_array);
+    }
+  else
+    {
+      for (counter = 0; counter < compact_items; counter++)
+	if (compact_type_array[counter] == NORMAL
+	    || compact_type_array[counter] == DELIMS)
+	  sorted_array[sorted++] = counter;
+      qsort (sorted_array, sorted, sizeof (int), compare_for_checksum_runs);
+    }
 
-  int cluster_size;		/* size of current cluster */
-  int size_value;		/* current size, or previous cluster size */
-  int counter;			/* all purpose counter */
-  int checksum;			/* possible common cheksum of previous items */
+  /* Write the shard.  */
 
-  /* Sort indices.  */
+  file = fopen (shard_name, "w");
+  if (!file)
+    error (EXIT_ERROR, errno, "%s", shard_name);
 
-#if DEBUGGING
-  if (debugging)
-    fprintf (stderr, _("Sorting"));
-#endif
+  write_index_header (file, inputs);
+  for (input = input_array; input < input_array + inputs; input++)
+    write_index_entry (file, input);
 
-  for (counter = 0; counter < items; counter++)
-    if (item_type (item_array + counter) == NORMAL
-	|| item_type (item_array + counter) == DELIMS)
-      indirect_item_array[indirect_items++] = counter;
-  if (indirect_items < items)
-    indirect_item_array = (int *)
-      xrealloc (indirect_item_array, indirect_items * sizeof (int));
-  qsort (indirect_item_array, indirect_items, sizeof (int),
-	 compare_for_checksum_runs);
+  memset (&trailer, 0, sizeof trailer);
+  strncpy (trailer.magic, SHARD_MAGIC, sizeof trailer.magic);
+  trailer.compact_items = compact_items;
+  trailer.sorted = sorted;
+  write_index_data (file, &trailer, sizeof trailer);
+  write_index_data (file, sorted_array, sorted * sizeof (int));
 
-  /* Find all clusters.  */
+  if (ferror (file) || fclose (file) != 0)
+    error (EXIT_ERROR, errno, "%s", shard_name);
 
-#if DEBUGGING
-  if (debugging)
-    fprintf (stderr, _(", clustering"));
-#endif
+  if (verbose)
+    {
+      fprintf (stderr, _("Shard summary:"));
+      fprintf (stderr, ngettext (" %d file,", " %d files,", inputs), inputs);
+      fprintf (stderr, ngettext (" %d seed sorted\n", " %d seeds sorted\n",
+				 sorted), sorted);
+    }
+
+  free (sorted_array);
+  free_compact_view ();
+}
+
+/*-----------------------------------------------------------------.
+| Move the shard at heap position HOLE down into HEAP, which holds |
+| COUNT shards ordered by their next seed.			   |
+`-----------------------------------------------------------------*/
+
+static void
+sift_shard_heap (struct shard **heap, int count, int hole)
+{
+  struct shard *shard = heap[hole];
+  int value = shard->base + shard->sorted_array[shard->cursor];
+  int child;
 
-  for (cluster_set = indirect_item_array;
-       cluster_set + 1 < indirect_item_array + indirect_items;
-       cluster_set += sizes + 1)
+  while (child = 2 * hole + 1, child < count)
     {
-      /* Find all members beginning with the same run of checksums.  These
-         will be later distributed among a few clusters of various sizes,
-         and so, are common to the incoming set of clusters.  */
+      int child_value = (heap[child]->base
+			 + heap[child]->sorted_array[heap[child]->cursor]);
 
-      sizes = 0;
-      while (cluster_set + sizes + 1 < indirect_item_array + indirect_items)
+      if (child + 1 < count)
 	{
-	  size_value
-	    = identical_size (cluster_set[sizes], cluster_set[sizes + 1]);
-	  if (size_value < minimum_size)
-	    break;
+	  int other_value = (heap[child + 1]->base
+			     + heap[child + 1]->sorted_array[heap[child + 1]
+							     ->cursor]);
 
-	  if (sizes == allocated_sizes)
+	  if (compare_for_checksum_runs (&other_value, &child_value) < 0)
 	    {
-	      allocated_sizes += 32;
-	      size_array = (int *)
-		xrealloc (size_array, allocated_sizes * sizeof (int));
-	      sorter_array = (int *)
-		xrealloc (sorter_array, (allocated_sizes + 1) * sizeof (int));
+	      child++;
+	      child_value = other_value;
 	    }
-	  size_array[sizes++] = size_value;
 	}
+      if (compare_for_checksum_runs (&value, &child_value) <= 0)
+	break;
+      heap[hole] = heap[child];
+      hole = child;
+    }
+  heap[hole] = shard;
+}
 
-      /* This test is not necessary for the algorithm to work, but this
-         fairly common case might be worth a bit of speedup.  Maybe!  */
+/*-------------------------------------------------------------------.
+| Merge sorted seeds from all shards into SORTED_ARRAY, which should |
+| receive COUNT seeds once those flagged in FREQUENT_ARRAY are left  |
+| out.								     |
+`-------------------------------------------------------------------*/
 
-      if (sizes == 0)
-	continue;
+static void
+merge_shard_seeds (int *sorted_array, int count, const char *frequent_array)
+{
+  struct shard **heap;
+  struct shard *shard;
+  int heap_count = 0;
+  int sorted = 0;
+  int counter;
 
-      /* Output all clusters of the set from the tallest to the shortest.
-         Here, size refers to number of items in members, and not to the
-         number of members in a cluster.  (In fact, it is very expectable
-         that shortest clusters have more members.)  */
+  /* Shards should exactly cover the compact view.  */
 
-      cluster_size = 0;
-      while (1)
+  shard = shard_array + shards - 1;
+  if (shard->base + shard->compact_items != compact_items)
+    error (EXIT_ERROR, 0, _("shards do not match the files they name"));
+
+  heap = (struct shard **) xmalloc (shards * sizeof (struct shard *));
+  for (shard = shard_array; shard < shard_array + shards; shard++)
+    if (shard->sorted > 0)
+      heap[heap_count++] = shard;
+  for (counter = heap_count / 2 - 1; counter >= 0; counter--)
+    sift_shard_heap (heap, heap_count, counter);
+
+  while (heap_count > 0)
+    {
+      shard = heap[0];
+      counter = shard->base + shard->sorted_array[shard->cursor];
+      if (compact_type_array[counter] != NORMAL
+	  && compact_type_array[counter] != DELIMS)
+	error (EXIT_ERROR, 0, _("%s: corrupted shard"), shard->name);
+
+      if (!(frequent_array && frequent_array[counter]))
 	{
-	  /* Discover the maximum cluster size not yet processed.  */
+	  if (sorted == count)
+	    error (EXIT_ERROR, 0, _("%s: corrupted shard"), shard->name);
+	  sorted_array[sorted++] = counter;
+	}
+
+      if (++shard->cursor == shard->sorted)
+	heap[0] = heap[--heap_count];
+      if (heap_count > 0)
+	sift_shard_heap (heap, heap_count, 0);
+    }
+
+  if (sorted != count)
+    error (EXIT_ERROR, 0, _("shards do not match the files they name"));
+
+  free (heap);
+}
+
+/*----------------------.
+| Search for clusters.  |
+`----------------------*/
 
-	  size_value = cluster_size;
-	  cluster_size = 0;
+static void
+prepare_clusters (void)
+{
+  /* The array of indirect items have similar contents next to each other.  */
+  int *indirect_item_array = xmalloc (items * sizeof (int));
+  int indirect_items = 0;	/* number of entries in indirect_item_array */
+  struct cluster_buffer *buffer;
+  int *cursor;			/* cursor into a cluster buffer */
+  int *limit;			/* limit value for cursor */
+  int counter;			/* all purpose counter */
+  int frequent_seeds = 0;	/* seeds left out for speed */
+  int pruned_members = 0;	/* set members left out for speed */
 
-	  for (size = size_array; size < size_array + sizes; size++)
-	    if ((size_value == 0 || *size < size_value)
-		&& *size > cluster_size)
-	      cluster_size = *size;
+  /* Sort indices.  Until members get created, indices all refer to the
+     compact view rather than to item_array.  */
 
-	  /* If the cluster size did not decrease, we cannot do more.  */
+#if DEBUGGING
+  if (debugging)
+    fprintf (stderr, _("Sorting"));
+#endif
 
-	  if (cluster_size == 0)
-	    break;
+  prepare_compact_view ();
 
-	  /* Consider all consecutive members having at least the cluster
-	     size in common: they form a cluster.  But any gap in the
-	     sequence represents a change of cluster: same length, but
-	     different contents.  */
+  /* When speeding large files, boilerplate items do not seed clusters,
+     they may only get into clusters seeded by preceding items.  */
 
-	  size = size_array;
-	  while (1)
-	    {
-	      /* Find all members for one cluster.  However, after having
-	         skipped over the gap, just break out if nothing remains.  */
+  speed_limit = SPEED_FREQUENCY_PER_INPUT * inputs + 16;
+  frequent_seed_array = NULL;
+  if (speed_large_files)
+    frequent_seed_array = find_frequent_checksums (speed_limit);
 
-	      while (size < size_array + sizes && *size < cluster_size)
-		size++;
-	      if (size == size_array + sizes)
-		break;
+  for (counter = 0; counter < compact_items; counter++)
+    if (compact_type_array[counter] == NORMAL
+	|| compact_type_array[counter] == DELIMS)
+      {
+	if (frequent_seed_array && frequent_seed_array[counter])
+	  frequent_seeds++;
+	else
+	  indirect_item_array[indirect_items++] = counter;
+      }
 
-	      member_set = cluster_set + (size - size_array);
-	      sorters = 1;
-	      while (size < size_array + sizes && *size >= cluster_size)
-		{
-		  sorters++;
-		  size++;
-		}
+  if (indirect_items < items)
+    indirect_item_array = (int *)
+      xrealloc (indirect_item_array, indirect_items * sizeof (int));
 
-	      /* No cluster may be a proper subset of another.  That is, if
-	         all putative members are preceded by identical items, then
-	         they are indeed part of a bigger cluster, which has already
-	         been or will later be caught.  In such case, just avoid
-	         retaining them here.  This also prevents quadratic
-	         behaviour which, I presume, would be heavy on computation.
+  pair_size_array = (int *) xmalloc ((indirect_items + 1) * sizeof (int));
+  if (tolerance > 0)
+    indirect_items = sort_by_grams (indirect_item_array, indirect_items);
+  else if (merge_shards)
+    merge_shard_seeds (indirect_item_array, indirect_items,
+		       frequent_seed_array);
+  else if (speed_large_files)
+    sort_by_doubling (indirect_item_array, frequent_seed_array);
+  else
+    qsort (indirect_item_array, indirect_items, sizeof (int),
+	   compare_for_checksum_runs);
+  end_phase (PHASE_SORT);
 
-	         This test may be defeated by tolerant matches.  Maybe
-	         tolerant matches will just go away.  Surely, tolerant
-	         matches later require subset member elimination.  */
+  /* Find all clusters.  */
 
-	      item = item_array + member_set[0];
-	      BACKWARD_ITEM (item);
-	      if (item_type (item) != SENTINEL)
-		{
-		  checksum = item->checksum;
+#if DEBUGGING
+  if (debugging)
+    fprintf (stderr, _(", clustering"));
+#endif
 
-		  for (counter = 1; counter < sorters; counter++)
-		    {
-		      item = item_array + member_set[counter];
-		      BACKWARD_ITEM (item);
-		      if (item_type (item) == SENTINEL
-			  || item->checksum != checksum)
-			break;
-		    }
-		  if (counter == sorters)
-		    continue;
-		}
+  set_item_array = indirect_item_array;
+  set_items = indirect_items;
+  cluster_jobs = workers > 1 ? 8 * workers : 1;
+  if (cluster_jobs > set_items)
+    cluster_jobs = set_items > 0 ? set_items : 1;
 
-	      /* Skip any cluster member overlapping with the previous
-	         member of the same cluster.  If doing so, chop the size of
-	         the first member just before the overlap point: this should
-	         later trigger a cluster having this reduced size.  */
+  if (tolerance > 0)
+    run_in_parallel (tolerant_job, cluster_jobs);
+  else if (!speed_large_files || merge_shards)
+    run_in_parallel (measure_job, cluster_jobs);
 
-	      memcpy (sorter_array, member_set, sorters * sizeof (int));
-	      qsort (sorter_array, sorters, sizeof (int),
-		     compare_for_positions);
-	      cursor = sorter_array;
-	      for (counter = 1; counter < sorters; counter++)
-		{
-		  size_value = item_distance (*cursor, sorter_array[counter],
-					      cluster_size);
-		  if (size_value < 0)
-		    *++cursor = sorter_array[counter];
-		  else
-		    {
-		      int counter2;
-
-		      for (counter2 = 0; counter2 < sizes; counter2++)
-			if (cluster_set[counter2] == *cursor
-			    || cluster_set[counter2] == sorter_array[counter])
-			  {
-			    assert (size_value < size_array[counter2]);
-			    size_array[counter2] = size_value;
-			    break;
-			  }
-		      assert (counter2 < sizes);
-		    }
-		}
-	      sorters = cursor - sorter_array + 1;
+  cluster_buffer_array = (struct cluster_buffer *)
+    xcalloc (cluster_jobs, sizeof (struct cluster_buffer));
+  run_in_parallel (cluster_job, cluster_jobs);
 
-	      /* Create the cluster only if at least two members remain.  */
+  /* Create all saved clusters, in order.  */
 
-	      if (sorters >= 2)
-		{
-		  new_cluster (cluster_size);
-		  for (counter = 0; counter < sorters; counter++)
-		    new_member (sorter_array[counter]);
-		}
-	    }
+  for (buffer = cluster_buffer_array;
+       buffer < cluster_buffer_array + cluster_jobs; buffer++)
+    {
+      cursor = buffer->array;
+      limit = buffer->array + buffer->used;
+      while (cursor < limit)
+	{
+	  new_cluster (cursor[0]);
+	  counter = cursor[1];
+	  for (cursor += 2; counter > 0; counter--)
+	    new_member (*cursor++);
 	}
+      pruned_members += buffer->pruned;
+      free (buffer->array);
     }
 
+  free (cluster_buffer_array);
+  free (pair_size_array);
+  free (frequent_seed_array);
+  frequent_seed_array = NULL;
+  if (tolerance > 0)
+    free (gram_hash_array);
+
   /* Add a sentinel cluster at the end.  */
 
   new_cluster (0);
@@ -1826,7 +5656,7 @@ prepare_clusters (void)
   /* Cleanup.  */
 
   free (indirect_item_array);
-  free (size_array);
+  free_compact_view ();
 
 #if DEBUGGING
   if (debugging)
@@ -1835,6 +5665,19 @@ prepare_clusters (void)
       dump_all_clusters ();
     }
 #endif
+
+  if (verbose && speed_large_files)
+    {
+      fprintf (stderr, _("Speed summary:"));
+      fprintf (stderr, ngettext (" %d frequent seed skipped,",
+				 " %d frequent seeds skipped,",
+				 frequent_seeds), frequent_seeds);
+      fprintf (stderr, ngettext (" %d set member pruned\n",
+				 " %d set members pruned\n",
+				 pruned_members), pruned_members);
+    }
+
+  end_phase (PHASE_CLUSTERING);
 }
 
 /*------------------------------------------------------------.
@@ -1846,15 +5689,10 @@ active_elsewhere (struct member *member, struct input *input)
 {
   struct cluster *cluster = cluster_array + member->cluster_number;
 
-  /* FIXME: maybe it is sufficient to test first and last member only?  */
-
-  for (member = member_array + cluster->first_member;
-       member < MEMBER_LIMIT (cluster); member++)
-    if (member->first_item < input->first_item
-	|| member->first_item + real_member_size (member) > input->item_limit)
-      return 1;
+  /* Members are sorted by position, the first one starts earliest.  */
 
-  return 0;
+  return (member_array[cluster->first_member].first_item < input->first_item
+	  || cluster->item_limit > input->item_limit);
 }
 
 /* Indirect members.  */
@@ -1941,8 +5779,8 @@ struct merging
 {
   unsigned group_flag:1;	/* beginning of a new merge group */
   unsigned cross_flag:1;	/* member isolated by cross matches */
-  unsigned input_number:14;	/* input file designator */
-  unsigned member_number:16;	/* member designator */
+  unsigned input_number:30;	/* input file designator */
+  int member_number;		/* member designator */
 };
 
 static struct merging *merging_array = NULL;
@@ -1979,57 +5817,487 @@ dump_all_mergings (void)
   putc ('\n', stderr);
 }
 
-#endif /* DEBUGGING */
+#endif /* DEBUGGING */
+
+/*------------------------------------------------------------------.
+| After having output PREFIX, explain the merging group starting at |
+| MERGING and extending until LIMIT.                                |
+`------------------------------------------------------------------*/
+
+static void
+explain_group (char prefix, struct merging *merging, struct merging *limit)
+{
+  struct cluster *cluster
+    = cluster_array + member_array[merging->member_number].cluster_number;
+  int counter;
+  struct input *input;
+  struct member *member;
+  struct merging *cursor;
+  struct reference reference;
+
+  putc (prefix, output_file);
+  for (counter = cluster->first_member;
+       counter < (cluster + 1)->first_member; counter++)
+    {
+      member = member_array + counter;
+      reference = get_reference (member->first_item);
+
+      for (cursor = merging;
+	   cursor < limit && cursor->member_number != counter; cursor++)
+	;
+
+      fprintf (output_file, cursor < limit ? " %s%d,%d" : " (%s%d,%d)",
+	       reference.input->nick_name,
+	       reference.number, real_member_size (member));
+    }
+  putc ('\n', output_file);
+}
+
+/*--------------------.
+| Add a new merging.  |
+`--------------------*/
+
+static void
+new_merging (int group, int cross, struct input *input, struct member *member)
+{
+  struct merging *merging = merging_array + mergings++;
+
+  merging->group_flag = group;
+  merging->cross_flag = cross;
+  merging->input_number = input - input_array;
+  merging->member_number = member - member_array;
+}
+
+
+/* Candidate clusters.  */
+
+/* At each step, the next merging group comes from a cluster having a
+   member at the head of some input, that is, under its indirect cursor.
+   Such candidate clusters are said to be live.  The cost of each live
+   cluster is kept up to date while inputs advance, and candidates wait in
+   a priority queue ordered by increasing cost, then by increasing input
+   number, so the best candidate is always on top.
+
+   The queue is lazy: an entry is never moved, but rather superseded by a
+   new one when its cluster changes, and stale entries get discarded only
+   once they reach the top.  */
+
+struct candidate
+{
+  int cost;			/* cost of cluster when queued */
+  int input_number;		/* input having the cluster at its head */
+  int cluster_number;		/* cluster being a candidate */
+};
+
+static struct candidate *candidate_array = NULL;
+static size_t candidates = 0;
+static size_t candidates_allocated = 0;
+
+/* Members of a cluster are sorted by position, so those within a given
+   input form a run.  Each run keeps a cursor on its first member neither
+   listed nor invalidated, which only moves forward as its input advances.
+   Members then get scanned once overall, rather than whenever their
+   cluster gets revived or chosen.  */
+
+struct run
+{
+  int input_number;		/* input holding the run */
+  int member_cursor;		/* first member not listed yet */
+  int member_limit;		/* one past the last member of run */
+};
+
+static struct run *run_array;	/* runs of all clusters, in order */
+static int *first_run_array;	/* first run of each cluster, and limit */
+
+/* Whenever an input advances, the cost of each live cluster having some
+   member in that input changes, so each input keeps watches on these.  A
+   watch also remembers how much its input contributes to the cluster cost.
+   It gets stale once its cluster is killed or revived again.  */
+
+struct watch
+{
+  int cluster_number;		/* watched cluster */
+  int life_stamp;		/* life stamp of cluster when watched */
+  int run_number;		/* run of cluster members in input */
+  int cost;			/* contribution of input to cluster cost */
+};
+
+/* The following arrays are indexed by cluster number.  A life stamp is
+   incremented whenever a cluster gets revived or killed, it is odd while
+   the cluster is live.  */
+
+static int *cost_array;		/* cost of each live cluster */
+static int *head_input_array;	/* first input having cluster at head, or -1 */
+static int *life_stamp_array;	/* life stamp of each cluster */
+static int *dirty_step_array;	/* last step changing cost or heads */
+
+/* Clusters changed during the current step, which need requeuing.  */
+
+static int *dirty_array;
+static int dirties;
+static int step;
+
+#define CANDIDATE_BEFORE(Cost1, Input1, Candidate2) \
+  ((Cost1) < (Candidate2)->cost \
+   || ((Cost1) == (Candidate2)->cost && (Input1) < (Candidate2)->input_number))
+
+/*---------------------------------------------------------------------.
+| Tell if MEMBER, not listed yet in INPUT, counts when choosing the    |
+| next merging.  When speeding large files, members too far ahead do   |
+| not, unless they are at the head of INPUT.			       |
+`---------------------------------------------------------------------*/
+
+static inline int
+within_horizon (struct member *member, struct input *input)
+{
+  return (!speed_large_files
+	  || member->first_item - input->item <= SPEED_HORIZON
+	  || (input->indirect_cursor < input->indirect_limit
+	      && member == INPUT_MEMBER (input)));
+}
+
+/*--------------------------------------------------------------------.
+| Move the cursor of RUN after all members already listed, and return |
+| the first member neither listed nor invalidated, or NULL if none.   |
+`--------------------------------------------------------------------*/
+
+static struct member *
+run_member (struct run *run)
+{
+  struct input *input = input_array + run->input_number;
+  struct member *member = member_array + run->member_cursor;
+  struct member *limit = member_array + run->member_limit;
+
+  while (member < limit
+	 && (member->first_item < input->item || member->cluster_number < 0))
+    member++;
+  run->member_cursor = member - member_array;
+
+  return member < limit ? member : NULL;
+}
+
+/*---------------------------------------------------------------------.
+| Move WATCH, for a cluster member in INPUT, after all members already |
+| listed.  Return how many items INPUT would then list as differences  |
+| before the first member not listed yet, or 0 if none remains.	       |
+`---------------------------------------------------------------------*/
+
+static int
+advance_watch (struct watch *watch, struct input *input)
+{
+  struct member *member = run_member (run_array + watch->run_number);
+
+  return (member && within_horizon (member, input)
+	  ? member->first_item - input->item : 0);
+}
+
+/*--------------------------------------------------------------.
+| Queue INPUT as having CLUSTER at its head, with a given COST. |
+`--------------------------------------------------------------*/
+
+static void
+push_candidate (int cost, struct input *input, struct cluster *cluster)
+{
+  int input_number = input - input_array;
+  size_t index;
+  size_t parent;
+
+  if (candidates == candidates_allocated)
+    candidate_array = (struct candidate *)
+      x2nrealloc (candidate_array, &candidates_allocated,
+		  sizeof (struct candidate));
+
+  for (index = candidates++; index > 0; index = parent)
+    {
+      parent = (index - 1) / 2;
+      if (!CANDIDATE_BEFORE (cost, input_number, candidate_array + parent))
+	break;
+      candidate_array[index] = candidate_array[parent];
+    }
+
+  candidate_array[index].cost = cost;
+  candidate_array[index].input_number = input_number;
+  candidate_array[index].cluster_number = cluster - cluster_array;
+}
+
+/*---------------------------------------------.
+| Remove the top entry of the candidate queue. |
+`---------------------------------------------*/
+
+static void
+pop_candidate (void)
+{
+  struct candidate *last = candidate_array + --candidates;
+  size_t index;
+  size_t child;
+
+  for (index = 0; (child = 2 * index + 1) < candidates; index = child)
+    {
+      if (child + 1 < candidates
+	  && CANDIDATE_BEFORE (candidate_array[child + 1].cost,
+			       candidate_array[child + 1].input_number,
+			       candidate_array + child))
+	child++;
+      if (!CANDIDATE_BEFORE (candidate_array[child].cost,
+			     candidate_array[child].input_number, last))
+	break;
+      candidate_array[index] = candidate_array[child];
+    }
+
+  candidate_array[index] = *last;
+}
+
+/*------------------------------------------------------------------.
+| Note that CLUSTER changed during this step, so it gets requeued.  |
+`------------------------------------------------------------------*/
+
+static void
+dirty_cluster (struct cluster *cluster)
+{
+  int number = cluster - cluster_array;
+
+  if (dirty_step_array[number] != step)
+    {
+      dirty_step_array[number] = step;
+      dirty_array[dirties++] = number;
+    }
+}
+
+/*-----------------------------------------------------------------.
+| Make CLUSTER live, compute its cost and watch it from all inputs |
+| having some of its members.                                      |
+`-----------------------------------------------------------------*/
+
+static void
+revive_cluster (struct cluster *cluster)
+{
+  int number = cluster - cluster_array;
+  struct input *input;
+  struct run *run;
+  struct watch *watch;
+
+  life_stamp_array[number]++;
+  cost_array[number] = 0;
+
+  for (run = run_array + first_run_array[number];
+       run < run_array + first_run_array[number + 1]; run++)
+    {
+      /* A run fully listed may never contribute again.  */
+
+      if (!run_member (run))
+	continue;
+
+      input = input_array + run->input_number;
+      if (input->watches == input->watches_allocated)
+	input->watch_array = (struct watch *)
+	  x2nrealloc (input->watch_array, &input->watches_allocated,
+		      sizeof (struct watch));
+      watch = input->watch_array + input->watches++;
+      watch->cluster_number = number;
+      watch->life_stamp = life_stamp_array[number];
+      watch->run_number = run - run_array;
+      watch->cost = advance_watch (watch, input);
+      cost_array[number] += watch->cost;
+    }
+}
+
+/*-----------------------------------------------------------------.
+| Update the cost of all live clusters watched by INPUT, once it   |
+| advanced, while forgetting all stale watches.			   |
+`-----------------------------------------------------------------*/
+
+static void
+update_watches (struct input *input)
+{
+  struct watch *watch;
+  struct watch *kept = input->watch_array;
+  int cost;
+
+  for (watch = input->watch_array;
+       watch < input->watch_array + input->watches; watch++)
+    if (watch->life_stamp == life_stamp_array[watch->cluster_number])
+      {
+	cost = advance_watch (watch, input);
+	if (cost != watch->cost)
+	  {
+	    cost_array[watch->cluster_number] += cost - watch->cost;
+	    watch->cost = cost;
+	    dirty_cluster (cluster_array + watch->cluster_number);
+	  }
+	*kept++ = *watch;
+      }
+
+  input->watches = kept - input->watch_array;
+}
+
+/*-----------------------------------------------------------------.
+| Add INPUT to the list of inputs having CLUSTER at their head.    |
+`-----------------------------------------------------------------*/
+
+static void
+link_head (struct input *input, struct cluster *cluster)
+{
+  int number = cluster - cluster_array;
+
+  input->previous_head = -1;
+  input->next_head = head_input_array[number];
+  if (input->next_head >= 0)
+    input_array[input->next_head].previous_head = input - input_array;
+  head_input_array[number] = input - input_array;
+}
+
+/*--------------------------------------------------------------------.
+| Remove INPUT from the list of inputs having CLUSTER at their head.  |
+`--------------------------------------------------------------------*/
+
+static void
+unlink_head (struct input *input, struct cluster *cluster)
+{
+  if (input->previous_head >= 0)
+    input_array[input->previous_head].next_head = input->next_head;
+  else
+    head_input_array[cluster - cluster_array] = input->next_head;
+  if (input->next_head >= 0)
+    input_array[input->next_head].previous_head = input->previous_head;
+}
+
+/*--------------------------------------------------------------------.
+| Return the best cluster to merge next, or NULL if none remains.     |
+| Ties go to the cluster at the head of the earliest input file.      |
+`--------------------------------------------------------------------*/
+
+static struct cluster *
+best_candidate (void)
+{
+  struct candidate *top;
+  struct input *input;
+
+  while (candidates > 0)
+    {
+      top = candidate_array;
+      input = input_array + top->input_number;
+      if (input->indirect_cursor < input->indirect_limit
+	  && INPUT_CLUSTER (input) == cluster_array + top->cluster_number
+	  && cost_array[top->cluster_number] == top->cost)
+	return cluster_array + top->cluster_number;
+      pop_candidate ();
+    }
+
+  return NULL;
+}
+
+#if DEBUGGING
+
+/*---------------------------------------------------------------------.
+| Find the best cluster to merge next by evaluating all candidates in  |
+| turn, while explaining costs.  This validates the candidate queue.   |
+`---------------------------------------------------------------------*/
+
+static struct cluster *
+debug_best_candidate (void)
+{
+  struct input *input0;
+  struct input *input;
+  struct member *member;
+  struct cluster *cluster;	/* current cluster candidate */
+  int cost;			/* cost associate with current candidate */
+  struct cluster *best_cluster;	/* best cluster candidate for hunk */
+  int best_cost;		/* cost associated with best cluster */
+
+  best_cluster = NULL;
+  for (input0 = input_array; input0 < input_array + inputs; input0++)
+    if (input0->indirect_cursor < input0->indirect_limit)
+      {
+	cluster = INPUT_CLUSTER (input0);
+	fprintf (stderr, "%s:\t", reference_string (input0->item));
+	dump_cluster (cluster);
+
+	/* Skip this input if we have already evaluated the cluster.  */
+
+	for (input = input_array; input < input0; input++)
+	  if (input->indirect_cursor < input->indirect_limit
+	      && INPUT_CLUSTER (input) == cluster)
+	    break;
+	if (input < input0)
+	  continue;
+
+	/* Evaluate the cost of the cluster.  This will be the total number
+	   of difference items needed in the listing for getting to the
+	   point of printing the cluster.  For computing it, check all
+	   members of the evaluated cluster, retaining only one member per
+	   file, in fact, exactly the first which has not been listed yet.  */
+
+	cost = 0;
+	input = input_array;
+	member = member_array + cluster->first_member;
+	while (member < MEMBER_LIMIT (cluster))
+	  {
+	    /* Just ignore invalidated members.  */
+
+	    if (member->cluster_number < 0)
+	      {
+		member++;
+		continue;
+	      }
+
+	    /* Find the proper file.  */
 
-/*------------------------------------------------------------------.
-| After having output PREFIX, explain the merging group starting at |
-| MERGING and extending until LIMIT.                                |
-`------------------------------------------------------------------*/
+	    while (member->first_item >= input->item_limit)
+	      input++;
 
-static void
-explain_group (char prefix, struct merging *merging, struct merging *limit)
-{
-  struct cluster *cluster
-    = cluster_array + member_array[merging->member_number].cluster_number;
-  int counter;
-  struct input *input;
-  struct member *member;
-  struct merging *cursor;
-  struct reference reference;
+	    /* Ignore a member that would have been already listed, or which
+	       is too far ahead.  */
 
-  putc (prefix, output_file);
-  for (counter = cluster->first_member;
-       counter < (cluster + 1)->first_member; counter++)
-    {
-      member = member_array + counter;
-      reference = get_reference (member->first_item);
+	    if (member->first_item < input->item)
+	      {
+		member++;
+		continue;
+	      }
+	    if (!within_horizon (member, input))
+	      {
+		while (member < MEMBER_LIMIT (cluster)
+		       && member->first_item < input->item_limit)
+		  member++;
+		continue;
+	      }
 
-      for (cursor = merging;
-	   cursor < limit && cursor->member_number != counter; cursor++)
-	;
+	    /* Accumulate cost for this member.  */
 
-      fprintf (output_file, cursor < limit ? " %s%d,%d" : " (%s%d,%d)",
-	       reference.input->nick_name,
-	       reference.number, real_member_size (member));
-    }
-  putc ('\n', output_file);
-}
+	    fprintf (stderr, "    Cost += %d  [%s..%s)\n",
+		     member->first_item - input->item,
+		     reference_string (input->item),
+		     reference_string (member->first_item));
+	    cost += (member++)->first_item - input->item;
 
-/*--------------------.
-| Add a new merging.  |
-`--------------------*/
+	    /* Skip other members that would appear later in same file.  */
 
-static void
-new_merging (int group, int cross, struct input *input, struct member *member)
-{
-  struct merging *merging = merging_array + mergings++;
+	    while (member < MEMBER_LIMIT (cluster)
+		   && member->first_item < input->item_limit)
+	      member++;
+	  }
+	assert (cost == cost_array[cluster - cluster_array]);
 
-  merging->group_flag = group;
-  merging->cross_flag = cross;
-  merging->input_number = input - input_array;
-  merging->member_number = member - member_array;
+	/* Retain the best cluster so far.  */
+
+	if (best_cluster)
+	  fprintf (stderr, "  {%ld}=%d <-> {%ld}=%d\n",
+		   (long) (best_cluster - cluster_array), best_cost,
+		   (long) (cluster - cluster_array), cost);
+	else
+	  fprintf (stderr, "  {%ld}=%d\n",
+		   (long) (cluster - cluster_array), cost);
+	if (!best_cluster || cost < best_cost)
+	  {
+	    best_cluster = cluster;
+	    best_cost = cost;
+	  }
+      }
+
+  return best_cluster;
 }
 
+#endif /* DEBUGGING */
+
 /*------------------------------.
 | Decide the merging sequence.  |
 `------------------------------*/
@@ -2039,36 +6307,76 @@ prepare_mergings (void)
 {
   int *cursor;
 
-  struct input *input0;
   struct input *input;
   struct member *member;
+  struct run *run;
+  int runs;
 
-  struct cluster *cluster;	/* current cluster candidate */
-  int cost;			/* cost associate with current candidate */
+  struct cluster *cluster;	/* cluster at head of some input */
   struct cluster *best_cluster;	/* best cluster candidate for hunk */
-  int best_cost;		/* cost associated with best cluster */
   int group_flag;		/* set if next merging starts group */
 
+  int *old_head_array;		/* cluster at head of each advanced input */
+  struct input **advanced_array; /* inputs advanced in this step */
+  int advanced;			/* number of entries in advanced_array */
+  int deferred_members = 0;	/* far members left for later, for speed */
+  int counter;
+
   /* Remove member overlaps.  */
 
   if (members > 0)
     {
-      int counter;
+      indirects = 0;
+      if (diff_hunks)
+	{
+	  /* For diffs, retain the longest of overlapping members, as a
+	     one-line blank member could otherwise shadow a much longer
+	     match.  A member replacing a shorter one cannot overlap the
+	     member retained before, as it starts later.  */
+
+	  for (counter = 0; counter < members; counter++)
+	    {
+	      member = member_array + indirect_array[counter];
+	      if (indirects > 0)
+		{
+		  struct member *kept
+		    = member_array + indirect_array[indirects - 1];
 
-      /* When members overlap, retain only the shortest ones (for now).  */
+		  if (kept->first_item + real_member_size (kept)
+		      > member->first_item)
+		    {
+		      /* Invalidate the shorter member.  */
 
-      indirects = 0;
-      for (counter = 0; counter < members - 1; counter++)
+		      if (real_member_size (member)
+			  <= real_member_size (kept))
+			{
+			  member->cluster_number = -1;
+			  continue;
+			}
+		      kept->cluster_number = -1;
+		      indirects--;
+		    }
+		}
+	      indirect_array[indirects++] = indirect_array[counter];
+	    }
+	}
+      else
 	{
-	  member = member_array + indirect_array[counter];
-	  if (member->first_item + real_member_size (member)
-	      <= member_array[indirect_array[counter + 1]].first_item)
-	    indirect_array[indirects++] = indirect_array[counter];
-	  else
-	    /* Invalidate this member.  */
-	    member->cluster_number = -1;
+	  /* When members overlap, retain only the shortest ones (for
+	     now).  */
+
+	  for (counter = 0; counter < members - 1; counter++)
+	    {
+	      member = member_array + indirect_array[counter];
+	      if (member->first_item + real_member_size (member)
+		  <= member_array[indirect_array[counter + 1]].first_item)
+		indirect_array[indirects++] = indirect_array[counter];
+	      else
+		/* Invalidate this member.  */
+		member->cluster_number = -1;
+	    }
+	  indirect_array[indirects++] = indirect_array[counter];
 	}
-      indirect_array[indirects++] = indirect_array[counter];
     }
 
   /* Once indirects sorted and ready, this array is logically split into
@@ -2087,11 +6395,71 @@ prepare_mergings (void)
       input->indirect_limit = cursor;
     }
 
+  /* Split the members of each cluster into runs, one per input.  */
+
+  run_array = xmalloc ((members + 1) * sizeof (struct run));
+  first_run_array = xmalloc ((clusters + 1) * sizeof (int));
+  runs = 0;
+  for (cluster = cluster_array; cluster < cluster_array + clusters; cluster++)
+    {
+      first_run_array[cluster - cluster_array] = runs;
+      input = NULL;
+      for (member = member_array + cluster->first_member;
+	   member < MEMBER_LIMIT (cluster); member++)
+	{
+	  if (!input || member->first_item >= input->item_limit)
+	    {
+	      input = get_reference (member->first_item).input;
+	      run_array[runs].input_number = input - input_array;
+	      run_array[runs].member_cursor = member - member_array;
+	      runs++;
+	    }
+	  run_array[runs - 1].member_limit = member - member_array + 1;
+	}
+    }
+  first_run_array[clusters] = runs;
+
   /* Allocate an array for discovered mergings.  */
 
   merging_array = xmalloc (indirects * sizeof (struct merging));
   mergings = 0;
 
+  /* Queue the cluster at the head of each input.  */
+
+  cost_array = xmalloc (clusters * sizeof (int));
+  head_input_array = xmalloc (clusters * sizeof (int));
+  life_stamp_array = xmalloc (clusters * sizeof (int));
+  dirty_step_array = xmalloc (clusters * sizeof (int));
+  dirty_array = xmalloc (clusters * sizeof (int));
+  for (counter = 0; counter < clusters; counter++)
+    {
+      head_input_array[counter] = -1;
+      life_stamp_array[counter] = 0;
+      dirty_step_array[counter] = -1;
+    }
+  dirties = 0;
+  step = 0;
+
+  old_head_array = xmalloc (inputs * sizeof (int));
+  advanced_array = xmalloc (inputs * sizeof (struct input *));
+
+  for (input = input_array; input < input_array + inputs; input++)
+    {
+      input->watch_array = NULL;
+      input->watches = 0;
+      input->watches_allocated = 0;
+      if (input->indirect_cursor < input->indirect_limit)
+	link_head (input, INPUT_CLUSTER (input));
+    }
+  for (input = input_array; input < input_array + inputs; input++)
+    if (input->indirect_cursor < input->indirect_limit)
+      {
+	cluster = INPUT_CLUSTER (input);
+	if (life_stamp_array[cluster - cluster_array] % 2 == 0)
+	  revive_cluster (cluster);
+	push_candidate (cost_array[cluster - cluster_array], input, cluster);
+      }
+
   /* Repetitively consider the incoming cluster members for all inputs, and
      select at each iteration the cluster members causing least differences.
      This may indirectly trigger bigger differences into later iterations.
@@ -2117,99 +6485,11 @@ prepare_mergings (void)
 	}
 #endif
 
-      best_cluster = NULL;
-      for (input0 = input_array; input0 < input_array + inputs; input0++)
-	if (input0->indirect_cursor < input0->indirect_limit)
-	  {
-	    cluster = INPUT_CLUSTER (input0);
-#if DEBUGGING
-	    if (debugging)
-	      {
-		fprintf (stderr, "%s:\t", reference_string (input0->item));
-		dump_cluster (cluster);
-	      }
-#endif
-
-	    /* Skip this input if we have already evaluated the cluster.  */
-
-	    for (input = input_array; input < input0; input++)
-	      if (input->indirect_cursor < input->indirect_limit
-		  && INPUT_CLUSTER (input) == cluster)
-		break;
-	    if (input < input0)
-	      continue;
-
-	    /* Evaluate the cost of the cluster.  This will be the total
-	       number of difference items needed in the listing for getting
-	       to the point of printing the cluster.  For computing it,
-	       check all members of the evaluated cluster, retaining only
-	       one member per file, in fact, exactly the first which has not
-	       been listed yet.  */
-
-	    cost = 0;
-	    input = input_array;
-	    member = member_array + cluster->first_member;
-	    while (member < MEMBER_LIMIT (cluster))
-	      {
-		/* Just ignore invalidated members.  */
-
-		if (member->cluster_number < 0)
-		  {
-		    member++;
-		    continue;
-		  }
-
-		/* Find the proper file.  */
-
-		while (member->first_item >= input->item_limit)
-		  input++;
-
-		/* Ignore a member that would have been already listed.  */
-
-		if (member->first_item < input->item)
-		  {
-		    member++;
-		    continue;
-		  }
-
-		/* Accumulate cost for this member.  */
-
-#if DEBUGGING
-		if (debugging)
-		  fprintf (stderr, "    Cost += %d  [%s..%s)\n",
-			   member->first_item - input->item,
-			   reference_string (input->item),
-			   reference_string (member->first_item));
-#endif
-		cost += (member++)->first_item - input->item;
-
-		/* Skip other members that would appear later in same file.  */
-
-		while (member < MEMBER_LIMIT (cluster)
-		       && member->first_item < input->item_limit)
-		  member++;
-	      }
-
-	    /* Retain the best cluster so far.  */
-
+      best_cluster = best_candidate ();
 #if DEBUGGING
-	    if (debugging)
-	      {
-		if (best_cluster)
-		  fprintf (stderr, "  {%ld}=%d <-> {%ld}=%d\n",
-			   (long) (best_cluster - cluster_array), best_cost,
-			   (long) (cluster - cluster_array), cost);
-		else
-		  fprintf (stderr, "  {%ld}=%d\n",
-			   (long) (cluster - cluster_array), cost);
-	      }
+      if (debugging)
+	assert (debug_best_candidate () == best_cluster);
 #endif
-	    if (!best_cluster || cost < best_cost)
-	      {
-		best_cluster = cluster;
-		best_cost = cost;
-	      }
-	  }
 
       /* Get out if everything has been done.  */
 
@@ -2228,20 +6508,18 @@ prepare_mergings (void)
       /* Save found mergings, while moving all items pointers to after the
          members of the best cluster.  */
 
-      input = input_array;
       group_flag = 1;
-      member = member_array + best_cluster->first_member;
-      while (member < MEMBER_LIMIT (best_cluster))
+      advanced = 0;
+      for (run = run_array + first_run_array[best_cluster - cluster_array];
+	   run < run_array + first_run_array[best_cluster - cluster_array + 1];
+	   run++)
 	{
-	  /* Just ignore invalidated members.  */
-
-	  if (member->cluster_number < 0)
-	    {
-	      member++;
-	      continue;
-	    }
+	  /* Ignore inputs where all members were already listed.  */
 
-	  /* Find the proper file.  */
+	  member = run_member (run);
+	  if (!member)
+	    continue;
+	  input = input_array + run->input_number;
 
 #if DEBUGGING
 	  if (debugging)
@@ -2250,17 +6528,20 @@ prepare_mergings (void)
 	      dump_member (member);
 	    }
 #endif
-	  while (member->first_item >= input->item_limit)
-	    input++;
 
-	  /* Ignore a member that would have been already listed.  */
+	  /* Leave a member too far ahead for a later merging group.  */
 
-	  if (member->first_item < input->item)
+	  if (!within_horizon (member, input))
 	    {
-	      member++;
+	      deferred_members++;
 	      continue;
 	    }
 
+	  /* Remember how this input was, for updating candidates.  */
+
+	  old_head_array[advanced] = INPUT_CLUSTER (input) - cluster_array;
+	  advanced_array[advanced++] = input;
+
 	  /* Skip all crossed members while adding them as crossed mergings.  */
 
 	  while (INPUT_MEMBER (input) != member)
@@ -2278,12 +6559,47 @@ prepare_mergings (void)
 	  group_flag = 0;
 	  input->item = member->first_item + real_member_size (member);
 	  input->indirect_cursor++;
+	}
+
+      /* Update the costs of live clusters having members in advanced
+	 inputs, and move these inputs to the cluster now at their head.  */
+
+      step++;
+      dirties = 0;
+      for (counter = 0; counter < advanced; counter++)
+	{
+	  input = advanced_array[counter];
+	  update_watches (input);
+	  unlink_head (input, cluster_array + old_head_array[counter]);
+	  if (input->indirect_cursor < input->indirect_limit)
+	    {
+	      cluster = INPUT_CLUSTER (input);
+	      link_head (input, cluster);
+	      dirty_cluster (cluster);
+	    }
+	}
+
+      /* Kill clusters no more at any head, revive those newly at a head,
+	 then queue again all inputs having a changed cluster at head.  */
 
-	  /* Skip other members that would appear later in same file.  */
+      for (counter = 0; counter < advanced; counter++)
+	if (head_input_array[old_head_array[counter]] < 0
+	    && life_stamp_array[old_head_array[counter]] % 2 == 1)
+	  life_stamp_array[old_head_array[counter]]++;
+
+      for (counter = 0; counter < dirties; counter++)
+	{
+	  int number = dirty_array[counter];
+	  int input_number;
 
-	  while (member < MEMBER_LIMIT (best_cluster)
-		 && member->first_item < input->item_limit)
-	    member++;
+	  if (head_input_array[number] < 0)
+	    continue;
+	  if (life_stamp_array[number] % 2 == 0)
+	    revive_cluster (cluster_array + number);
+	  for (input_number = head_input_array[number]; input_number >= 0;
+	       input_number = input_array[input_number].next_head)
+	    push_candidate (cost_array[number], input_array + input_number,
+			    cluster_array + number);
 	}
     }
 
@@ -2294,6 +6610,24 @@ prepare_mergings (void)
 
   assert (mergings == indirects);
 
+  /* Cleanup.  */
+
+  for (input = input_array; input < input_array + inputs; input++)
+    free (input->watch_array);
+  free (candidate_array);
+  candidate_array = NULL;
+  candidates = 0;
+  candidates_allocated = 0;
+  free (cost_array);
+  free (head_input_array);
+  free (life_stamp_array);
+  free (dirty_step_array);
+  free (dirty_array);
+  free (run_array);
+  free (first_run_array);
+  free (old_head_array);
+  free (advanced_array);
+
   if (verbose)
     {
       fprintf (stderr, _("Work summary:"));
@@ -2303,6 +6637,13 @@ prepare_mergings (void)
 	       members);
       fprintf (stderr, ngettext (" %d overlap\n", " %d overlaps\n",
 				 members - indirects), members - indirects);
+      if (speed_large_files)
+	{
+	  fprintf (stderr, _("Speed summary:"));
+	  fprintf (stderr, ngettext (" %d far member deferred\n",
+				     " %d far members deferred\n",
+				     deferred_members), deferred_members);
+	}
     }
 }
 
@@ -2328,7 +6669,53 @@ enum emphasis
 };
 
 /* Current output emphasis.  */
-enum emphasis current_emphasis = STRAIGHT;
+THREAD_LOCAL enum emphasis current_emphasis = STRAIGHT;
+
+#if HAVE_TPUTS
+
+/* Terminal strings get rendered through tputs once and for all, so
+   switching emphasis later merely writes a ready string.  */
+
+static char *rendered_buffer = NULL;
+static size_t rendered_allocated = 0;
+static size_t rendered_length = 0;
+
+/*------------------------------------------------.
+| Save one character for tputs, while rendering.  |
+`------------------------------------------------*/
+
+static int
+collect_for_tputs (int character)
+{
+  if (rendered_length == rendered_allocated)
+    rendered_buffer = (char *)
+      x2nrealloc (rendered_buffer, &rendered_allocated, 1);
+  rendered_buffer[rendered_length++] = character;
+  return character;
+}
+
+/*---------------------------------------------------------------.
+| Return the termcap STRING with padding done, or NULL if none.  |
+`---------------------------------------------------------------*/
+
+static const char *
+render_termcap (const char *string)
+{
+  char *result;
+
+  if (!string)
+    return NULL;
+
+  rendered_length = 0;
+  tputs (string, 1, collect_for_tputs);
+  collect_for_tputs ('\0');
+
+  result = xmalloc (rendered_length);
+  memcpy (result, rendered_buffer, rendered_length);
+  return result;
+}
+
+#endif /* HAVE_TPUTS */
 
 /*-----------------------------.
 | Select strings for marking.  |
@@ -2360,10 +6747,10 @@ initialize_strings (void)
       buffer = (char *) malloc (strlen (term_buffer));
       filler = buffer;
 
-      termcap_start_underline = tgetstr ("us", &filler);
-      termcap_stop_underline = tgetstr ("ue", &filler);
-      termcap_start_bold = tgetstr ("so", &filler);
-      termcap_stop_bold = tgetstr ("se", &filler);
+      termcap_start_underline = render_termcap (tgetstr ("us", &filler));
+      termcap_stop_underline = render_termcap (tgetstr ("ue", &filler));
+      termcap_start_bold = render_termcap (tgetstr ("so", &filler));
+      termcap_stop_bold = render_termcap (tgetstr ("se", &filler));
     }
 #endif /* HAVE_TPUTS */
 
@@ -2396,20 +6783,6 @@ initialize_strings (void)
     }
 }
 
-#if HAVE_TPUTS
-
-/*-----------------------------------------.
-| Write one character for tputs function.  |
-`-----------------------------------------*/
-
-static int
-putc_for_tputs (int character)
-{
-  return putc (character, output_file);
-}
-
-#endif /* HAVE_TPUTS */
-
 /*-----------------------.
 | Set current EMPHASIS.  |
 `-----------------------*/
@@ -2429,12 +6802,12 @@ set_emphasis (enum emphasis emphasis)
 
 	case UNDERLINED:
 	  if (termcap_start_underline)
-	    tputs (termcap_start_underline, 0, putc_for_tputs);
+	    fputs (termcap_start_underline, output_file);
 	  break;
 
 	case BOLD:
 	  if (termcap_start_bold)
-	    tputs (termcap_start_bold, 0, putc_for_tputs);
+	    fputs (termcap_start_bold, output_file);
 	  break;
 	}
       break;
@@ -2444,7 +6817,7 @@ set_emphasis (enum emphasis emphasis)
 	{
 	case STRAIGHT:
 	  if (termcap_stop_underline)
-	    tputs (termcap_stop_underline, 0, putc_for_tputs);
+	    fputs (termcap_stop_underline, output_file);
 	  break;
 
 	case UNDERLINED:
@@ -2453,9 +6826,9 @@ set_emphasis (enum emphasis emphasis)
 
 	case BOLD:
 	  if (termcap_stop_underline)
-	    tputs (termcap_stop_underline, 0, putc_for_tputs);
+	    fputs (termcap_stop_underline, output_file);
 	  if (termcap_start_bold)
-	    tputs (termcap_start_bold, 0, putc_for_tputs);
+	    fputs (termcap_start_bold, output_file);
 	  break;
 	}
       break;
@@ -2465,14 +6838,14 @@ set_emphasis (enum emphasis emphasis)
 	{
 	case STRAIGHT:
 	  if (termcap_stop_bold)
-	    tputs (termcap_stop_bold, 0, putc_for_tputs);
+	    fputs (termcap_stop_bold, output_file);
 	  break;
 
 	case UNDERLINED:
 	  if (termcap_stop_bold)
-	    tputs (termcap_stop_bold, 0, putc_for_tputs);
+	    fputs (termcap_stop_bold, output_file);
 	  if (termcap_start_underline)
-	    tputs (termcap_start_underline, 0, putc_for_tputs);
+	    fputs (termcap_start_underline, output_file);
 	  break;
 
 	case BOLD:
@@ -2492,8 +6865,8 @@ set_emphasis (enum emphasis emphasis)
 
 #define EMPHASIS_STACK_LENGTH 1
 
-static enum emphasis emphasis_array[EMPHASIS_STACK_LENGTH];
-static int emphasises = 0;
+static THREAD_LOCAL enum emphasis emphasis_array[EMPHASIS_STACK_LENGTH];
+static THREAD_LOCAL int emphasises = 0;
 
 static void
 push_emphasis (enum emphasis emphasis)
@@ -2512,6 +6885,15 @@ pop_emphasis (void)
   set_emphasis (emphasis_array[--emphasises]);
 }
 
+/* Characters needing special care while expanding or overstriking.  */
+static const char special_output[CHAR_SET_SIZE] =
+  {
+    ['\b'] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1
+  };
+
+/* Spaces, for expanding TABs at once.  */
+static const char output_spaces[] = "        ";
+
 /*--------------------------------------------------------------------------.
 | Output a STRING having LENGTH characters, subject to the current          |
 | emphasis.  If EXPAND is nonzero, expand TABs.  For expansion to work      |
@@ -2521,13 +6903,39 @@ pop_emphasis (void)
 static void
 output_characters (const char *string, int length, int expand)
 {
-  static unsigned column = 0;
+  static THREAD_LOCAL unsigned column = 0;
 
   const char *cursor;
-  int counter;
+  const char *limit = string + length;
+  const char *run;
+  int fill;
+
+  if (!overstrike && !expand)
+    {
+      fwrite (string, length, 1, output_file);
+      return;
+    }
+
+  cursor = string;
+  while (cursor < limit)
+    {
+      /* Unless overstriking is needed, write whole runs of ordinary
+	 characters at once.  */
+
+      if (!overstrike || current_emphasis == STRAIGHT)
+	{
+	  for (run = cursor;
+	       cursor < limit && !special_output[(unsigned char) *cursor];
+	       cursor++)
+	    ;
+	  if (cursor > run)
+	    {
+	      fwrite (run, cursor - run, 1, output_file);
+	      column += cursor - run;
+	      continue;
+	    }
+	}
 
-  if (overstrike || expand)
-    for (cursor = string; cursor < string + length; cursor++)
       switch (*cursor)
 	{
 	  /* Underlining or overstriking whitespace surely looks strange,
@@ -2541,78 +6949,43 @@ output_characters (const char *string, int length, int expand)
 	  column = 0;
 	  break;
 
-	case '\b':
-	  putc ('\b', output_file);
-	  if (column > 0)
-	    column--;
-	  break;
-
-	case '\t':
-	  if (expand)
-	    do
-	      {
-		if (overstrike)
-		  switch (current_emphasis)
-		    {
-		    case STRAIGHT:
-		      putc (' ', output_file);
-		      break;
-
-		    case UNDERLINED:
-		      putc ('_', output_file);
-		      if (overstrike_for_less)
-			{
-			  putc ('\b', output_file);
-			  putc (' ', output_file);
-			}
-		      break;
-
-		    case BOLD:
-		      putc (*cursor, output_file);
-		      if (overstrike_for_less)
-			{
-			  putc ('\b', output_file);
-			  putc (' ', output_file);
-			}
-		      break;
-		    }
-		else
-		  putc (' ', output_file);
-		column++;
-	      }
-	    while (column % 8 != 0);
-	  else
-	    putc ('\t', output_file);
-	  break;
-
-	case ' ':
-	  if (overstrike)
-	    switch (current_emphasis)
-	      {
-	      case STRAIGHT:
-		putc (' ', output_file);
-		break;
-
-	      case UNDERLINED:
-		putc ('_', output_file);
-		if (overstrike_for_less)
-		  {
-		    putc ('\b', output_file);
-		    putc (' ', output_file);
-		  }
-		break;
+	case '\b':
+	  putc ('\b', output_file);
+	  if (column > 0)
+	    column--;
+	  break;
 
-	      case BOLD:
-		putc (' ', output_file);
+	case '\t':
+	  if (!expand)
+	    putc ('\t', output_file);
+	  else if (!overstrike || current_emphasis == STRAIGHT)
+	    {
+	      fill = 8 - column % 8;
+	      fwrite (output_spaces, fill, 1, output_file);
+	      column += fill;
+	    }
+	  else
+	    do
+	      {
+		putc (current_emphasis == UNDERLINED ? '_' : '\t',
+		      output_file);
 		if (overstrike_for_less)
 		  {
 		    putc ('\b', output_file);
 		    putc (' ', output_file);
 		  }
-		break;
+		column++;
 	      }
-	  else
-	    putc (' ', output_file);
+	    while (column % 8 != 0);
+	  break;
+
+	case ' ':
+	  putc (current_emphasis == UNDERLINED ? '_' : ' ', output_file);
+	  if (overstrike_for_less)
+	    {
+	      putc ('\b', output_file);
+	      putc (' ', output_file);
+	    }
 	  column++;
 	  break;
 
@@ -2627,32 +7000,14 @@ output_characters (const char *string, int length, int expand)
 	  /* Fall through.  */
 
 	default:
-	  if (overstrike)
-	    switch (current_emphasis)
-	      {
-	      case STRAIGHT:
-		putc (*cursor, output_file);
-		break;
-
-	      case UNDERLINED:
-		putc ('_', output_file);
-		putc ('\b', output_file);
-		putc (*cursor, output_file);
-		break;
-
-	      case BOLD:
-		putc (*cursor, output_file);
-		putc ('\b', output_file);
-		putc (*cursor, output_file);
-		break;
-	      }
-	  else
-	    putc (*cursor, output_file);
+	  putc (current_emphasis == UNDERLINED ? '_' : *cursor, output_file);
+	  putc ('\b', output_file);
+	  putc (*cursor, output_file);
 	  column++;
 	  break;
 	}
-  else
-    fwrite (string, length, 1, output_file);
+      cursor++;
+    }
 }
 
 /*------------------------------------------------------------------------.
@@ -2674,7 +7029,7 @@ start_of_emphasis (struct input *input, enum emphasis emphasis)
 
 #if HAVE_TPUTS
   if (input->term_start)
-    tputs (input->term_start, 0, putc_for_tputs);
+    fputs (input->term_start, output_file);
 #endif
 
   if (input->user_start)
@@ -2705,12 +7060,27 @@ end_of_emphasis (struct input *input)
 
 #if HAVE_TPUTS
   if (input->term_stop)
-    tputs (input->term_stop, 0, putc_for_tputs);
+    fputs (input->term_stop, output_file);
 #endif
 
   current_emphasis = STRAIGHT;
 }
 
+/* Size of the output buffer, when output does not go to a terminal.  */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/*---------------------------------------------------------------------.
+| Have FILE, not yet written to, use a large buffer unless a user may  |
+| be watching it directly.                                             |
+`---------------------------------------------------------------------*/
+
+static void
+buffer_output_file (FILE *file)
+{
+  if (!isatty (fileno (file)))
+    setvbuf (file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+}
+
 /*-------------------------------------------------------------------.
 | Launch the output pager if any.  If INPUT is not NULL, do it for a |
 | specific input file.                                               |
@@ -2725,6 +7095,7 @@ launch_output_program (struct input *input)
 	output_file = writepipe ("pr", "-f", "-h", input->file_name, NULL);
       else
 	output_file = writepipe ("pr", "-f", NULL);
+      buffer_output_file (output_file);
     }
   else
     {
@@ -2788,6 +7159,7 @@ launch_output_program (struct input *input)
 	  output_file = writepipe (program, NULL);
 	  if (!output_file)
 	    error (EXIT_ERROR, errno, "%s", program);
+	  buffer_output_file (output_file);
 	}
     }
 }
@@ -2826,7 +7198,7 @@ enum margin_mode
 static void
 make_margin (struct input *input, enum margin_mode margin)
 {
-  char buffer[15];
+  char buffer[32];
   char *cursor;
 
   switch (margin)
@@ -2842,7 +7214,7 @@ make_margin (struct input *input, enum margin_mode margin)
     case FILLER_IN_MARGIN:
       cursor = buffer + strlen (input->nick_name);
       *cursor-- = '\0';
-      while (cursor > buffer)
+      while (cursor >= buffer)
 	*cursor-- = '|';
       break;
 
@@ -2903,9 +7275,13 @@ copy_line_item (struct input *input, enum margin_mode margin)
 static void
 skip_whitespace (struct input *input)
 {
+  const char *start;
+
   assert (input->cursor);
-  while (input->cursor && isspace (*input->cursor))
-    input_character (input);
+  while (input->cursor && !locate_item (input, &start))
+    input_character_helper (input);
+  if (input->cursor)
+    input->cursor = (char *) start;
 
   /* FIXME: Maybe worth following columns for TAB expansion, maybe not?  */
 }
@@ -2918,11 +7294,18 @@ static void
 copy_whitespace (struct input *input, enum margin_mode margin)
 {
   char *string = input->cursor;
+  const char *start;
 
   assert (input->cursor);
-  while (input->cursor && isspace (*input->cursor))
-    if (++input->cursor == input->limit)
+  while (input->cursor)
+    if (locate_item (input, &start))
+      {
+	input->cursor = (char *) start;
+	break;
+      }
+    else
       {
+	input->cursor = input->limit;
 	if (input->cursor[-1] == '\n')
 	  {
 	    output_characters (string, input->cursor - string - 1,
@@ -2935,7 +7318,7 @@ copy_whitespace (struct input *input, enum margin_mode margin)
 	      fprintf (output_file, "%s", input->user_stop);
 #if HAVE_TPUTS
 	    if (input->term_stop)
-	      tputs (input->term_stop, 0, putc_for_tputs);
+	      fputs (input->term_stop, output_file);
 #endif
 
 	    output_characters (input->cursor - 1, 1, expand_tabs);
@@ -2943,7 +7326,7 @@ copy_whitespace (struct input *input, enum margin_mode margin)
 
 #if HAVE_TPUTS
 	    if (input->term_start)
-	      tputs (input->term_start, 0, putc_for_tputs);
+	      fputs (input->term_start, output_file);
 #endif
 	    if (avoid_wraps && input->user_start)
 	      fprintf (output_file, "%s", input->user_start);
@@ -2966,9 +7349,16 @@ copy_whitespace (struct input *input, enum margin_mode margin)
 static void
 skip_word_item (struct input *input)
 {
-  assert (input->cursor && !isspace (*input->cursor));
-  while (input->cursor && !isspace (*input->cursor))
-    input_character (input);
+  const char *start;
+  int length;
+
+  assert (input->cursor);
+  length = locate_item (input, &start);
+  assert (length > 0 && start == input->cursor);
+
+  input->cursor += length;
+  if (input->cursor == input->limit)
+    input_character_helper (input);
 
   /* FIXME: Maybe worth following columns for TAB expansion, maybe not?  */
 
@@ -2983,12 +7373,15 @@ static void
 copy_word_item (struct input *input)
 {
   char *string = input->cursor;
+  const char *start;
+  int length;
 
-  assert (input->cursor && !isspace (*input->cursor));
-  while (input->cursor && !isspace (*input->cursor))
-    input->cursor++;
+  assert (input->cursor);
+  length = locate_item (input, &start);
+  assert (length > 0 && start == input->cursor);
 
-  output_characters (string, input->cursor - string, expand_tabs);
+  input->cursor += length;
+  output_characters (string, length, expand_tabs);
 
   if (input->cursor == input->limit)
     input_character_helper (input);
@@ -3010,6 +7403,13 @@ skip_until (struct input *input, int item)
 	skip_whitespace (input);
 	skip_word_item (input);
       }
+  else if (input->item_offset && input->item < item)
+    {
+      /* Go straight to the last line to skip, it still has to be read.  */
+
+      seek_input_item (input, item - 1);
+      skip_line_item (input);
+    }
   else
     while (input->item < item)
       skip_line_item (input);
@@ -3059,12 +7459,13 @@ copy_member_proper (struct input *input, struct member *member)
 
 /* Listing control.  */
 
-/*------------------------------------------.
-| Relist all input files with annotations.  |
-`------------------------------------------*/
+/*-------------------------------------------------------------------.
+| Relist INPUT with annotations, on OUTPUT_FILE.  CURSOR points into |
+| INDIRECT_ARRAY at the first member within INPUT, if any.           |
+`-------------------------------------------------------------------*/
 
 static void
-relist_annotated_files (void)
+relist_annotated_input (struct input *input, int *cursor)
 {
   /* The array of actives holds all members being concurrently listed.  If
      there is no overlapping members, the array will never hold more than
@@ -3080,185 +7481,115 @@ relist_annotated_files (void)
   };
   struct active *active_array = NULL;
   int actives = 0;
-  int allocated_actives = 0;
+  size_t allocated_actives = 0;
 
   int other_count = 0;		/* how many actives in other files */
 
   enum margin_mode margin_mode =
     show_links ? LOCATION_IN_MARGIN : EMPTY_MARGIN;
 
-  struct input *input = NULL;
-  int *cursor;
   int counter;
-  FILE *file;
   ITEM *item;
   struct active *active;
-  struct member *member;
+  struct member *member = NULL;
   struct cluster *cluster;
   int ordinal;
   struct reference reference;
-  char buffer[20];
+  char buffer[32];
 
-#if DEBUGGING
-  if (debugging)
-    fputs ("\f\n", stderr);
-#endif
+  if (cursor == indirect_array + indirects)
+    cursor = NULL;
+  else if (cursor)
+    member = member_array + *cursor;
 
-  /* Prepare terminal.  */
+  /* Prepare for file.  */
 
-  if (!paginate)
-    {
-      launch_output_program (input);
-      initialize_strings ();
-    }
+  open_input (input);
+  input->item = input->first_item;
 
-  /* Prepare to scan all members.  */
+  /* Process all items.  */
 
-  if (indirects > 0)
+  if (word_mode)
     {
-      cursor = indirect_array;
-      member = member_array + *cursor;
+      if (input->stat_buffer.st_size > 0)
+	make_margin (input, margin_mode);
+      input_character_helper (input);
     }
-  else
-    cursor = NULL;
-
-  /* Process all files.  */
 
-  for (input = input_array; input < input_array + inputs; input++)
+  while (input->item < input->item_limit)
     {
-      /* Prepare terminal.  */
-
-      if (paginate)
-	{
-	  launch_output_program (input);
-	  if (input == input_array)
-	    initialize_strings ();
-	}
-      else
-	{
-	  if (input > input_array)
-	    fputs ("\f\n", output_file);
-	  fprintf (output_file, "@@@ %s\n", input->file_name);
-	}
-
-      /* Prepare for file.  */
-
-      open_input (input);
-      input->item = input->first_item;
+      if (word_mode)
+	copy_whitespace (input, margin_mode);
 
-      /* Process all items.  */
+      item = item_array + input->item;
 
-      if (word_mode && input->item < input->item_limit)
-	{
-	  make_margin (input, margin_mode);
-	  input_line (input);
-	}
+      /* See if we are starting any member.  */
 
-      while (input->item < input->item_limit)
+      while (cursor && member->first_item == input->item)
 	{
-	  if (word_mode)
-	    copy_whitespace (input, margin_mode);
-
-	  item = item_array + input->item;
+	  cluster = cluster_array + member->cluster_number;
+	  ordinal = member - member_array - cluster->first_member - 1;
 
-	  /* See if we are starting any member.  */
+	  /* Obtain some active slot for the new member.  */
 
-	  while (cursor && member->first_item == input->item)
+	  if (actives)
 	    {
-	      cluster = cluster_array + member->cluster_number;
-	      ordinal = member - member_array - cluster->first_member - 1;
+	      /* Set ACTIVE to the rightmost not-in-use active, or after
+		 all actives if they are all in use.  */
 
-	      /* Obtain some active slot for the new member.  */
+	      active = active_array + actives;
+	      for (counter = 0; counter < actives; counter++)
+		if (!active_array[counter].member)
+		  active = active_array + counter;
 
-	      if (actives)
-		{
-		  /* Set ACTIVE to the rightmost not-in-use active, or after
-		     all actives if they are all in use.  */
-
-		  active = active_array + actives;
-		  for (counter = 0; counter < actives; counter++)
-		    if (!active_array[counter].member)
-		      active = active_array + counter;
-
-		  /* Output vertical bars as needed for all prior actives.  */
-
-		  if (!word_mode)
-		    for (counter = 0;
-			 active_array + counter < active; counter++)
-		      if (active_array[counter].member)
-			putc ('|', output_file);
-		      else
-			putc (' ', output_file);
+	      /* Output vertical bars as needed for all prior actives.  */
 
-		  /* Ensure active will be allocated if necessary.  */
+	      if (!word_mode)
+		for (counter = 0;
+		     active_array + counter < active; counter++)
+		  if (active_array[counter].member)
+		    putc ('|', output_file);
+		  else
+		    putc (' ', output_file);
 
-		  if (active == active_array + actives)
-		    active = NULL;
-		}
-	      else
+	      /* Ensure active will be allocated if necessary.  */
+
+	      if (active == active_array + actives)
 		active = NULL;
+	    }
+	  else
+	    active = NULL;
 
-	      /* Allocate and initialise the active.  */
+	  /* Allocate and initialise the active.  */
 
-	      if (!active)
-		{
-		  if (actives == allocated_actives)
-		    {
-		      allocated_actives += 8;
-		      active_array = (struct active *)
-			xrealloc (active_array,
-				  allocated_actives *
-				  (sizeof (struct active)));
-		    }
-		  active = active_array + actives++;
-		}
-	      active->member = member;
-	      active->remaining
-		= cluster_array[member->cluster_number].item_count;
+	  if (!active)
+	    {
+	      if (actives == allocated_actives)
+		active_array = (struct active *)
+		  x2nrealloc (active_array, &allocated_actives,
+			      sizeof (struct active));
+	      active = active_array + actives++;
+	    }
+	  active->member = member;
+	  active->remaining
+	    = cluster_array[member->cluster_number].item_count;
 
-	      /* Print a pointer to the previous member of same cluster.  */
+	  /* Print a pointer to the previous member of same cluster.  */
 
-	      if (ordinal >= 0)
-		{
-		  reference = get_reference
-		    (member_array
-		     [cluster->first_member + ordinal].first_item);
+	  if (ordinal >= 0)
+	    {
+	      reference = get_reference
+		(member_array
+		 [cluster->first_member + ordinal].first_item);
 
-		  if (word_mode)
-		    {
-		      if (show_links)
-			{
-			  sprintf (buffer, "[%c%s%d",
-				   (char) (active - active_array + 'A'),
-				   reference.input->nick_name,
-				   reference.number);
-			  push_emphasis (UNDERLINED);
-			  output_characters (buffer, strlen (buffer), 0);
-			  pop_emphasis ();
-			  putc (' ', output_file);
-			}
-		    }
-		  else
-		    {
-		      fprintf (output_file, ".-> [%d/%d] ",
-			       ordinal + 1, MEMBERS (cluster));
-		      sprintf (buffer, "%s%d",
-			       reference.input->nick_name, reference.number);
-		      push_emphasis (UNDERLINED);
-		      output_characters (buffer, strlen (buffer), 0);
-		      pop_emphasis ();
-		      if (reference.input != input)
-			fprintf (output_file, " (%s)",
-				 reference.input->file_name);
-		      putc ('\n', output_file);
-		    }
-		}
-	      else if (word_mode)
+	      if (word_mode)
 		{
 		  if (show_links)
 		    {
-		      sprintf (buffer, "[%c",
-			       (char) (active - active_array + 'A'));
+		      sprintf (buffer, "[%c%s%d",
+			       (char) (active - active_array + 'A'),
+			       reference.input->nick_name,
+			       reference.number);
 		      push_emphasis (UNDERLINED);
 		      output_characters (buffer, strlen (buffer), 0);
 		      pop_emphasis ();
@@ -3266,164 +7597,340 @@ relist_annotated_files (void)
 		    }
 		}
 	      else
-		fputs (".-\n", output_file);
+		{
+		  fprintf (output_file, ".-> [%d/%d] ",
+			   ordinal + 1, MEMBERS (cluster));
+		  sprintf (buffer, "%s%d",
+			   reference.input->nick_name, reference.number);
+		  push_emphasis (UNDERLINED);
+		  output_characters (buffer, strlen (buffer), 0);
+		  pop_emphasis ();
+		  if (reference.input != input)
+		    fprintf (output_file, " (%s)",
+			     reference.input->file_name);
+		  putc ('\n', output_file);
+		}
+	    }
+	  else if (word_mode)
+	    {
+	      if (show_links)
+		{
+		  sprintf (buffer, "[%c",
+			   (char) (active - active_array + 'A'));
+		  push_emphasis (UNDERLINED);
+		  output_characters (buffer, strlen (buffer), 0);
+		  pop_emphasis ();
+		  putc (' ', output_file);
+		}
+	    }
+	  else
+	    fputs (".-\n", output_file);
 
-	      /* Bold text appearing in other files.  */
+	  /* Bold text appearing in other files.  */
 
-	      if (active_elsewhere (member, input))
-		if (other_count++ == 0)
-		  set_emphasis (BOLD);
+	  if (active_elsewhere (member, input))
+	    if (other_count++ == 0)
+	      set_emphasis (BOLD);
 
-	      /* Advance cursor.  */
+	  /* Advance cursor.  */
 
-	      if (++cursor < indirect_array + indirects)
-		member = member_array + *cursor;
-	      else
-		cursor = NULL;
-	    }
+	  if (++cursor < indirect_array + indirects)
+	    member = member_array + *cursor;
+	  else
+	    cursor = NULL;
+	}
 
-	  /* List the item itself.  */
+      /* List the item itself.  */
 
-	  if (word_mode)
-	    copy_word_item (input);
-	  else
+      if (word_mode)
+	copy_word_item (input);
+      else
+	{
+	  for (counter = 0; counter < actives; counter++)
+	    if (active_array[counter].member)
+	      putc ('|', output_file);
+	    else
+	      putc (' ', output_file);
+
+	  if (counter < 7)
 	    {
-	      for (counter = 0; counter < actives; counter++)
-		if (active_array[counter].member)
-		  putc ('|', output_file);
-		else
-		  putc (' ', output_file);
+	      sprintf (buffer, "%s%d", input->nick_name,
+		       input->item - input->first_item + 1);
+	      for (counter += strlen (buffer); counter < 7; counter++)
+		putc (' ', output_file);
+	      push_emphasis (UNDERLINED);
+	      output_characters (buffer + counter - 7,
+				 strlen (buffer + counter - 7), 0);
+	      pop_emphasis ();
+	    }
 
-	      if (counter < 7)
-		{
-		  sprintf (buffer, "%s%d", input->nick_name,
-			   input->item - input->first_item + 1);
-		  for (counter += strlen (buffer); counter < 7; counter++)
-		    putc (' ', output_file);
-		  push_emphasis (UNDERLINED);
-		  output_characters (buffer + counter - 7,
-				     strlen (buffer + counter - 7), 0);
-		  pop_emphasis ();
-		}
+	  if (initial_tab)
+	    putc ('\t', output_file);
+	  else
+	    putc (' ', output_file);
 
-	      if (initial_tab)
-		putc ('\t', output_file);
-	      else
-		putc (' ', output_file);
+	  copy_line_item (input, EMPTY_MARGIN);
+	}
 
-	      copy_line_item (input, EMPTY_MARGIN);
-	    }
+      /* See if we are ending any member.  */
 
-	  /* See if we are ending any member.  */
+      if (!actives)
+	continue;
 
-	  if (!actives)
-	    continue;
+      active = active_array + actives;
+      while (--active >= active_array)
+	if (item_type (item) == NORMAL && --active->remaining == 0)
+	  {
+	    cluster = cluster_array + active->member->cluster_number;
+	    ordinal
+	      = active->member - member_array - cluster->first_member + 1;
+
+	    /* Print a pointer to the next member of same cluster.  */
 
-	  active = active_array + actives;
-	  while (--active >= active_array)
-	    if (item_type (item) == NORMAL && --active->remaining == 0)
+	    if (!word_mode)
 	      {
-		cluster = cluster_array + active->member->cluster_number;
-		ordinal
-		  = active->member - member_array - cluster->first_member + 1;
+		for (counter = 0;
+		     active_array + counter < active; counter++)
+		  if (active_array[counter].member)
+		    putc ('|', output_file);
+		  else
+		    putc (' ', output_file);
+	      }
 
-		/* Print a pointer to the next member of same cluster.  */
+	    if (ordinal < MEMBERS (cluster))
+	      {
+		reference = get_reference
+		  (member_array
+		   [cluster->first_member + ordinal].first_item);
 
-		if (!word_mode)
+		if (word_mode)
 		  {
-		    for (counter = 0;
-			 active_array + counter < active; counter++)
-		      if (active_array[counter].member)
-			putc ('|', output_file);
-		      else
+		    if (show_links)
+		      {
 			putc (' ', output_file);
+			sprintf (buffer, "%s%d%c]",
+				 reference.input->nick_name,
+				 reference.number,
+				 (char) (active - active_array + 'A'));
+			push_emphasis (UNDERLINED);
+			output_characters (buffer, strlen (buffer), 0);
+			pop_emphasis ();
+		      }
 		  }
-
-		if (ordinal < MEMBERS (cluster))
+		else
+		  {
+		    fprintf (output_file, "`-> [%d/%d] ",
+			     ordinal + 1, MEMBERS (cluster));
+		    sprintf (buffer, "%s%d",
+			     reference.input->nick_name,
+			     reference.number);
+		    push_emphasis (UNDERLINED);
+		    output_characters (buffer, strlen (buffer), 0);
+		    pop_emphasis ();
+		    if (reference.input != input)
+		      fprintf (output_file, " (%s)",
+			       reference.input->file_name);
+		    putc ('\n', output_file);
+		  }
+	      }
+	    else if (word_mode)
+	      {
+		if (show_links)
 		  {
-		    reference = get_reference
-		      (member_array
-		       [cluster->first_member + ordinal].first_item);
+		    putc (' ', output_file);
+		    sprintf (buffer, "%c]",
+			     (char) (active - active_array + 'A'));
+		    push_emphasis (UNDERLINED);
+		    output_characters (buffer, strlen (buffer), 0);
+		    pop_emphasis ();
+		  }
+	      }
+	    else
+	      fputs ("`-\n", output_file);
+
+	    /* Do not bold text not appearing in any other file.  */
+
+	    if (active_elsewhere (active->member, input))
+	      if (--other_count == 0)
+		set_emphasis (STRAIGHT);
+
+	    /* Remove as many active members as we can.  */
+
+	    active->member = NULL;
+	    if (active == active_array + actives - 1)
+	      while (actives > 0 && !active_array[actives - 1].member)
+		actives--;
+	  }
+    }
+
+  /* Copy what follows the last item.  Without -O, this is only white
+     space, but any text not being an item may remain.  */
+
+  if (word_mode && input->cursor)
+    copy_whitespace (input, EMPTY_MARGIN);
+
+  /* Finish file.  */
+
+  assert (actives == 0);
+  assert (other_count == 0);
+
+  close_input (input);
+  free (active_array);
+}
+
+/* Annotated listings of separate inputs only depend on read-only cluster
+   data, so many of them may get rendered at once, each into a memory
+   buffer of its own, before being written in input order.  Inputs are
+   processed in batches, so to bound the memory held by buffers.  */
+
+/* Batch size, as a multiple of the number of workers.  */
+#define LISTINGS_PER_WORKER 4
+
+struct listing
+{
+  char *buffer;			/* rendered annotated listing */
+  size_t size;			/* size of buffer contents */
+};
+
+static struct listing *listing_array = NULL; /* listings of current batch */
+static struct input *listing_base;	/* first input of current batch */
+static int *listing_cursor_array;	/* first indirect for each input */
+
+#if PARALLEL_LISTINGS
+
+/*-------------------------------------------------------------------.
+| Render the annotated listing for job number JOB, within the batch, |
+| into its own memory buffer.					     |
+`-------------------------------------------------------------------*/
+
+static void
+listing_job (int job)
+{
+  struct listing *listing = listing_array + job;
+  struct input *input = listing_base + job;
+  FILE *saved_file = output_file;
+
+  /* The calling thread works as well, so its output file is kept.  */
+
+  output_file = open_memstream (&listing->buffer, &listing->size);
+  if (!output_file)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+  relist_annotated_input (input,
+			  indirect_array
+			  + listing_cursor_array[input - input_array]);
+  if (fclose (output_file) != 0)
+    error (EXIT_ERROR, errno, "%s", input->file_name);
+  output_file = saved_file;
+}
+
+#endif /* PARALLEL_LISTINGS */
+
+/*------------------------------------------.
+| Relist all input files with annotations.  |
+`------------------------------------------*/
+
+static void
+relist_annotated_files (void)
+{
+  struct input *input;
+  struct input *limit;
+  int batch;
+  int counter;
+
+#if DEBUGGING
+  if (debugging)
+    fputs ("\f\n", stderr);
+#endif
+
+  /* Prepare terminal.  */
+
+  if (!paginate)
+    launch_output_program (NULL);
+  initialize_strings ();
+
+  /* Find where members of each input start, in textual order.  */
+
+  listing_cursor_array = (int *) xmalloc (inputs * sizeof (int));
+  counter = 0;
+  for (input = input_array; input < input_array + inputs; input++)
+    {
+      while (counter < indirects
+	     && (member_array[indirect_array[counter]].first_item
+		 < input->first_item))
+	counter++;
+      listing_cursor_array[input - input_array] = counter;
+    }
+
+  /* Render listings in parallel when possible, else directly.  */
+
+  batch = 1;
+#if PARALLEL_LISTINGS
+  if (workers > 1 && inputs > 1)
+    {
+      batch = workers * LISTINGS_PER_WORKER;
+      listing_array = (struct listing *)
+	xmalloc (batch * sizeof (struct listing));
+    }
+#endif
 
-		    if (word_mode)
-		      {
-			if (show_links)
-			  {
-			    putc (' ', output_file);
-			    sprintf (buffer, "%s%d%c]",
-				     reference.input->nick_name,
-				     reference.number,
-				     (char) (active - active_array + 'A'));
-			    push_emphasis (UNDERLINED);
-			    output_characters (buffer, strlen (buffer), 0);
-			    pop_emphasis ();
-			  }
-		      }
-		    else
-		      {
-			fprintf (output_file, "`-> [%d/%d] ",
-				 ordinal + 1, MEMBERS (cluster));
-			sprintf (buffer, "%s%d",
-				 reference.input->nick_name,
-				 reference.number);
-			push_emphasis (UNDERLINED);
-			output_characters (buffer, strlen (buffer), 0);
-			pop_emphasis ();
-			if (reference.input != input)
-			  fprintf (output_file, " (%s)",
-				   reference.input->file_name);
-			putc ('\n', output_file);
-		      }
-		  }
-		else if (word_mode)
-		  {
-		    if (show_links)
-		      {
-			putc (' ', output_file);
-			sprintf (buffer, "%c]",
-				 (char) (active - active_array + 'A'));
-			push_emphasis (UNDERLINED);
-			output_characters (buffer, strlen (buffer), 0);
-			pop_emphasis ();
-		      }
-		  }
-		else
-		  fputs ("`-\n", output_file);
+  /* Process all files.  */
 
-		/* Do not bold text not appearing in any other file.  */
+  for (listing_base = input_array; listing_base < input_array + inputs;
+       listing_base = limit)
+    {
+      limit = listing_base + batch;
+      if (limit > input_array + inputs)
+	limit = input_array + inputs;
 
-		if (active_elsewhere (active->member, input))
-		  if (--other_count == 0)
-		    set_emphasis (STRAIGHT);
+#if PARALLEL_LISTINGS
+      if (listing_array)
+	run_in_parallel (listing_job, limit - listing_base);
+#endif
 
-		/* Remove as many active members as we can.  */
+      for (input = listing_base; input < limit; input++)
+	{
+	  /* Prepare terminal.  */
 
-		active->member = NULL;
-		if (active == active_array + actives - 1)
-		  while (actives > 0 && !active_array[actives - 1].member)
-		    actives--;
-	      }
-	}
+	  if (paginate)
+	    launch_output_program (input);
+	  else
+	    {
+	      if (input > input_array)
+		fputs ("\f\n", output_file);
+	      fprintf (output_file, "@@@ %s\n", input->file_name);
+	    }
 
-      /* Finish file.  */
+	  /* List the file, or copy its listing.  */
 
-      assert (actives == 0);
-      assert (other_count == 0);
+	  if (listing_array)
+	    {
+	      struct listing *listing = listing_array + (input - listing_base);
 
-      close_input (input);
+	      fwrite (listing->buffer, listing->size, 1, output_file);
+	      free (listing->buffer);
+	    }
+	  else
+	    relist_annotated_input (input,
+				    indirect_array
+				    + listing_cursor_array[input - input_array]);
 
-      if (paginate)
-	complete_output_program ();
+	  if (paginate)
+	    complete_output_program ();
+	}
     }
 
   if (!paginate)
     complete_output_program ();
+
+  free (listing_cursor_array);
+  free (listing_array);
+  listing_array = NULL;
 }
 
 /*--------------------------------------------------------------------.
 | Make a merged listing of input files.  If UNIFIED, produce unified  |
 | context diffs instead of plain context diffs.  If CROSSED, identify |
-| crossed blocks.						      |
+| crossed blocks.  Not reached for now, see the stream pool.	      |
 `--------------------------------------------------------------------*/
 
 static void
@@ -3444,11 +7951,10 @@ relist_merged_lines (int unified, int crossed)
   launch_output_program (NULL);
   initialize_strings ();
 
-  /* FIXME: Merging requires all input files to be opened in parallel.  This
-     is not realistic when there are really many input files: in such cases,
-     one has no other choice than to avoid merged listings and resort to the
-     full relisting option instead.  */
+  /* Merging reads all input files in parallel.  As there might be more
+     input files than available file descriptors, streams get pooled.  */
 
+  start_stream_pool ();
   for (input = input_array; input < input_array + inputs; input++)
     {
       open_input (input);
@@ -3478,6 +7984,14 @@ relist_merged_lines (int unified, int crossed)
 
       group_limit = cursor;
 
+      /* Get streams ready for the inputs of this group, while the pool has
+	 room for all of them.  */
+
+      for (cursor = merging;
+	   cursor < group_limit && cursor < merging + maximum_streams;
+	   cursor++)
+	prefetch_input (input_array + cursor->input_number);
+
       /* Prepare for a new hunk.  Hmph!  Not really yet...  */
 
       /* Output differences, which are items before members.  Also consider
@@ -3522,9 +8036,557 @@ relist_merged_lines (int unified, int crossed)
 
   for (input = input_array; input < input_array + inputs; input++)
     {
-      copy_until (input, input->item_limit, FILE_IN_MARGIN);
-      close_input (input);
+      copy_until (input, input->item_limit, FILE_IN_MARGIN);
+      close_input (input);
+    }
+  stop_stream_pool ();
+}
+
+/* Context and unified diffs, for two inputs.  Each merging group having
+   members of the same size in both inputs yields a block of common lines,
+   and everything between common blocks is a change.  Changes get gathered
+   into hunks as mergings are read, and a hunk is output as soon as the
+   common lines after its last change exceed twice the number of horizon
+   lines, so only the extent of one hunk is ever kept.  */
+
+struct change
+{
+  int left_first;		/* first left item deleted or changed */
+  int left_limit;		/* one past last left item in change */
+  int right_first;		/* first right item inserted or changed */
+  int right_limit;		/* one past last right item in change */
+};
+
+static struct change *change_array = NULL; /* changes in current hunk */
+static int changes = 0;			   /* number of changes in hunk */
+static size_t allocated_changes = 0;	   /* allocated entries */
+static int previous_left_limit;	/* end of change before current hunk */
+
+/* Lines only get taken as common once their text got compared, as equal
+   checksums do not prove lines equal.  Blocks are read again through
+   these, for the left and right inputs.  */
+
+static int diff_handle[2];	/* descriptors, or -1 if in memory */
+static char *diff_buffer[2];	/* text of block just read */
+static size_t diff_allocated[2]; /* allocated bytes in diff_buffer */
+
+/*-------------------------------------------------------------------.
+| Output a header line about INPUT, starting with MARK, for the file |
+| name and modification time.					     |
+`-------------------------------------------------------------------*/
+
+static void
+output_diff_header (const char *mark, struct input *input)
+{
+  char buffer[64];
+  struct tm *tm = localtime (&input->stat_buffer.st_mtime);
+
+  if (!tm || !strftime (buffer, sizeof buffer, "%Y-%m-%d %H:%M:%S %z", tm))
+    strcpy (buffer, "?");
+  fprintf (output_file, "%s %s\t%s\n", mark, input->file_name, buffer);
+}
+
+/*-----------------------------------------------------------------------.
+| Output a range of items from INPUT, in diff style, as FIRST and LIMIT. |
+| Unified diffs use a start and a count, context diffs use line numbers  |
+| for both ends.							 |
+`-----------------------------------------------------------------------*/
+
+static void
+output_diff_range (struct input *input, int first, int limit, int unified)
+{
+  int start = first - input->first_item + 1;
+  int count = limit - first;
+
+  if (unified)
+    {
+      if (count == 0)
+	fprintf (output_file, "%d,0", start - 1);
+      else if (count == 1)
+	fprintf (output_file, "%d", start);
+      else
+	fprintf (output_file, "%d,%d", start, count);
+    }
+  else
+    {
+      if (count == 0)
+	fprintf (output_file, "%d", start - 1);
+      else if (count == 1)
+	fprintf (output_file, "%d", start);
+      else
+	fprintf (output_file, "%d,%d", start, start + count - 1);
+    }
+}
+
+/*-----------------------------------------------------------------.
+| Copy lines from INPUT until ITEM, each preceded by a diff MARK.  |
+`-----------------------------------------------------------------*/
+
+static void
+copy_diff_lines (struct input *input, int item, const char *mark)
+{
+  assert (input->item <= item);
+  while (input->item < item)
+    {
+      input_line (input);
+      assert (input->cursor);
+
+      output_characters (mark, strlen (mark), expand_tabs);
+      output_characters (input->line, input->limit - input->line,
+			 expand_tabs);
+      if (input->limit == input->line || input->limit[-1] != '\n')
+	fputs (_("\n\\ No newline at end of file\n"), output_file);
+
+      input->item++;
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Return the file offset of ITEM in INPUT, or the file size if ITEM  |
+| is the item limit.						     |
+`-------------------------------------------------------------------*/
+
+static inline off_t
+diff_item_offset (struct input *input, int item)
+{
+  return (item < input->item_limit
+	  ? input->item_offset[item - input->first_item]
+	  : input->stat_buffer.st_size);
+}
+
+/*---------------------------------------------------------------------.
+| Return the text of lines FIRST to LIMIT from input number NUMBER,    |
+| read again unless the input is in memory.			       |
+`---------------------------------------------------------------------*/
+
+static const char *
+read_diff_block (int number, int first, int limit)
+{
+  struct input *input = input_array + number;
+  off_t offset = diff_item_offset (input, first);
+  size_t length = diff_item_offset (input, limit) - offset;
+  const char *block;
+
+  if (diff_handle[number] >= 0)
+    {
+      if (length > diff_allocated[number])
+	{
+	  free (diff_buffer[number]);
+	  diff_allocated[number] = length;
+	  diff_buffer[number] = xmalloc (length);
+	}
+      if (lseek (diff_handle[number], offset, SEEK_SET) < 0)
+	error (EXIT_ERROR, errno, "%s", input->file_name);
+    }
+
+  block = read_input_contents (input, diff_handle[number],
+			       diff_buffer[number], offset, length);
+  if (!block)
+    error (EXIT_ERROR, 0, _("%s: file shrank while being compared"),
+	   input->file_name);
+  return block;
+}
+
+/*--------------------------------------------------------------------.
+| Return the next character from *CURSOR, before LIMIT, as studying   |
+| sees it under options ignoring case or white space, or -1 at end.   |
+`--------------------------------------------------------------------*/
+
+static inline int
+next_diff_character (const char **cursor, const char *limit)
+{
+  unsigned char character;
+
+  while (*cursor < limit)
+    {
+      character = *(*cursor)++;
+      if (!isspace (character))
+	return (ignore_case && islower (character)
+		? toupper (character) : character);
+      if (ignore_all_space)
+	continue;
+      if (ignore_space_change)
+	{
+	  while (*cursor < limit && isspace ((unsigned char) **cursor))
+	    (*cursor)++;
+	  return ' ';
+	}
+      return character;
+    }
+  return -1;
+}
+
+/*------------------------------------------------------------------.
+| Return non-zero if lines from LINE1 to LIMIT1 and from LINE2 to   |
+| LIMIT2 are equal, as far as options make them compare.	    |
+`------------------------------------------------------------------*/
+
+static int
+same_diff_lines (const char *line1, const char *limit1,
+		 const char *line2, const char *limit2)
+{
+  int character;
+
+  if (!ignore_all_space && !ignore_space_change && !ignore_case)
+    return (limit1 - line1 == limit2 - line2
+	    && memcmp (line1, line2, limit1 - line1) == 0);
+
+  do
+    {
+      character = next_diff_character (&line1, limit1);
+      if (character != next_diff_character (&line2, limit2))
+	return 0;
+    }
+  while (character >= 0);
+  return 1;
+}
+
+/*--------------------------------------------------------------------.
+| Output the text of the last line of INPUT matching -F before ITEM,  |
+| if any, after a space.					      |
+`--------------------------------------------------------------------*/
+
+static void
+output_function_line (struct input *input, int item)
+{
+  int low = 0;
+  int high = input->functions;
+  int middle;
+
+  item -= input->first_item;
+  while (low < high)
+    {
+      middle = low + (high - low) / 2;
+      if (input->function_array[middle].item < item)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+
+  if (low > 0)
+    {
+      putc (' ', output_file);
+      fputs (input->function_array[low - 1].text, output_file);
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Output the current hunk, with TRAILING common lines after its last |
+| change, then forget it.  Both inputs are left after the hunk.	     |
+`-------------------------------------------------------------------*/
+
+static void
+output_hunk (int unified, int trailing)
+{
+  struct change *first = change_array;
+  struct change *last = change_array + changes - 1;
+  struct change *change;
+  int leading = first->left_first - previous_left_limit;
+  int left_first;		/* first left item in hunk */
+  int left_limit;		/* one past last left item in hunk */
+  int right_first;		/* first right item in hunk */
+  int right_limit;		/* one past last right item in hunk */
+  int deleted = 0;		/* if some lines only in left */
+  int inserted = 0;		/* if some lines only in right */
+
+  if (leading > horizon_lines)
+    leading = horizon_lines;
+
+  left_first = first->left_first - leading;
+  right_first = first->right_first - leading;
+  left_limit = last->left_limit + trailing;
+  right_limit = last->right_limit + trailing;
+
+  for (change = first; change <= last; change++)
+    {
+      deleted |= change->left_first < change->left_limit;
+      inserted |= change->right_first < change->right_limit;
+    }
+
+  skip_until (left, left_first);
+  skip_until (right, right_first);
+
+  if (unified)
+    {
+      fputs ("@@ -", output_file);
+      output_diff_range (left, left_first, left_limit, 1);
+      fputs (" +", output_file);
+      output_diff_range (right, right_first, right_limit, 1);
+      fputs (" @@", output_file);
+      if (function_regexp)
+	output_function_line (left, left_first);
+      putc ('\n', output_file);
+
+      /* Common lines are taken from the left input.  */
+
+      for (change = first; change <= last; change++)
+	{
+	  copy_diff_lines (left, change->left_first,
+			   initial_tab ? " \t" : " ");
+	  skip_until (right, change->right_first);
+	  copy_diff_lines (left, change->left_limit,
+			   initial_tab ? "-\t" : "-");
+	  copy_diff_lines (right, change->right_limit,
+			   initial_tab ? "+\t" : "+");
+	}
+      copy_diff_lines (left, left_limit, initial_tab ? " \t" : " ");
+      skip_until (right, right_limit);
+    }
+  else
+    {
+      fputs ("***************", output_file);
+      if (function_regexp)
+	output_function_line (left, left_first);
+      fputs ("\n*** ", output_file);
+      output_diff_range (left, left_first, left_limit, 0);
+      fputs (" ****\n", output_file);
+
+      /* Lines of a side having no change at all are not shown.  */
+
+      if (deleted)
+	{
+	  for (change = first; change <= last; change++)
+	    {
+	      copy_diff_lines (left, change->left_first,
+			       initial_tab ? " \t" : "  ");
+	      copy_diff_lines (left, change->left_limit,
+			       change->right_first < change->right_limit
+			       ? (initial_tab ? "!\t" : "! ")
+			       : (initial_tab ? "-\t" : "- "));
+	    }
+	  copy_diff_lines (left, left_limit, initial_tab ? " \t" : "  ");
+	}
+      else
+	skip_until (left, left_limit);
+
+      fputs ("--- ", output_file);
+      output_diff_range (right, right_first, right_limit, 0);
+      fputs (" ----\n", output_file);
+
+      if (inserted)
+	{
+	  for (change = first; change <= last; change++)
+	    {
+	      copy_diff_lines (right, change->right_first,
+			       initial_tab ? " \t" : "  ");
+	      copy_diff_lines (right, change->right_limit,
+			       change->left_first < change->left_limit
+			       ? (initial_tab ? "!\t" : "! ")
+			       : (initial_tab ? "+\t" : "+ "));
+	    }
+	  copy_diff_lines (right, right_limit, initial_tab ? " \t" : "  ");
+	}
+      else
+	skip_until (right, right_limit);
+    }
+
+  previous_left_limit = last->left_limit;
+  changes = 0;
+}
+
+/*-------------------------------------------------------------------.
+| Account for the change from LEFT_FIRST and RIGHT_FIRST until the   |
+| common lines at LEFT_LIMIT and RIGHT_LIMIT, outputting the current |
+| hunk first if the common lines in between are too many.	     |
+`-------------------------------------------------------------------*/
+
+static void
+add_change (int left_first, int left_limit, int right_first, int right_limit,
+	    int unified)
+{
+  struct change *change;
+
+  if (left_first == left_limit && right_first == right_limit)
+    return;
+
+  if (changes > 0
+      && left_first - change_array[changes - 1].left_limit > 2 * horizon_lines)
+    output_hunk (unified, horizon_lines);
+
+  if (changes == allocated_changes)
+    change_array = (struct change *)
+      x2nrealloc (change_array, &allocated_changes, sizeof (struct change));
+
+  change = change_array + changes++;
+  change->left_first = left_first;
+  change->left_limit = left_limit;
+  change->right_first = right_first;
+  change->right_limit = right_limit;
+}
+
+/*----------------------------------------------------------------------.
+| Take COUNT lines from LEFT_FIRST and RIGHT_FIRST as common, except    |
+| those which really differ, which rather get into changes.  *LEFT_ITEM |
+| and *RIGHT_ITEM tell the first lines not yet common, and get updated. |
+`----------------------------------------------------------------------*/
+
+static void
+add_common_block (int left_first, int right_first, int count,
+		  int *left_item, int *right_item, int unified)
+{
+  const char *left_block = NULL;
+  const char *right_block = NULL;
+  off_t left_base = 0;
+  off_t right_base = 0;
+  int start = 0;		/* first line of current common run */
+  int counter;
+
+  /* Without item positions, checksums have to be trusted.  */
+
+  if (left->item_offset && right->item_offset)
+    {
+      left_block = read_diff_block (0, left_first, left_first + count);
+      left_base = diff_item_offset (left, left_first);
+      right_block = read_diff_block (1, right_first, right_first + count);
+      right_base = diff_item_offset (right, right_first);
+    }
+
+  for (counter = 0; left_block && counter < count; counter++)
+    {
+      int left_line = left_first + counter;
+      int right_line = right_first + counter;
+
+      /* Ignored lines are taken as equal to one another.  */
+
+      if (item_type (item_array + left_line) == WHITE
+	  && item_type (item_array + right_line) == WHITE)
+	continue;
+
+      if (same_diff_lines
+	  (left_block + (diff_item_offset (left, left_line) - left_base),
+	   left_block + (diff_item_offset (left, left_line + 1) - left_base),
+	   right_block + (diff_item_offset (right, right_line) - right_base),
+	   right_block + (diff_item_offset (right, right_line + 1)
+			  - right_base)))
+	continue;
+
+      /* Lines differing despite their checksums end the common run.  */
+
+      if (counter > start)
+	{
+	  add_change (*left_item, left_first + start,
+		      *right_item, right_first + start, unified);
+	  *left_item = left_line;
+	  *right_item = right_line;
+	}
+      start = counter + 1;
+    }
+
+  if (start < count)
+    {
+      add_change (*left_item, left_first + start,
+		  *right_item, right_first + start, unified);
+      *left_item = left_first + count;
+      *right_item = right_first + count;
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Produce a context diff, or a unified diff if UNIFIED, between both |
+| inputs, out of merging groups.				     |
+`-------------------------------------------------------------------*/
+
+static void
+relist_diff_hunks (int unified)
+{
+  struct merging *merging;
+  struct merging *group_limit;
+  struct merging *cursor;
+  struct member *left_member;	/* common member in left input, or NULL */
+  struct member *right_member;	/* common member in right input, or NULL */
+  int left_item = left->first_item; /* first left item not yet common */
+  int right_item = right->first_item; /* first right item not yet common */
+  int header_done = 0;		/* if file headers were output */
+  int counter;
+
+  launch_output_program (NULL);
+
+  open_input (left);
+  left->item = left->first_item;
+  open_input (right);
+  right->item = right->first_item;
+  previous_left_limit = left->first_item;
+  diff_handle[0] = open_input_contents (left);
+  diff_handle[1] = open_input_contents (right);
+
+  for (merging = merging_array;
+       merging <= merging_array + mergings; merging = group_limit)
+    {
+      /* At end, pretend to meet an empty common block at end of files.  */
+
+      if (merging == merging_array + mergings)
+	{
+	  add_change (left_item, left->item_limit,
+		      right_item, right->item_limit, unified);
+	  group_limit = merging + 1;
+	}
+      else
+	{
+	  left_member = NULL;
+	  right_member = NULL;
+	  for (cursor = merging;
+	       cursor < merging_array + mergings
+	       && (cursor == merging || !cursor->group_flag); cursor++)
+	    if (!cursor->cross_flag)
+	      {
+		if (cursor->input_number == 0 && !left_member)
+		  left_member = member_array + cursor->member_number;
+		else if (cursor->input_number == 1 && !right_member)
+		  right_member = member_array + cursor->member_number;
+	      }
+	  group_limit = cursor;
+
+	  /* Members found in one input only, or having different sizes
+	     because of ignored items, merely get into the next change.  */
+
+	  if (!left_member || !right_member
+	      || (real_member_size (left_member)
+		  != real_member_size (right_member))
+	      || left_member->first_item < left_item
+	      || right_member->first_item < right_item)
+	    continue;
+
+	  add_common_block (left_member->first_item,
+			    right_member->first_item,
+			    real_member_size (left_member),
+			    &left_item, &right_item, unified);
+	}
+
+      if (changes > 0 && !header_done)
+	{
+	  output_diff_header (unified ? "---" : "***", left);
+	  output_diff_header (unified ? "+++" : "---", right);
+	  header_done = 1;
+	}
+    }
+
+  if (changes > 0)
+    {
+      int trailing = left->item_limit - change_array[changes - 1].left_limit;
+
+      if (trailing > horizon_lines)
+	trailing = horizon_lines;
+      output_hunk (unified, trailing);
+    }
+
+  if (header_done)
+    exit_status = EXIT_DIFFERENCE;
+
+  close_input (left);
+  close_input (right);
+  free (change_array);
+  change_array = NULL;
+  allocated_changes = 0;
+  for (counter = 0; counter < 2; counter++)
+    {
+      if (diff_handle[counter] >= 0)
+	close (diff_handle[counter]);
+      free (diff_buffer[counter]);
+      diff_buffer[counter] = NULL;
+      diff_allocated[counter] = 0;
     }
+
+  complete_output_program ();
 }
 
 /*-----------------------------------------------------.
@@ -3540,6 +8602,7 @@ relist_merged_words (void)
 {
   int counter;
   struct input *input;
+  struct input *other;
   struct member *member;
   struct cluster *chosen_cluster;
   struct reference reference;
@@ -3566,7 +8629,7 @@ relist_merged_words (void)
     {
       open_input (input);
       input->item = input->first_item;
-      input_line (input);
+      input_character_helper (input);
     }
 
   count_total_left = left->item_limit - left->first_item;
@@ -3690,7 +8753,17 @@ relist_merged_words (void)
 
 	      end_of_emphasis (input);
 	    }
-	  copy_whitespace (input, EMPTY_MARGIN);
+
+	  /* Trailing white space is only copied once.  */
+
+	  if (input->cursor)
+	    {
+	      for (other = input + 1; other < input_array + inputs; other++)
+		if (other->listing_allowed)
+		  break;
+	      if (other == input_array + inputs)
+		copy_whitespace (input, EMPTY_MARGIN);
+	    }
 	}
       close_input (input);
     }
@@ -3751,6 +8824,517 @@ relist_merged_words (void)
   complete_output_program ();
 }
 
+/* Reports.  */
+
+/* With --report, clusters, members and mergings are written out for other
+   programs, instead of any listing.  The binary report is a memory image
+   meant to be mapped as is, and only good for the kind of machine which
+   wrote it.  A header is followed by arrays of inputs, clusters, members
+   and mergings, then by all file names, each with its NUL.  Every array
+   starts on an 8 bytes boundary.  Items are lines, or words in word mode,
+   numbered from 1 within each input.  Byte ranges are -1 when unknown,
+   which happens for inputs which could not be read twice.  Members which
+   got dropped for overlapping other members are kept, so member indices
+   stay valid, but their cluster index is -1.  */
+
+#define REPORT_MAGIC "mdiff report 1\n"
+
+/* Data layout checked by readers, including byte order.  */
+#define REPORT_LAYOUT \
+  ((unsigned) (sizeof (struct report_member) << 24 \
+	       | sizeof (struct report_merging) << 16 | 0x0102))
+
+/* Flags of a reported merging.  */
+#define REPORT_GROUP 1		/* beginning of a new merge group */
+#define REPORT_CROSS 2		/* member isolated by cross matches */
+
+struct report_header
+{
+  char magic[16];		/* REPORT_MAGIC, padded with NULs */
+  unsigned layout;		/* REPORT_LAYOUT */
+  unsigned word_mode;		/* if items are words rather than lines */
+  unsigned long long inputs;	/* number of reported inputs */
+  unsigned long long clusters;	/* number of reported clusters */
+  unsigned long long members;	/* number of reported members */
+  unsigned long long mergings;	/* number of reported mergings */
+  unsigned long long names_length; /* length of all file names */
+};
+
+struct report_input
+{
+  unsigned long long name_offset; /* offset of file name among names */
+  long long size;		/* file size */
+  int items;			/* number of items */
+  int lines;			/* number of lines */
+};
+
+struct report_cluster
+{
+  int first_member;		/* index of first member */
+  int members;			/* number of members */
+  int item_count;		/* size of each member, in normal items */
+  int input_count;		/* number of inputs having members */
+};
+
+struct report_member
+{
+  int cluster_number;		/* cluster index, or -1 if dropped */
+  int input_number;		/* input index */
+  int first_number;		/* number of first item, from 1 */
+  int item_count;		/* number of items, including white ones */
+  long long first_byte;		/* offset of first byte, or -1 */
+  long long byte_limit;		/* offset past last byte, or -1 */
+};
+
+struct report_merging
+{
+  unsigned flags;		/* REPORT_GROUP, REPORT_CROSS */
+  int input_number;		/* input index */
+  int member_number;		/* member index */
+};
+
+/*----------------------------------------------------------------------.
+| Describe cluster MEMBER into REPORTED, finding its byte range if the  |
+| offsets of its items were kept while studying.			|
+`----------------------------------------------------------------------*/
+
+static void
+describe_member (struct member *member, struct report_member *reported)
+{
+  struct input *input = get_reference (member->first_item).input;
+  int first = member->first_item - input->first_item;
+  int last = first + real_member_size (member) - 1;
+
+  reported->cluster_number = member->cluster_number;
+  reported->input_number = input - input_array;
+  reported->first_number = first + 1;
+  reported->item_count = real_member_size (member);
+  reported->first_byte = -1;
+  reported->byte_limit = -1;
+
+  if (input->item_offset)
+    {
+      reported->first_byte = input->item_offset[first];
+      if (word_mode)
+	reported->byte_limit
+	  = input->item_offset[last] + input->item_length[last];
+      else if (input->first_item + last + 1 < input->item_limit)
+	reported->byte_limit = input->item_offset[last + 1];
+      else
+	reported->byte_limit = input->stat_buffer.st_size;
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Count how many inputs have members still in CLUSTER.  Members are  |
+| sorted by position, so those of a same input are next to each      |
+| other.							     |
+`-------------------------------------------------------------------*/
+
+static int
+count_cluster_inputs (struct cluster *cluster)
+{
+  struct member *member;
+  struct input *input;
+  struct input *previous = NULL;
+  int count = 0;
+
+  for (member = member_array + cluster->first_member;
+       member < MEMBER_LIMIT (cluster); member++)
+    {
+      if (member->cluster_number < 0)
+	continue;
+
+      input = get_reference (member->first_item).input;
+      if (input != previous)
+	count++;
+      previous = input;
+    }
+  return count;
+}
+
+/*-------------------------------------------------------------.
+| Pad the binary report after a block of LENGTH bytes, so the  |
+| next block starts on an 8 bytes boundary.		       |
+`-------------------------------------------------------------*/
+
+static void
+pad_binary_report (size_t length)
+{
+  static const char zeroes[8];
+
+  fwrite (zeroes, INDEX_ALIGN (length) - length, 1, output_file);
+}
+
+/*------------------------------------.
+| Write clusters as a binary report.  |
+`------------------------------------*/
+
+static void
+output_binary_report (void)
+{
+  struct report_header header;
+  struct report_input reported_input;
+  struct report_cluster reported_cluster;
+  struct report_member reported_member;
+  struct report_merging reported_merging;
+  unsigned long long names_length = 0;
+  struct input *input;
+  struct cluster *cluster;
+  struct member *member;
+  struct merging *merging;
+
+  for (input = input_array; input < input_array + inputs; input++)
+    names_length += strlen (input->file_name) + 1;
+
+  memset (&header, 0, sizeof header);
+  strcpy (header.magic, REPORT_MAGIC);
+  header.layout = REPORT_LAYOUT;
+  header.word_mode = word_mode;
+  header.inputs = inputs;
+  header.clusters = clusters;
+  header.members = members;
+  header.mergings = mergings;
+  header.names_length = names_length;
+  fwrite (&header, sizeof header, 1, output_file);
+
+  names_length = 0;
+  for (input = input_array; input < input_array + inputs; input++)
+    {
+      memset (&reported_input, 0, sizeof reported_input);
+      reported_input.name_offset = names_length;
+      reported_input.size = input->stat_buffer.st_size;
+      reported_input.items = input->item_limit - input->first_item;
+      reported_input.lines = input->line_count;
+      fwrite (&reported_input, sizeof reported_input, 1, output_file);
+      names_length += strlen (input->file_name) + 1;
+    }
+
+  for (cluster = cluster_array; cluster < cluster_array + clusters; cluster++)
+    {
+      reported_cluster.first_member = cluster->first_member;
+      reported_cluster.members = MEMBERS (cluster);
+      reported_cluster.item_count = cluster->item_count;
+      reported_cluster.input_count = count_cluster_inputs (cluster);
+      fwrite (&reported_cluster, sizeof reported_cluster, 1, output_file);
+    }
+
+  for (member = member_array; member < member_array + members; member++)
+    {
+      memset (&reported_member, 0, sizeof reported_member);
+      describe_member (member, &reported_member);
+      fwrite (&reported_member, sizeof reported_member, 1, output_file);
+    }
+
+  for (merging = merging_array; merging < merging_array + mergings;
+       merging++)
+    {
+      reported_merging.flags = ((merging->group_flag ? REPORT_GROUP : 0)
+				| (merging->cross_flag ? REPORT_CROSS : 0));
+      reported_merging.input_number = merging->input_number;
+      reported_merging.member_number = merging->member_number;
+      fwrite (&reported_merging, sizeof reported_merging, 1, output_file);
+    }
+  pad_binary_report (mergings * sizeof (struct report_merging));
+
+  for (input = input_array; input < input_array + inputs; input++)
+    fwrite (input->file_name, strlen (input->file_name) + 1, 1, output_file);
+  pad_binary_report (names_length);
+}
+
+/*---------------------------------------------------.
+| Write STRING as a JSON string, quoting as needed.  |
+`---------------------------------------------------*/
+
+static void
+output_json_string (const char *string)
+{
+  const char *cursor;
+
+  putc ('"', output_file);
+  for (cursor = string; *cursor; cursor++)
+    if (*cursor == '"' || *cursor == '\\')
+      fprintf (output_file, "\\%c", *cursor);
+    else if ((unsigned char) *cursor < ' ')
+      fprintf (output_file, "\\u%04x", (unsigned char) *cursor);
+    else
+      putc (*cursor, output_file);
+  putc ('"', output_file);
+}
+
+/*-----------------------------------------------.
+| Write clusters as JSON objects, one per line.  |
+`-----------------------------------------------*/
+
+static void
+output_jsonl_report (void)
+{
+  struct report_member reported_member;
+  struct input *input;
+  struct cluster *cluster;
+  struct member *member;
+  struct merging *merging;
+
+  for (input = input_array; input < input_array + inputs; input++)
+    {
+      fprintf (output_file, "{\"type\": \"input\", \"input\": %d, \"name\": ",
+	       (int) (input - input_array));
+      output_json_string (input->file_name);
+      fprintf (output_file, ", \"size\": %lld, \"items\": %d, \
+\"lines\": %d}\n",
+	       (long long) input->stat_buffer.st_size,
+	       input->item_limit - input->first_item, input->line_count);
+    }
+
+  for (cluster = cluster_array; cluster < cluster_array + clusters; cluster++)
+    fprintf (output_file, "{\"type\": \"cluster\", \"cluster\": %d, \
+\"first_member\": %d, \"members\": %d, \"items\": %d, \"inputs\": %d}\n",
+	     (int) (cluster - cluster_array), cluster->first_member,
+	     MEMBERS (cluster), cluster->item_count,
+	     count_cluster_inputs (cluster));
+
+  for (member = member_array; member < member_array + members; member++)
+    {
+      describe_member (member, &reported_member);
+      fprintf (output_file, "{\"type\": \"member\", \"member\": %d, \
+\"cluster\": %d, \"input\": %d, \"first\": %d, \"items\": %d, \
+\"first_byte\": %lld, \"byte_limit\": %lld}\n",
+	       (int) (member - member_array), reported_member.cluster_number,
+	       reported_member.input_number, reported_member.first_number,
+	       reported_member.item_count, reported_member.first_byte,
+	       reported_member.byte_limit);
+    }
+
+  for (merging = merging_array; merging < merging_array + mergings;
+       merging++)
+    fprintf (output_file, "{\"type\": \"merging\", \"merging\": %d, \
+\"input\": %d, \"member\": %d, \"group\": %s, \"cross\": %s}\n",
+	     (int) (merging - merging_array), (int) merging->input_number,
+	     merging->member_number, merging->group_flag ? "true" : "false",
+	     merging->cross_flag ? "true" : "false");
+}
+
+/*---------------------------------------------------------.
+| Report clusters, members and mergings in REPORT_FORMAT.  |
+`---------------------------------------------------------*/
+
+static void
+output_report (void)
+{
+  if (report_format == BINARY_REPORT)
+    output_binary_report ();
+  else
+    output_jsonl_report ();
+
+  if (fflush (output_file) != 0 || ferror (output_file))
+    error (EXIT_ERROR, errno, _("write error"));
+}
+
+/* Repetitions.  */
+
+/* With --repetitions, clusters are merely reported as repeated blocks,
+   each with all its locations, most bytes saved first, as if all copies
+   but one were removed.  Only sorting and clustering are needed, which
+   suits very large inputs.  Overlapping members of a cluster, as found
+   in periodic text, only count once.  */
+
+struct repetition
+{
+  int cluster_number;		/* cluster index */
+  int count;			/* number of non-overlapping members */
+  long long saved;		/* bytes saved if only one was kept */
+};
+
+/*---------------------------------------------------------------.
+| Compare two repetitions for decreasing savings, then position. |
+`---------------------------------------------------------------*/
+
+static int
+compare_for_repetitions (const void *void_first, const void *void_second)
+{
+  const struct repetition *first = (const struct repetition *) void_first;
+  const struct repetition *second = (const struct repetition *) void_second;
+
+  if (first->saved != second->saved)
+    return first->saved < second->saved ? 1 : -1;
+  return first->cluster_number - second->cluster_number;
+}
+
+/*-------------------------------------------------------------------.
+| Report each repeated block once, with all its locations, ordered   |
+| by decreasing bytes saved.					     |
+`-------------------------------------------------------------------*/
+
+static void
+report_repetitions (void)
+{
+  struct repetition *repetition_array;
+  struct repetition *repetition;
+  int repetitions_found = 0;
+  long long total_saved = 0;
+  struct report_member reported;
+  struct cluster *cluster;
+  struct member *member;
+  long long limit;
+  long long length;
+
+  repetition_array = (struct repetition *)
+    xmalloc (clusters * sizeof (struct repetition));
+
+  for (cluster = cluster_array; cluster < cluster_array + clusters; cluster++)
+    {
+      repetition = repetition_array + repetitions_found;
+      repetition->cluster_number = cluster - cluster_array;
+      repetition->count = 0;
+      repetition->saved = 0;
+      limit = -1;
+      length = 0;
+
+      /* Members are sorted by position, so an overlapping member always
+	 follows the one it overlaps.  */
+
+      for (member = member_array + cluster->first_member;
+	   member < MEMBER_LIMIT (cluster); member++)
+	if (member->first_item >= limit)
+	  {
+	    describe_member (member, &reported);
+	    limit = member->first_item + real_member_size (member);
+	    if (reported.first_byte >= 0)
+	      length = reported.byte_limit - reported.first_byte;
+	    if (repetition->count++ > 0)
+	      repetition->saved += length;
+	  }
+
+      if (repetition->count > 1)
+	{
+	  total_saved += repetition->saved;
+	  repetitions_found++;
+	}
+    }
+
+  qsort (repetition_array, repetitions_found, sizeof (struct repetition),
+	 compare_for_repetitions);
+
+  for (repetition = repetition_array;
+       repetition < repetition_array + repetitions_found; repetition++)
+    {
+      cluster = cluster_array + repetition->cluster_number;
+      if (word_mode)
+	printf (ngettext ("Block of %d word", "Block of %d words",
+			  cluster->item_count), cluster->item_count);
+      else
+	printf (ngettext ("Block of %d line", "Block of %d lines",
+			  cluster->item_count), cluster->item_count);
+      printf (ngettext (", found %d time", ", found %d times",
+			repetition->count), repetition->count);
+      printf (_(", %lld bytes saved\n"), repetition->saved);
+
+      for (member = member_array + cluster->first_member;
+	   member < MEMBER_LIMIT (cluster); member++)
+	{
+	  describe_member (member, &reported);
+	  if (reported.item_count > 1)
+	    printf ("  %s:%d-%d\n",
+		    input_array[reported.input_number].file_name,
+		    reported.first_number,
+		    reported.first_number + reported.item_count - 1);
+	  else
+	    printf ("  %s:%d\n", input_array[reported.input_number].file_name,
+		    reported.first_number);
+	}
+    }
+  fflush (stdout);
+
+  if (verbose)
+    {
+      fprintf (stderr, _("Repetition summary:"));
+      fprintf (stderr, ngettext (" %d repeated block,",
+				 " %d repeated blocks,",
+				 repetitions_found), repetitions_found);
+      fprintf (stderr, _(" %lld bytes saved\n"), total_saved);
+    }
+
+  free (repetition_array);
+}
+
+/* Statistics output.  */
+
+/*--------------------------------------------------------------------.
+| Output NAME with VALUE seconds, as a JSON member.  Decimals are     |
+| written by hand, as the locale might not use a period.	      |
+`--------------------------------------------------------------------*/
+
+static void
+output_json_seconds (const char *name, double value)
+{
+  long long micros = value * 1e6 + 0.5;
+
+  fprintf (stderr, "\"%s\": %lld.%06lld", name, micros / 1000000,
+	   micros % 1000000);
+}
+
+/*----------------------------------------------------------------.
+| Report statistics on standard error, as a single JSON object.   |
+`----------------------------------------------------------------*/
+
+static void
+output_stats (void)
+{
+  struct input *input;
+  struct rusage usage;
+  long long bytes_read = 0;
+  double wall;
+  double cpu;
+  int counter;
+
+  if (!stats_json)
+    return;
+
+  wall = stats_clock (&cpu);
+  getrusage (RUSAGE_SELF, &usage);
+  for (input = input_array; input < input_array + inputs; input++)
+    bytes_read += input->bytes_read;
+
+  fprintf (stderr, "{\n  \"inputs\": %d,\n", inputs);
+  fprintf (stderr, "  \"items\": %d,\n", items > 0 ? items - inputs - 1 : 0);
+  fprintf (stderr, "  \"clusters\": %d,\n", clusters);
+  fprintf (stderr, "  \"members\": %d,\n", members);
+  fprintf (stderr, "  \"indirects\": %d,\n", indirects);
+  fprintf (stderr, "  \"mergings\": %d,\n", mergings);
+  fprintf (stderr, "  \"workers\": %d,\n", workers);
+  fprintf (stderr, "  \"bytes_read\": %lld,\n", bytes_read);
+  fprintf (stderr, "  \"peak_rss_kb\": %ld,\n", (long) usage.ru_maxrss);
+
+  fputs ("  \"phases\": {\n", stderr);
+  for (counter = 0; counter < PHASES; counter++)
+    {
+      fprintf (stderr, "    \"%s\": {", phase_name_array[counter]);
+      output_json_seconds ("wall", phase_wall_array[counter]);
+      fputs (", ", stderr);
+      output_json_seconds ("cpu", phase_cpu_array[counter]);
+      fputs (counter < PHASES - 1 ? "},\n" : "}\n", stderr);
+    }
+  fputs ("  },\n  \"total\": {", stderr);
+  output_json_seconds ("wall", wall - first_wall);
+  fputs (", ", stderr);
+  output_json_seconds ("cpu", cpu - first_cpu);
+  fputs ("},\n", stderr);
+
+  fprintf (stderr, "  \"comparisons\": {\"checksum_runs\": %llu, \
+\"doubling\": %llu, \"grams\": %llu},\n",
+	   checksum_run_comparisons, doubling_comparisons, gram_comparisons);
+
+  /* Only the main arrays are accounted, as allocated.  */
+
+  fprintf (stderr, "  \"allocated\": {\"items\": %lld, \"clusters\": %lld, \
+\"members\": %lld, \"indirects\": %lld, \"mergings\": %lld}\n}\n",
+	   (long long) items * sizeof (ITEM),
+	   (long long) allocated_clusters * sizeof (struct cluster),
+	   (long long) allocated_members * sizeof (struct member),
+	   (long long) indirects * sizeof (int),
+	   (long long) indirects * sizeof (struct merging));
+}
+
 /* Main control.  */
 
 /*-----------------------------------------------.
@@ -3778,15 +9362,37 @@ Usage: %s [OPTION]... [FILE]...\n"),
       fputs (_("\nOperation modes:\n"), stdout);
       fputs (_("  -h                     (ignored)\n"), stdout);
       fputs (_("  -v, --verbose          report a few statistics on stderr\n"), stdout);
+      fputs (_("      --stats=json       report timings and counts on stderr, as JSON\n"), stdout);
+      fputs (_("  -H, --speed-large-files  go faster, for large inputs, with coarser output\n"), stdout);
+      fputs (_("  -q, --brief            only tell which files differ from the first\n"), stdout);
+      fputs (_("  -s, --report-identical-files  tell which files are the same as the first\n"), stdout);
+      fputs (_("      --near-duplicates[=PERCENT]  only tell which files look much alike\n"), stdout);
+      fputs (_("      --repetitions      only report blocks repeated within FILEs\n"), stdout);
+      fputs (_("      --report=FORMAT    write clusters for programs, binary or jsonl\n"), stdout);
+      fputs (_("      --index=FILE       reuse and save study results in FILE\n"), stdout);
+      fputs (_("      --build-shard=FILE  only study FILEs and save a shard in FILE\n"), stdout);
+      fputs (_("      --merge-shards     compare files from the shards given as operands\n"), stdout);
       fputs (_("      --help             display this help then exit\n"), stdout);
       fputs (_("      --version          display program version then exit\n"), stdout);
 
       fputs (_("\nFormatting output:\n"), stdout);
       fputs (_("  -T, --initial-tab       produce TAB instead of initial space\n"), stdout);
       fputs (_("  -l, --paginate          paginate output through `pr'\n"), stdout);
-      fputs (_("  -S, --string[=STRING]   take note of another user STRING\n"), stdout);
+      fputs (_("  -Z, --string[=STRING]   take note of another user STRING\n"), stdout);
       fputs (_("  -V, --show-links        give file and line references in annotations\n"), stdout);
       fputs (_("  -t, --expand-tabs       expand tabs to spaces in the output\n"), stdout);
+      fputs (_("  -c, -C NUM, --context[=NUM]  output a context diff, two files only\n"), stdout);
+      fputs (_("  -u, -U NUM, --unified[=NUM]  output a unified diff, two files only\n"), stdout);
+      fputs (_("      --horizon-lines=NUM  keep NUM (default 3) lines of context\n"), stdout);
+      fputs (_("  -p, --show-c-function   show which C function each hunk is in\n"), stdout);
+      fputs (_("  -F, --show-function-line=RE  show the last line matching RE before hunks\n"), stdout);
+
+      fputs (_("\nComparing directories:\n"), stdout);
+      fputs (_("  -r, --recursive              read all files found below directories\n"), stdout);
+      fputs (_("  -x, --exclude=PAT            skip files and directories matching PAT\n"), stdout);
+      fputs (_("  -X, --exclude-from=FILE      skip those matching any pattern in FILE\n"), stdout);
+      fputs (_("  -S, --starting-file=FILE     skip files sorting before FILE\n"), stdout);
+      fputs (_("  -N, --new-file               consider missing files to be empty\n"), stdout);
 
 #if DEBUGGING
       fputs (_("\nDebugging:\n"), stdout);
@@ -3833,6 +9439,7 @@ Usage: %s [OPTION]... [FILE]...\n"),
       fputs (_("\nClustering:\n"), stdout);
       fputs (_("  -G, --relist-files         list all input files with annotations\n"), stdout);
       fputs (_("  -J, --minimum-size=ITEMS   ignore clusters not having that many ITEMS\n"), stdout);
+      fputs (_("      --tolerance=ITEMS      allow that many mismatched ITEMS in clusters\n"), stdout);
       fputs (_("  -j, --ignore-delimiters    do not count items having only delimiters\n"), stdout);
       ***/
       /***
@@ -4023,6 +9630,11 @@ main (int argc, char *const *argv)
   bindtextdomain (PACKAGE, LOCALEDIR);
   textdomain (PACKAGE);
 
+  /* Regexps keep the Emacs syntax, yet accept character classes, as the
+     character tables built for simple -O expressions do.  */
+
+  re_syntax_options = RE_SYNTAX_EMACS | RE_CHAR_CLASSES;
+
   /* Decode command options.  */
 
   while (option_char = getopt_long (argc, (char **) argv, OPTION_STRING,
@@ -4071,7 +9683,6 @@ main (int argc, char *const *argv)
 
       case 'F':
 	show_function_line = optarg;
-	UNIMPLEMENTED ("--show-function-line");
 	break;
 
       case 'G':
@@ -4080,15 +9691,20 @@ main (int argc, char *const *argv)
 
       case 'H':
 	speed_large_files = 1;
-	UNIMPLEMENTED ("--speed-large-files");
 	break;
 
       case 'I':
 	if (ignore_regexps % 8 == 0)
-	  ignore_regexp_array = (struct re_pattern_buffer **)
-	    xrealloc (ignore_regexp_array,
-		      ((ignore_regexps + 8)
-		       * sizeof (struct re_pattern_buffer *)));
+	  {
+	    ignore_regexp_array = (struct re_pattern_buffer **)
+	      xrealloc (ignore_regexp_array,
+			((ignore_regexps + 8)
+			 * sizeof (struct re_pattern_buffer *)));
+	    ignore_string_array = (const char **)
+	      xrealloc (ignore_string_array,
+			(ignore_regexps + 8) * sizeof (const char *));
+	  }
+	ignore_string_array[ignore_regexps] = optarg;
 	ignore_regexp_array[ignore_regexps++]
 	  = alloc_and_compile_regex (optarg);
 	break;
@@ -4104,12 +9720,12 @@ main (int argc, char *const *argv)
 
       case 'N':
 	new_file = 1;
-	UNIMPLEMENTED ("--new-file");
 	break;
 
       case 'O':
-	UNIMPLEMENTED ("--compare-words");
 	item_regexp = alloc_and_compile_regex (optarg);
+	item_regexp_string = optarg;
+	word_mode = 1;
 	break;
 
       case 'P':
@@ -4127,7 +9743,6 @@ main (int argc, char *const *argv)
 
       case 'S':
 	starting_file = optarg;
-	UNIMPLEMENTED ("--starting-file");
 	break;
 
       case 'T':
@@ -4143,8 +9758,7 @@ main (int argc, char *const *argv)
 	break;
 
       case 'X':
-	exclude_from = optarg;
-	UNIMPLEMENTED ("--exclude-from");
+	add_exclude_file (optarg);
 	break;
 
       case 'Y':
@@ -4167,7 +9781,6 @@ main (int argc, char *const *argv)
 
       case 'C':
       case 'c':
-	UNIMPLEMENTED ("--context");
 	if (optarg)
 	  horizon_lines = atoi (optarg);
 	context = 1;
@@ -4223,29 +9836,25 @@ main (int argc, char *const *argv)
 
       case 'p':
 	show_c_function = 1;
-	UNIMPLEMENTED ("--show-c-function");
 	break;
 
       case 'q':
 	brief = 1;
-	UNIMPLEMENTED ("--brief");
 	break;
 
       case 'r':
 	recursive = 1;
-	UNIMPLEMENTED ("--recursive");
 	break;
 
-#if FIXME
       case 's':
 	report_identical_files = 1;
-	UNIMPLEMENTED ("--report-identical-files");
 	break;
-#endif
 
       case TOLERANCE_OPTION:	/* mdiff draft */
-	UNIMPLEMENTED ("--tolerance");
 	tolerance = atoi (optarg);
+	if (tolerance < 0)
+	  error (EXIT_ERROR, 0, _("%s: tolerance should not be negative"),
+		 optarg);
 	break;
 
       case 't':
@@ -4255,7 +9864,6 @@ main (int argc, char *const *argv)
 
       case 'U':
       case 'u':
-	UNIMPLEMENTED ("--unified");
 	if (optarg)
 	  horizon_lines = atoi (optarg);
 	unified = 1;
@@ -4277,8 +9885,7 @@ main (int argc, char *const *argv)
 #endif
 
       case 'x':
-	exclude = optarg;
-	UNIMPLEMENTED ("--exclude");
+	add_exclude (optarg);
 	break;
 
       case 'y':
@@ -4306,7 +9913,45 @@ main (int argc, char *const *argv)
 
       case HORIZON_LINES_OPTION:
 	horizon_lines = atoi (optarg);
-	UNIMPLEMENTED ("--horizon-lines");
+	break;
+
+      case INDEX_OPTION:
+	index_name = optarg;
+	break;
+
+      case BUILD_SHARD_OPTION:
+	shard_name = optarg;
+	break;
+
+      case MERGE_SHARDS_OPTION:
+	merge_shards = 1;
+	break;
+
+      case REPETITIONS_OPTION:
+	repetitions = 1;
+	break;
+
+      case REPORT_OPTION:
+	if (strcmp (optarg, "binary") == 0)
+	  report_format = BINARY_REPORT;
+	else if (strcmp (optarg, "jsonl") == 0)
+	  report_format = JSONL_REPORT;
+	else
+	  error (EXIT_ERROR, 0, _("%s: report should be binary or jsonl"),
+		 optarg);
+	break;
+
+      case STATS_OPTION:
+	if (strcmp (optarg, "json") != 0)
+	  error (EXIT_ERROR, 0, _("%s: only json statistics (so far)"), optarg);
+	stats_json = 1;
+	break;
+
+      case NEAR_DUPLICATES_OPTION:
+	near_duplicates = optarg ? atoi (optarg) : 50;
+	if (near_duplicates < 1 || near_duplicates > 100)
+	  error (EXIT_ERROR, 0, _("%s: percentage should be from 1 to 100"),
+		 optarg);
 	break;
 
       case LEFT_COLUMN_OPTION:
@@ -4331,9 +9976,22 @@ main (int argc, char *const *argv)
       }
 
   if (minimum_size < 0)
-    minimum_size = relist_files ? (word_mode ? 10 : 5) : 1;
+    minimum_size = relist_files || repetitions ? (word_mode ? 10 : 5) : 1;
+
+  if (shard_name && merge_shards)
+    error (EXIT_ERROR, 0, _("cannot both build and merge shards"));
+  if (merge_shards && index_name)
+    error (EXIT_ERROR, 0, _("cannot use an index while merging shards"));
+
+  if (tolerance > 0 && !relist_files && !shard_name && !near_duplicates
+      && !repetitions)
+    {
+      error (0, 0, _("tolerant matches for -G only (so far)"));
+      usage (EXIT_ERROR);
+    }
 
-  if (!relist_files && word_mode && argc - optind != 2)
+  if (!relist_files && word_mode && !shard_name && !merge_shards
+      && !near_duplicates && !repetitions && argc - optind != 2)
     {
       error (0, 0, _("word merging for two files only (so far)"));
       usage (EXIT_ERROR);
@@ -4366,13 +10024,49 @@ Written by Franc,ois Pinard <pinard@iro.umontreal.ca>.\n"), stdout);
   if (show_help)
     usage (EXIT_SUCCESS);
 
+  prepare_ignore_regexps ();
+  if (show_c_function && !show_function_line)
+    show_function_line = C_FUNCTION_REGEXP;
+  if (show_function_line)
+    function_regexp = alloc_and_compile_regex (show_function_line);
+  if (word_mode)
+    prepare_item_tables ();
+
+  /* Context and unified diffs ask for stricter matching while studying,
+     so shards to be merged into such diffs should be built likewise.  */
+
+  if ((context || unified) && !relist_files && !brief && !near_duplicates
+      && !repetitions && report_format == NO_REPORT)
+    diff_hunks = 1;
+
   /* Register all input files.  */
 
-  if (optind == argc)
+  if (merge_shards)
+    {
+      if (optind == argc)
+	error (EXIT_ERROR, 0, _("no shards to merge"));
+      load_shards (argc - optind, argv + optind);
+      if (!relist_files && word_mode && !near_duplicates && !repetitions
+	  && inputs != 2)
+	{
+	  error (0, 0, _("word merging for two files only (so far)"));
+	  usage (EXIT_ERROR);
+	}
+    }
+  else if (optind == argc)
     new_input ("-");
   else
     while (optind < argc)
-      new_input (argv[optind++]);
+      new_input_or_tree (argv[optind++]);
+
+  if (inputs == 0)
+    error (EXIT_ERROR, 0, _("no files to compare"));
+
+  if (diff_hunks && (word_mode || (inputs != 2 && !shard_name)))
+    {
+      error (0, 0, _("context and unified diffs for two files of lines only"));
+      usage (EXIT_ERROR);
+    }
 
   /* Save some option values.  */
 
@@ -4395,28 +10089,94 @@ Written by Franc,ois Pinard <pinard@iro.umontreal.ca>.\n"), stdout);
 	error (0, 0, _("options -123RSYZ meaningful only when two inputs"));
     }
 
-  /* Do all the crunching.  */
+  /* Standard output gets its buffer before anything is written to it.  */
+
+  buffer_output_file (stdout);
+
+  /* Do all the crunching.  When only brief output is wanted, inputs are
+     compared as wholes, and clusters are not needed.  */
+
+  if (stats_json)
+    {
+      first_wall = stats_clock (&first_cpu);
+      last_wall = first_wall;
+      last_cpu = first_cpu;
+    }
+
+  decide_workers ();
+  if (brief || report_identical_files)
+    {
+      int items_only = comparing_items ();
+
+      if (items_only)
+	study_all_inputs ();
+      else
+	run_in_parallel (hash_job, inputs);
+      report_whole_inputs (items_only);
+      if (brief)
+	{
+	  end_phase (PHASE_STUDY);
+	  output_stats ();
+	  exit (exit_status);
+	}
+      if (!items_only)
+	study_all_inputs ();
+    }
+  else
+    study_all_inputs ();
+  end_phase (PHASE_STUDY);
+
+  if (shard_name)
+    {
+      save_shard ();
+      end_phase (PHASE_SORT);
+      output_stats ();
+      exit (EXIT_SUCCESS);
+    }
+
+  if (near_duplicates)
+    {
+      report_near_duplicates ();
+      output_stats ();
+      exit (exit_status);
+    }
 
-  study_all_inputs ();
   prepare_clusters ();
+
+  if (repetitions)
+    {
+      report_repetitions ();
+      end_phase (PHASE_RELISTING);
+      output_stats ();
+      exit (exit_status);
+    }
+
   prepare_indirects ();
-  if (!relist_files)
+  end_phase (PHASE_INDIRECTS);
+  if (!relist_files || report_format != NO_REPORT)
     prepare_mergings ();
+  end_phase (PHASE_MERGINGS);
 
   /* Output results.  */
 
   output_file = stdout;
 
-  if (relist_files)
+  if (report_format != NO_REPORT)
+    output_report ();
+  else if (relist_files)
     relist_annotated_files ();
+  else if (diff_hunks)
+    relist_diff_hunks (unified);
   else if (context)
     relist_merged_lines (0, 1);
   else if (unified)
     relist_merged_lines (1, 1);
   else if (word_mode)
     relist_merged_words ();
+  end_phase (PHASE_RELISTING);
 
   /* Clean up.  */
 
+  output_stats ();
   exit (exit_status);
 }